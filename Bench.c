@@ -0,0 +1,634 @@
+/*
+--------------------------------
+|      Web Crawler: Benchmarks  |
+--------------------------------
+
+[make bench] builds this file and runs it. It includes Crawl.c with CRAWL_NO_MAIN, so
+it can call the crawler's own functions, and does two things:
+
+    1) Microbenchmarks
+       ---------------
+        parseHTML(), parseHTMLElements(), the streaming sitemap parser (sitemap_feed(),
+        which replaced the old XML DOM pass) and write_callback() with the stream
+        parser attached, each run over the checked-in output.html fixture, or over a
+        generated sitemap for the sitemap parser. Reported as microseconds per call and
+        MB/s.
+
+    2) End to end
+       ----------
+        A forked child serves a synthetic web on 127.0.0.1: a tree of pages with a
+        configurable fan-out, depth and page size, optional per-request latency,
+        injected 500 errors and a sitemap. Another forked child runs the real crawler
+        (run_crawler(), so execute_crawl() workers unless -a is passed through) against
+        it with metrics on and reports pages/s, MB/s, p50/p99 fetch-to-parse latency
+        and peak RSS. Forking keeps the server's work and memory out of the numbers.
+
+Usage: ./bench.out [bench options] [-- crawler options]
+
+    --fanout=N       links per page (default 8)
+    --depth=N        levels below the root page (default 4)
+    --page-kb=N      size of each page (default 16)
+    --latency-ms=N   delay before every response (default 0)
+    --error-rate=P   fraction of pages answered with 500 (default 0)
+    --sitemaps       advertise a sitemap of the deepest level in robots.txt
+    --iterations=N   calls per microbenchmark (default 200)
+    --micro-only / --e2e-only
+*/
+
+#define CRAWL_NO_MAIN
+#include "Crawl.c"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+
+typedef struct site_shape{
+    int fanout;
+    int depth;
+    int page_bytes;
+    int latency_ms;
+    double error_rate;
+    bool sitemaps;
+} site_shape;
+
+static site_shape site = { 8, 4, 16 * 1024, 0, 0.0, false };
+
+
+
+/*
+-----------------------------------------
+|          Synthetic web server         |
+-----------------------------------------
+Pages are /p/<level>/<index>.html; page i of level d links to pages i*fanout ..
+i*fanout + fanout - 1 of level d + 1, and back to the root, so the crawler also sees
+links it already knows. Everything is derived from the path, so every run serves the
+same site. One thread per connection, with keep-alive, like a small origin server.
+*/
+
+static long level_size(int level){
+
+    long n = 1;
+
+    for(int i = 0; i < level; i++){
+        n *= site.fanout;
+    }
+
+    return n;
+}
+
+
+//Deterministic filler: words drawn from a fixed vocabulary by a generator seeded with the page.
+static size_t fill_text(char *out, size_t size, uint64_t seed){
+
+    static const char *words[] = { "crawler", "frontier", "latency", "about", "socket", "buffer", "parser",
+                                   "segment", "harbor", "window", "lantern", "meadow", "circuit", "orbit" };
+    size_t used = 0;
+
+    while(used + 16 < size){
+
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        used += snprintf(out + used, size - used, "%s ", words[seed % (sizeof(words) / sizeof(words[0]))]);
+    }
+
+    return used;
+}
+
+
+/*
+Builds the response for path into out.
+
+@return int: HTTP status.
+*/
+static int render(const char *path, struct mem *out, const char **type){
+
+    int level;
+    long index;
+
+    out->size = 0;
+    *type = "text/html";
+
+    if(strcmp(path, "/robots.txt") == 0){
+
+        *type = "text/plain";
+        out->size = snprintf(out->memory, out->capacity, "User-agent: *\nDisallow: /nowhere/\n%s",
+                             site.sitemaps ? "Sitemap: /sitemap.xml\n" : "");
+        return 200;
+    }
+
+    if(strcmp(path, "/sitemap.xml") == 0 && site.sitemaps){
+
+        long count = level_size(site.depth);
+
+        *type = "application/xml";
+
+        if(!reserve_body(out, (size_t) count * 64 + 256)){
+            return 500;
+        }
+
+        out->size = snprintf(out->memory, out->capacity, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                             "<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\">\n");
+
+        for(long i = 0; i < count; i++){
+            out->size += snprintf(out->memory + out->size, out->capacity - out->size,
+                                  "<url><loc>/p/%d/%ld.html</loc></url>\n", site.depth, i);
+        }
+
+        out->size += snprintf(out->memory + out->size, out->capacity - out->size, "</urlset>\n");
+        return 200;
+    }
+
+    if(strcmp(path, "/") == 0){
+        path = "/p/0/0.html";
+    }
+
+    if(sscanf(path, "/p/%d/%ld.html", &level, &index) != 2 || level < 0 || level > site.depth ||
+       index < 0 || index >= level_size(level)){
+        out->size = snprintf(out->memory, out->capacity, "<html><body>Not found</body></html>");
+        return 404;
+    }
+
+    uint64_t seed = hash_bytes(path, strlen(path));
+
+    if(site.error_rate > 0 && (seed % 10000) < site.error_rate * 10000){
+        out->size = snprintf(out->memory, out->capacity, "<html><body>Injected error</body></html>");
+        return 500;
+    }
+
+    if(!reserve_body(out, (size_t) site.page_bytes + (size_t) site.fanout * 64 + 512)){
+        return 500;
+    }
+
+    out->size = snprintf(out->memory, out->capacity, "<!doctype html><html><head><title>Page %d/%ld</title></head><body>"
+                         "<a href=\"/\">home</a><p>", level, index);
+
+    for(int k = 0; level < site.depth && k < site.fanout; k++){
+        out->size += snprintf(out->memory + out->size, out->capacity - out->size, "<a href=\"/p/%d/%ld.html\">child %d</a> ",
+                              level + 1, index * site.fanout + k, k);
+    }
+
+    out->size += snprintf(out->memory + out->size, out->capacity - out->size, "</p><p>");
+
+    if(out->size + 32 < (size_t) site.page_bytes){
+        out->size += fill_text(out->memory + out->size, site.page_bytes - out->size - 16, seed);
+    }
+
+    out->size += snprintf(out->memory + out->size, out->capacity - out->size, "</p></body></html>");
+
+    return 200;
+}
+
+
+static void * serve_connection(void *arg){
+
+    int fd = (int) (intptr_t) arg;
+    char request[8192];
+    size_t have = 0;
+    struct mem body = { NULL, 0, 0 };
+
+    if(!reserve_body(&body, 64 * 1024)){
+        close(fd);
+        return NULL;
+    }
+
+    while(1){
+
+        char *end;
+
+        //One request: everything up to the blank line. Bodies are never sent to us.
+        while((end = memmem(request, have, "\r\n\r\n", 4)) == NULL){
+
+            ssize_t n = (have < sizeof(request)) ? read(fd, request + have, sizeof(request) - have) : -1;
+
+            if(n <= 0){
+                free(body.memory);
+                close(fd);
+                return NULL;
+            }
+
+            have += n;
+        }
+
+        char path[1024] = "/";
+        sscanf(request, "GET %1023s", path);
+        bool keep_alive = (memmem(request, end - request, "onnection: close", 16) == NULL);
+
+        size_t used = end + 4 - request;
+        memmove(request, request + used, have - used);
+        have -= used;
+
+        if(site.latency_ms > 0){
+            struct timespec delay = { site.latency_ms / 1000, (site.latency_ms % 1000) * 1000000L };
+            nanosleep(&delay, NULL);
+        }
+
+        const char *type;
+        int status = render(path, &body, &type);
+        char header[256];
+        int header_len = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s\r\n",
+                                  status, status == 200 ? "OK" : "Error", type, body.size,
+                                  keep_alive ? "" : "Connection: close\r\n");
+        struct iovec iov[2] = { { header, (size_t) header_len }, { body.memory, body.size } };
+
+        if(writev(fd, iov, 2) < 0 || !keep_alive){
+            break;
+        }
+    }
+
+    free(body.memory);
+    close(fd);
+
+    return NULL;
+}
+
+
+//Server process: accepts until it is killed.
+static void run_site_server(int listen_fd){
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while(1){
+
+        int fd = accept(listen_fd, NULL, NULL);
+        pthread_t thread;
+
+        if(fd < 0){
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, 1 /* TCP_NODELAY */, &one, sizeof(one));
+
+        if(pthread_create(&thread, NULL, serve_connection, (void *) (intptr_t) fd) != 0){
+            close(fd);
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+}
+
+
+/*
+Forks the synthetic web server on a free loopback port.
+
+@return pid_t: the server's pid, or -1; port receives the port.
+*/
+static pid_t start_site_server(int *port){
+
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = 0, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length = sizeof(address);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(fd, 512) != 0 ||
+       getsockname(fd, (struct sockaddr *) &address, &length) != 0){
+        perror("bench server");
+        return -1;
+    }
+
+    *port = ntohs(address.sin_port);
+
+    pid_t pid = fork();
+
+    if(pid == 0){
+        run_site_server(fd);
+        _exit(0);
+    }
+
+    close(fd);
+
+    return pid;
+}
+
+
+
+/*
+-----------------------------------------
+|            Microbenchmarks            |
+-----------------------------------------
+*/
+
+typedef struct micro_env{
+    URLQueue *url_q;
+    struct data_list *output;
+    ac_automaton *matcher;
+    crawl_args args;
+    char *html;
+    size_t html_size;
+    char *sitemap;
+    size_t sitemap_size;
+} micro_env;
+
+
+static void report_micro(const char *name, int iterations, long elapsed_us, size_t bytes_per_call){
+
+    double per_call = (double) elapsed_us / iterations;
+
+    printf("  %-24s %8d calls %10.1f us/call %9.1f MB/s\n", name, iterations, per_call,
+           per_call > 0 ? bytes_per_call / per_call : 0.0);
+}
+
+
+static void bench_parse_html(micro_env *env, int iterations){
+
+    long started = monotonic_us();
+
+    for(int i = 0; i < iterations; i++){
+        parseHTML(env->url_q, env->html, "http://bench.invalid/output.html", 0);
+    }
+
+    report_micro("parseHTML", iterations, monotonic_us() - started, env->html_size);
+}
+
+
+static void bench_parse_elements(micro_env *env, int iterations){
+
+    long started = monotonic_us();
+
+    for(int i = 0; i < iterations; i++){
+        parseHTMLElements(env->url_q, env->output, env->html, env->matcher, "http://bench.invalid/output.html");
+    }
+
+    report_micro("parseHTMLElements", iterations, monotonic_us() - started, env->html_size);
+}
+
+
+static void bench_sitemap(micro_env *env, int iterations){
+
+    long started = monotonic_us();
+
+    for(int i = 0; i < iterations; i++){
+
+        sitemap_parser *sm = create_sitemap_parser(env->url_q, "http://bench.invalid/sitemap.xml", 0);
+
+        if(sm == NULL){
+            return;
+        }
+
+        for(size_t at = 0; at < env->sitemap_size; at += 64 * 1024){
+            size_t n = env->sitemap_size - at < 64 * 1024 ? env->sitemap_size - at : 64 * 1024;
+            sitemap_feed(sm, env->sitemap + at, n);
+        }
+
+        finish_sitemap(sm);
+        free_sitemap_parser(sm);
+    }
+
+    report_micro("sitemap_feed (parseXML)", iterations, monotonic_us() - started, env->sitemap_size);
+}
+
+
+//The download path of a page: buffering plus the stream parser, in 16KB chunks as curl would deliver them.
+static void bench_write_callback(micro_env *env, int iterations){
+
+    frontier_item item = { URL_NONE, "http://bench.invalid/output.html", 0, ITEM_PAGE, NULL };
+    long started = monotonic_us();
+
+    for(int i = 0; i < iterations; i++){
+
+        response resp;
+
+        if(!init_response(&resp, &env->args, &item)){
+            return;
+        }
+
+        for(size_t at = 0; at < env->html_size; at += 16 * 1024){
+            size_t n = env->html_size - at < 16 * 1024 ? env->html_size - at : 16 * 1024;
+            write_callback(env->html + at, 1, n, &resp);
+        }
+
+        free_response(&resp);
+    }
+
+    report_micro("write_callback (stream)", iterations, monotonic_us() - started, env->html_size);
+}
+
+
+static bool load_fixture(const char *path, char **data, size_t *size){
+
+    FILE *file = fopen(path, "rb");
+
+    if(file == NULL){
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    *size = (size_t) ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    *data = (char *) malloc(*size + 1);
+
+    if(*data == NULL || fread(*data, 1, *size, file) != *size){
+        fclose(file);
+        return false;
+    }
+
+    (*data)[*size] = '\0';
+    fclose(file);
+
+    return true;
+}
+
+
+static int run_microbenchmarks(int iterations){
+
+    micro_env env;
+
+    if(!load_fixture("output.html", &env.html, &env.html_size)){
+        printf("output.html not found; run from the repository directory.\n");
+        return 1;
+    }
+
+    //Deep enough that found links go through resolution and the seen-set, as in a crawl.
+    config.depth_limit = 100;
+    config.obey_robots = false;
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    xmlInitParser();
+    init_link_scanner();
+
+    env.url_q = (URLQueue *) aligned_alloc(CACHE_LINE, sizeof(URLQueue));
+    env.output = (struct data_list *) aligned_alloc(CACHE_LINE, sizeof(struct data_list));
+
+    //A target that is not on the page: the automaton scans everything but nothing is printed.
+    char *targets[] = { "no-such-target-in-fixture" };
+    env.matcher = compile_matcher(targets, 1, false, false);
+
+    if(env.url_q == NULL || env.output == NULL || env.matcher == NULL || !initQueue(env.url_q) || !initData(env.output)){
+        printf("Benchmark set-up failed.\n");
+        return 1;
+    }
+
+    env.args = (crawl_args) { env.url_q, env.output, "http://bench.invalid/", env.matcher };
+
+    //10,000 entries, a typical sitemap file.
+    struct mem sitemap = { NULL, 0, 0 };
+    reserve_body(&sitemap, 10000 * 80 + 256);
+    sitemap.size = snprintf(sitemap.memory, sitemap.capacity, "<?xml version=\"1.0\"?>\n<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\">\n");
+
+    for(int i = 0; i < 10000; i++){
+        sitemap.size += snprintf(sitemap.memory + sitemap.size, sitemap.capacity - sitemap.size,
+                                 "<url><loc>http://bench.invalid/s/%d.html</loc></url>\n", i);
+    }
+
+    sitemap.size += snprintf(sitemap.memory + sitemap.size, sitemap.capacity - sitemap.size, "</urlset>\n");
+    env.sitemap = sitemap.memory;
+    env.sitemap_size = sitemap.size;
+
+    printf("Microbenchmarks (output.html, %zu bytes):\n", env.html_size);
+
+    bench_parse_html(&env, iterations);
+    bench_parse_elements(&env, iterations);
+    bench_sitemap(&env, iterations / 10 > 0 ? iterations / 10 : 1);
+    bench_write_callback(&env, iterations);
+
+    return 0;
+}
+
+
+
+/*
+-----------------------------------------
+|              End to end               |
+-----------------------------------------
+*/
+
+//Crawler process: runs the crawl with its output silenced, then reports from the metrics.
+static void run_crawl_child(int port, int argc, char **argv){
+
+    char url[64], depth[16];
+    char *args[64];
+    int n = 0;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/", port);
+    snprintf(depth, sizeof(depth), "%d", site.depth);
+
+    args[n++] = "crawler";
+    args[n++] = "--host-rate=0";
+    args[n++] = "--host-connections=0";
+    args[n++] = "--stats-every=86400";      //Turns recording on; the dump goes to /dev/null with the rest.
+    args[n++] = "--log-file=/dev/null";
+
+    for(int i = 0; i < argc && n < 60; i++){
+        args[n++] = argv[i];
+    }
+
+    args[n++] = depth;
+    args[n++] = url;
+    args[n] = NULL;
+
+    int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+
+    fflush(stdout);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+
+    long started = monotonic_ms();
+    int status = run_crawler(n, args);
+    double seconds = (monotonic_ms() - started) / 1000.0;
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+
+    thread_metrics *total = (thread_metrics *) malloc(sizeof(thread_metrics));
+    struct rusage usage;
+
+    if(status != 0 || total == NULL){
+        printf("Crawl failed with status %d.\n", status);
+        exit(1);
+    }
+
+    collect_metrics(total);
+    getrusage(RUSAGE_SELF, &usage);
+
+    uint64_t pages = total->counters[COUNT_PAGES];
+    latency_histogram *page = &total->stages[STAGE_PAGE];
+
+    printf("End to end (fan-out %d, depth %d, %d KB pages, %d ms latency, %.1f%% errors%s):\n",
+           site.fanout, site.depth, site.page_bytes / 1024, site.latency_ms, site.error_rate * 100, site.sitemaps ? ", sitemap" : "");
+    printf("  %llu responses in %.2f s: %.1f pages/s, %.1f MB/s\n", (unsigned long long) pages, seconds,
+           pages / seconds, total->counters[COUNT_BYTES] / 1048576.0 / seconds);
+    printf("  fetch-to-parse p50 %.2f ms, p99 %.2f ms\n", histogram_quantile(page, 0.5) / 1000.0, histogram_quantile(page, 0.99) / 1000.0);
+    printf("  peak RSS %.1f MB\n", usage.ru_maxrss / 1024.0);
+
+    fflush(stdout);
+    exit(0);
+}
+
+
+static int run_end_to_end(int argc, char **argv){
+
+    int port, status = 1;
+    pid_t server = start_site_server(&port);
+
+    if(server < 0){
+        return 1;
+    }
+
+    pid_t crawler = fork();
+
+    if(crawler == 0){
+        run_crawl_child(port, argc, argv);
+    }
+
+    if(crawler > 0){
+        waitpid(crawler, &status, 0);
+    }
+
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+
+    return (crawler > 0 && WIFEXITED(status)) ? WEXITSTATUS(status) : 1;
+}
+
+
+int main(int argc, char *argv[]){
+
+    int iterations = 200;
+    bool micro = true, e2e = true;
+    int i;
+
+    for(i = 1; i < argc && strcmp(argv[i], "--") != 0; i++){
+
+        const char *arg = argv[i];
+
+        if(strncmp(arg, "--fanout=", 9) == 0)           site.fanout = atoi(arg + 9);
+        else if(strncmp(arg, "--depth=", 8) == 0)       site.depth = atoi(arg + 8);
+        else if(strncmp(arg, "--page-kb=", 10) == 0)    site.page_bytes = atoi(arg + 10) * 1024;
+        else if(strncmp(arg, "--latency-ms=", 13) == 0) site.latency_ms = atoi(arg + 13);
+        else if(strncmp(arg, "--error-rate=", 13) == 0) site.error_rate = atof(arg + 13);
+        else if(strcmp(arg, "--sitemaps") == 0)         site.sitemaps = true;
+        else if(strncmp(arg, "--iterations=", 13) == 0) iterations = atoi(arg + 13);
+        else if(strcmp(arg, "--micro-only") == 0)       e2e = false;
+        else if(strcmp(arg, "--e2e-only") == 0)         micro = false;
+        else {
+            printf("Unknown option %s; see the comment at the top of Bench.c.\n", arg);
+            return 1;
+        }
+    }
+
+    if(site.fanout < 1 || site.depth < 0 || site.page_bytes < 0 || iterations < 1){
+        printf("Invalid benchmark options.\n");
+        return 1;
+    }
+
+    //Everything after "--" goes to the crawler.
+    int crawler_argc = (i < argc) ? argc - i - 1 : 0;
+    char **crawler_argv = argv + (i < argc ? i + 1 : argc);
+
+    if(e2e && run_end_to_end(crawler_argc, crawler_argv) != 0){
+        return 1;
+    }
+
+    if(micro){
+        fflush(stdout);
+        return run_microbenchmarks(iterations);
+    }
+
+    return 0;
+}
@@ -54,9 +54,12 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include <curl/curl.h> 
 #include <cjson/cJSON.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -67,14 +70,147 @@
 #include <libxml/xpath.h>
 #include <libxml/tree.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <zlib.h>
+#include <limits.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <ares.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 typedef struct mem{
     char *memory; //String 
     size_t size;
+    size_t capacity;  //Bytes allocated for memory.
 } mem;
 
 
 
+//A URL interned by intern_url(); see url_string().
+typedef uint32_t url_id;
+
+#define URL_NONE UINT32_MAX
+#define URL_MAX 2048             //Longest URL we queue.
+
+
+
+//Aho-Corasick automaton compiled from every target by compile_matcher(); read-only afterwards.
+typedef struct ac_automaton{
+    int state_count;
+    int class_count;
+    uint8_t byte_class[256];   //Input byte (after case folding) to column in next.
+    int32_t *next;             //state_count * class_count transitions.
+    int32_t *out_start;        //Per state: first entry in outputs...
+    int32_t *out_count;        //...and how many patterns end in this state.
+    int32_t *outputs;
+    char **patterns;
+    size_t *lengths;
+    int pattern_count;
+    size_t max_len;
+    bool ignore_case;
+    bool whole_word;           //A hit must not have a letter, digit or '_' on either side.
+} ac_automaton;
+
+
+//One occurrence of a target on a page.
+typedef struct match_hit{
+    int pattern;
+    size_t offset;             //Where the pattern starts in the page's text.
+} match_hit;
+
+
+#define MAX_HITS_PER_PAGE 10000
+
+typedef struct match_list{
+    match_hit *hits;
+    size_t count, capacity;
+} match_list;
+
+
+//Matcher position inside one page's text, see match_stream_feed().
+typedef struct match_stream{
+    const ac_automaton *ac;
+    int32_t state;
+    size_t offset;             //Bytes of text consumed so far.
+    size_t run_start;          //Offset where the current text node began.
+    uint8_t *word_history;     //Was byte i a word character, for the last max_len + 1 bytes.
+    match_hit *pending;        //Whole-word hits still waiting to see the next byte.
+    size_t pending_count, pending_capacity;
+    match_list *hits;
+} match_stream;
+
+
+
+/*
+State of a page that is parsed while it downloads. libxml2's push parser gets every
+chunk straight from write_callback() and reports elements and text through SAX
+callbacks, so links are queued and targets are matched in a single pass,
+without ever building a DOM.
+*/
+typedef struct stream_parser{
+    htmlParserCtxtPtr ctxt;
+    struct crawl_args *args;
+    const char *url;
+    char base[URL_MAX];  //What links are resolved against: the page's URL, or its <base href>.
+    int depth;           //Depth of this page; its links are one deeper.
+    match_list hits;     //Every target occurrence on the page.
+    match_stream ms;
+    bool defer_links;    //Collect links in deferred until the page is known not to be a near duplicate.
+    struct mem deferred; //Resolved links, each NUL terminated.
+} stream_parser;
+
+
+
+//What a page fetch needs for the validator cache: the validators sent and received, and what parsing the page found.
+typedef struct page_validators{
+    char etag[256];                  //From the response, sent back as If-None-Match next time.
+    char last_modified[64];          //Sent back as If-Modified-Since.
+    struct curl_slist *conditions;   //Request headers built from the cached entry, NULL if there was none.
+    struct mem links;                //Every resolved link on the page, each NUL terminated.
+    match_list hits;
+} page_validators;
+
+
+//Everything collected while one page downloads: the body and, in stream mode, its parser.
+typedef struct response{
+    struct mem body;
+    struct mem headers;      //Raw header block of the final response, kept only for the WARC store.
+    long status;             //HTTP status once the transfer is done.
+    stream_parser *parser;   //NULL when the page is parsed after the transfer.
+    struct sitemap_parser *sitemap;   //Set for sitemaps, which are parsed as they arrive and never buffered.
+    page_validators *validators;      //Set for pages while the validator cache is on.
+    struct simhash_state *simhash;    //Set for pages while near duplicates are skipped.
+    bool robots;                      //robots.txt, which is text/plain and exempt from the type filter.
+    const char *rejected;             //Why the transfer was aborted early, NULL if it was not.
+    long parse_us;                    //Time the stream parser spent on the chunks so far.
+    long started_us;                  //When the fetch began, while metrics are on.
+    bool deferred;                    //Parsed on a parse worker after the transfer; write_callback() only buffers.
+    struct curl_slist *resolve;       //CURLOPT_RESOLVE entry from the DNS prefetch cache, NULL for none.
+} response;
+
+
+
 
 
 typedef struct URL{
@@ -84,905 +220,11327 @@ typedef struct URL{
 
 
 
+#define USER_AGENT "libcurl-agent/1.0"
+#define ROBOTS_AGENT "libcurl-agent"     //Product token we look for in robots.txt User-agent lines.
+
+#define CACHE_LINE 64
+#define SEEN_SHARDS 64
+
+/*
+One shard of a seen-set: an open-addressing table of 64-bit URL fingerprints with
+linear probing. 0 marks an empty slot, so url_fingerprint() never returns it. Each
+shard has its own lock and sits on its own cache lines, so threads inserting URLs
+that land in different shards never contend.
+*/
+typedef struct seen_shard{
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    uint64_t *slots;
+    size_t capacity;     //Power of two.
+    size_t count;
+} seen_shard;
+
+
+/*
+Blocked Bloom filter: every fingerprint maps to one 512-bit block (a single cache line)
+and sets k bits inside it, so a lookup touches one line of memory. Bits are set with
+atomic OR, which makes insert-and-test lock-free. Size is fixed at start-up, so memory 
+stays flat however many URLs the crawl discovers, at the price of a false-positive rate
+that grows as the filter fills.
+*/
+typedef struct bloom_filter{
+    _Atomic uint64_t *blocks;   //block_count * 8 words.
+    size_t block_count;
+    int k;
+    atomic_long inserted;
+} bloom_filter;
+
+
+/*
+Optional exact second tier for the Bloom filter: an open-addressing fingerprint table
+in a file, read and written with pread/pwrite so it lives in the page cache rather than
+our heap. It is split into SEEN_SHARDS partitions, each a contiguous run of slots with
+its own lock. Only consulted when the filter says "maybe seen". 
+*/
+typedef struct seen_spill{
+    int fd;
+    size_t partition_slots;
+    pthread_mutex_t locks[SEEN_SHARDS];
+    atomic_long false_positives;   //Filter hits the file showed to be new URLs.
+    atomic_long full;              //Inserts dropped because a partition was full.
+} seen_spill;
+
+
+enum seen_backend { SEEN_EXACT, SEEN_BLOOM };
+enum parser_mode  { PARSER_STREAM, PARSER_DOM, PARSER_FAST };
+
+//Concurrent set of URL fingerprints, used to drop duplicates before they are queued or output.
+typedef struct seen_set{
+    enum seen_backend backend;
+    seen_shard shards[SEEN_SHARDS];  //SEEN_EXACT
+    bloom_filter bloom;              //SEEN_BLOOM
+    seen_spill spill;                //SEEN_BLOOM with a spill file, fd is -1 otherwise.
+} seen_set;
+
+
+
 //Define a structure for a thread-safe queue to be written to.
 typedef struct data_list{
     URL *head, *tail;
     pthread_mutex_t lock;
+    seen_set seen;       //Fingerprints of URLs already in the list.
 } data_list;
 
 
 
 //Define a structure for queue elements.
+//What a frontier entry is fetched for.
+enum item_kind { ITEM_PAGE, ITEM_ROBOTS, ITEM_SITEMAP };
+
 typedef struct URLQueueNode{
-    char *html_url;
+    url_id html_url;
+    int depth;
+    enum item_kind kind;
+    struct host_entry *host;
     struct URLQueueNode *next_URL;
 } URLQueueNode;
 
 
 
-// Define a structure for a thread-safe queue.
-typedef struct URLQueue{
-    URLQueueNode *head, *tail;
-    pthread_mutex_t lock;
-} URLQueue;
-
+//One cell of the frontier ring. sequence tells producers and consumers whose turn the cell is.
+typedef struct URLQueueSlot{
+    atomic_size_t sequence;
+    url_id html_url;
+    int depth;           //Links followed from the starting URL to reach this one.
+    enum item_kind kind;
+    struct host_entry *host;
+} URLQueueSlot;
 
 
 
-void append_to_log_file(const char *message){
-    // Open the log file in append mode
-    FILE *log_file = fopen("crawler_log.txt", "a");
-
-    // Check if the file opened successfully
-    if (log_file == NULL) {
-        fprintf(stderr, "Error opening log file.\n");
-        return;
-    }
+//A URL handed to a worker: where to go, how deep it is, and whose politeness limits it counts against.
+typedef struct frontier_item{
+    url_id id;
+    const char *url;     //url_string(id), filled in when the item is dequeued.
+    int depth;
+    enum item_kind kind;
+    struct host_entry *host;
+} frontier_item;
 
-    // Append the message to the log file
-    fprintf(log_file, "%s\n", message);
 
-    // Close the log file
-    fclose(log_file);
-}
 
+//One node of a compiled robots.txt trie, see robots_add_rule().
+typedef struct robots_node{
+    int16_t label;           //Byte to match, ROBOTS_STAR or ROBOTS_END; -1 at the root.
+    int8_t  verdict;         //+1 Allow or -1 Disallow if a rule ends here, else 0.
+    int     length;          //Length of that rule; the longest matching rule wins.
+    int     first_child;
+    int     next_sibling;
+} robots_node;
 
-//URLQUEUE struct 
-struct URL * create_URL(char *url){
-  
-    struct URL *newNode = (struct URL *) malloc(sizeof(struct URL));
 
-    if (newNode == NULL) {
+typedef struct robots_rules{
+    robots_node *nodes;      //nodes[0] is the root.
+    int count;
+    int capacity;
+} robots_rules;
 
-        printf("Memory allocation failed.\n");
-        return NULL;
-    }
-    
-    newNode -> url = (char *) malloc(strlen(url) + 1); 
 
-    if(newNode->url == NULL) {
+enum robots_state { ROBOTS_NONE, ROBOTS_FETCHING, ROBOTS_READY };
 
-        printf("Memory allocation failed.\n");
-        free(newNode); // Free previously allocated memory
-        return NULL;
-    }
 
- 
-    strcpy(newNode -> url, url);
 
-    newNode -> next_URL = NULL;
+/*
+Politeness state of one host. URLs wait in head/tail until the host's token bucket
+and connection limit let them through to the frontier ring.
+*/
+typedef struct host_entry{
+    char *name;                      //"scheme://host:port", lower case.
+    uint64_t hash;
+    struct host_entry *next;         //Chain in the host table bucket.
 
-    return newNode;
-}
+    pthread_mutex_t lock;            //Guards everything below.
+    URLQueueNode *head, *tail;       //URLs waiting for this host.
+    double tokens;                   //Requests the host may take right now.
+    long   refilled_ms;              //When tokens was last topped up.
+    int    inflight;                 //Pages of this host handed out and not yet done.
 
-// Add a URL to the queue.
-void enqueue_URL(URLQueue **url_q, const char *url){
+    enum robots_state robots_state;
+    robots_rules *robots;            //Compiled robots.txt, NULL until the first one is in.
+    long   robots_expires_ms;        //When robots.txt is due to be fetched again.
+    URLQueueNode *robots_wait_head, *robots_wait_tail;   //URLs that arrived before robots.txt did.
 
-    struct URLQueueNode *newURL = (struct URLQueueNode *) malloc( sizeof(URLQueueNode) );
-    
-    newURL -> html_url = strdup(url);
-    newURL -> next_URL = NULL;
+    bool   on_wheel;                 //Parked on the timer wheel waiting for a token.
+    long   wheel_due;                //Tick (ms) it is due on.
+    struct host_entry *wheel_next;
+} host_entry;
 
-    pthread_mutex_lock(&((*url_q)->lock));
-    
-    if((*url_q) -> tail) {
 
-        (*url_q)->tail->next_URL = newURL;
-    } 
-    
-    else {
-        (*url_q) -> head = newURL;
-    }
+#define HOST_SHARDS 64
+#define WHEEL_SLOTS 1024             //1ms ticks, so one turn is about a second.
 
-    (*url_q) -> tail = newURL;
-    pthread_mutex_unlock(&((*url_q)->lock));
-}
+typedef struct host_shard{
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    host_entry **buckets;
+    size_t mask;
+    size_t count;
+} host_shard;
 
 
-bool url_exists(struct URL *URLS, const char *url){
+typedef struct host_table{
+    host_shard shards[HOST_SHARDS];
+    atomic_long hosts;
+    atomic_long throttled;           //Times a host had to wait for a token.
+    atomic_long disallowed;          //URLs dropped because of robots.txt.
 
-    struct URL *ptr = URLS;
+    pthread_mutex_t wheel_lock;      //Guards the wheel.
+    pthread_cond_t wheel_wake;
+    host_entry *wheel[WHEEL_SLOTS];
+    long wheel_tick;                 //Next tick the wheel thread will look at.
+    long wheel_count;                //Hosts on the wheel.
+    bool stopping;
+    pthread_t timer;
+} host_table;
 
-    while(ptr != NULL){
-        if(strcmp(ptr->url, url) == 0){
-            //printf("Duplicate avoided.");
-            return true;
-        }
 
-        ptr = ptr -> next_URL;
 
-    }
+/*
+Cold tail of the frontier, see spill_url(). Segments are numbered files in the state
+directory; URLs are appended to the tail segment and read back from the head one.
+*/
+typedef struct frontier_spill{
+    pthread_mutex_t lock;        //Guards the tail segment and its buffer.
+    int    tail;                 //Segment being written.
+    int    fd;                   //Its file, -1 until the first URL lands in it.
+    size_t tail_size;            //Bytes in it, buffered ones included.
+    size_t tail_flushed;         //Bytes of it known to be in the file; always a record boundary.
+    char  *buffer;
+    size_t buffered;             //Bytes not written yet; may start in the middle of a record.
+    long   buffered_records;     //URLs not wholly in the file yet.
 
-    return false;
-}
+    pthread_mutex_t refill_lock; //Guards head and head_offset; one refill at a time.
+    int    head;                 //Oldest segment with URLs still to be read.
+    size_t head_offset;          //Bytes of it already back in memory.
+    int    deleted;              //Segments below this are gone from disk.
 
-// Add a URL to the output queue.
-void append_data(struct data_list **output_q, const char *url){
+    long  *records;              //URLs still on disk in each segment, by segment number. Guarded by lock.
+    int    records_capacity;
 
-    
-    //check if URL already exists
-    if(url_exists((*output_q) -> head, url)){
-        return;
-    }
+    atomic_long count;           //URLs on disk.
+    atomic_long total;           //URLs ever spilled.
+} frontier_spill;
 
-    struct URL *newURL = (struct URL *) malloc( sizeof(URL) );
-    
-    newURL -> url = strdup(url);
-    newURL -> next_URL = NULL;
 
-    pthread_mutex_lock(&((*output_q)->lock));
 
-    if((*output_q) -> tail) {
+/*
+Define a structure for a thread-safe queue (the frontier). 
+
+URLs live in a bounded lock-free multi-producer multi-consumer ring. The enqueue and 
+dequeue positions sit on their own cache lines so producers and consumers do not 
+invalidate each other's line on every operation. If a page floods the ring, the 
+extra URLs spill into the old linked list (head/tail) under the mutex. 
+
+outstanding counts URLs that are queued or still being processed. A worker that finds
+the queue empty parks on the condition variable instead of exiting, and the crawl is 
+finished only once outstanding drops to zero: nothing queued and nobody busy who 
+could still queue more. 
+
+Every URL carries its depth, the number of links followed from the starting URL. 
+URLs deeper than max_depth are never queued. With --bfs-barrier the crawl goes one 
+level at a time: links found on level d wait in the next_head list until every 
+level d page has been processed (level_outstanding reaches zero), and only then are 
+they released to the workers, so pages are always fetched in breadth-first order.
+
+With --state-dir the frontier holds at most about --frontier-memory URLs in memory; 
+the rest wait on disk in spill, and count as outstanding like any other. pausing 
+stops workers from taking new URLs while a checkpoint is written.
+*/
+typedef struct URLQueue{
+    URLQueueSlot *slots;
+    size_t mask;
+
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+    _Alignas(CACHE_LINE) atomic_long outstanding;
+    atomic_long overflow_count;
+    atomic_int idle_workers;
+    atomic_bool finished;
+
+    _Alignas(CACHE_LINE) atomic_bool pausing;   //Read on every dequeue, written once per checkpoint.
+    atomic_int workers;                         //Crawl threads, for telling when all of them are idle.
+    atomic_long parsing;                        //Pages handed to the parse workers and not retired yet.
+
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;   //Guards the overflow list and the parking lot.
+    pthread_cond_t wake;
+    URLQueueNode *head, *tail;
 
-        (*output_q)->tail->next_URL = newURL;
-    } 
-    
-    else {
+    int  max_depth;                    //Deepest level that is fetched; the start URL is level 0.
+    bool bfs_barrier;
+    int  level;                        //Level being fetched when bfs_barrier is set.
+    atomic_long level_outstanding;     //Pages of that level queued or in progress.
+    URLQueueNode *next_head, *next_tail;   //Next level, held back until this one drains. Guarded by lock.
+    long next_count;
 
-        (*output_q) -> head = newURL;
-    }
+    seen_set seen;       //Every URL that has ever been queued, so each page is fetched once.
+    host_table hosts;    //Per-host queues that feed the ring at a polite pace.
+    frontier_spill spill;
+} URLQueue;
 
-    (*output_q) -> tail = newURL;
 
-    pthread_mutex_unlock(&((*output_q)->lock));
 
-    return;
+//Shared state handed to every crawl thread, blocking worker or event loop.
+typedef struct crawl_args{
+    struct URLQueue *url_q;
+    struct data_list *output;
+    char *url;
+    const struct ac_automaton *matcher;   //Compiled targets, shared read-only.
+} crawl_args;
+
+
+
+//Runtime options, filled in by main() from the command line.
+enum log_full_policy { LOG_DROP, LOG_BLOCK };
+
+typedef struct crawl_config{
+    int  num_threads;    //Blocking fetch workers.
+    bool async;          //Drive transfers through curl multi event loops instead of blocking workers.
+    int  event_loops;    //Event-loop threads in async mode.
+    int  max_inflight;   //Transfers a single event loop keeps in flight.
+    int  queue_size;     //Slots in the lock-free frontier ring, rounded up to a power of two.
+    int  depth_limit;    //Deepest link level that is fetched, from the command line.
+    bool bfs_barrier;    //Finish each level before starting the next.
+    double host_rate;         //Requests per second per host, 0 for no limit.
+    double host_burst;        //Requests a host may take back to back after being quiet.
+    int    host_connections;  //Pages of one host fetched at the same time, 0 for no limit.
+    bool   obey_robots;       //Fetch robots.txt for every host and skip what it disallows.
+    long   robots_ttl;        //Seconds a host's robots.txt is trusted before it is fetched again.
+    bool   follow_sitemaps;   //Queue the sitemaps that robots.txt lists.
+    char **strip_params;      //Session parameters removed from URLs on top of default_strip_params.
+    int    strip_param_count;
+    char  *state_dir;         //Spilled frontier segments and checkpoints, NULL to keep everything in memory.
+    long   frontier_memory;   //URLs the frontier keeps in memory before it spills, 0 for no limit.
+    int    checkpoint_every;  //Seconds between checkpoints, 0 for none but the last.
+    bool   resume;            //Start from the checkpoint in state_dir.
+    char  *warc_dir;          //Where fetched responses are archived as WARC, NULL for nowhere.
+    long   warc_segment_mb;   //Size at which a new WARC file is started.
+    char  *validator_cache;   //ETag, Last-Modified and links of pages from earlier runs, NULL for none.
+    int    near_duplicate_bits;  //Pages this many SimHash bits or fewer from an earlier page are skipped, -1 for none.
+    long   max_page_size;     //Bytes a body may have before its transfer is aborted, 0 for no limit.
+    int    stats_every;       //Seconds between stats dumps on stderr, 0 for none.
+    int    metrics_port;      //Local port serving Prometheus text, 0 for none.
+    bool   dns_prefetch;      //Resolve hosts with c-ares as they enter the frontier and hand curl the answers.
+    long   dns_negative_ttl;  //Seconds a name that does not exist is remembered.
+    char  *cluster_file;      //Membership of a multi-node crawl, one address per line, NULL to crawl alone.
+    char  *node_address;      //This node's line in cluster_file, which it also listens on.
+    enum parser_mode parser;          //Stream pages through SAX, the old two DOM passes, or the SIMD scanner.
+    int    parse_workers;     //Threads that parse fetched pages, 0 to parse on the fetching thread.
+    int    parse_queue;       //Fetched pages waiting for a parse worker before fetching blocks.
+
+    enum seen_backend seen_backend;   //How the frontier remembers which URLs it has queued.
+    double bloom_fpr;                 //Target false-positive rate of the Bloom filter.
+    long   bloom_items;               //URLs the filter is sized for.
+    long   bloom_memory_mb;           //Hard ceiling on the filter's size.
+    char  *seen_spill_path;           //Exact on-disk second tier, NULL to disable.
+
+    char **targets;                   //Patterns to look for in page text.
+    int    target_count;
+    bool   ignore_case;
+    bool   whole_word;
+
+    char  *log_path;                  //Structured log, appended to by the writer thread.
+    int    log_fsync_ms;              //-1 never fsync, 0 every batch, otherwise an interval.
+    enum log_full_policy log_full;    //Drop or wait when a thread's log ring is full.
+} crawl_config;
+
+//Query and path parameters that only carry a session, so the same page does not get a new URL per visit.
+static const char *default_strip_params[] = { "jsessionid", "phpsessid", "aspsessionid", "sessionid", "sid" };
+
+static crawl_config config = {
+    .num_threads = 10,
+    .async = false,
+    .event_loops = 2,
+    .max_inflight = 1000,
+    .queue_size = 65536,
+    .depth_limit = 0,
+    .bfs_barrier = false,
+    .host_rate = 20.0,
+    .host_burst = 20.0,
+    .host_connections = 6,
+    .obey_robots = true,
+    .robots_ttl = 86400,
+    .follow_sitemaps = true,
+    .strip_params = NULL,
+    .strip_param_count = 0,
+    .state_dir = NULL,
+    .frontier_memory = 1000000,
+    .checkpoint_every = 300,
+    .resume = false,
+    .warc_dir = NULL,
+    .warc_segment_mb = 1024,
+    .validator_cache = NULL,
+    .near_duplicate_bits = -1,
+    .max_page_size = 10L * 1024 * 1024,
+    .stats_every = 0,
+    .metrics_port = 0,
+    .dns_prefetch = false,
+    .dns_negative_ttl = 300,
+    .cluster_file = NULL,
+    .node_address = NULL,
+    .parser = PARSER_STREAM,
+    .parse_workers = 0,
+    .parse_queue = 256,
+    .seen_backend = SEEN_EXACT,
+    .bloom_fpr = 0.001,
+    .bloom_items = 100000000,
+    .bloom_memory_mb = 256,
+    .log_path = "crawler_log.txt",
+    .log_fsync_ms = -1,
+    .log_full = LOG_DROP,
+    .seen_spill_path = NULL,
+    .targets = NULL,
+    .target_count = 0,
+    .ignore_case = false,
+    .whole_word = false,
+};
+
+
+
+
+long monotonic_ms(void){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
 }
 
 
+/*
+-----------------------------------------
+|               Logging                 |
+-----------------------------------------
+Every thread that logs gets its own single-producer ring of fixed-size records the
+first time it calls log_event(), so logging from the fetch path is a memcpy and two
+atomic stores: no lock, no syscall. A background writer thread drains all rings,
+formats the records as one line each and appends them to crawler_log.txt with a
+single writev() per batch. The file is opened once. With --log-fsync the writer also
+fsyncs, after every batch (0) or at most every N milliseconds. When a ring is full the
+record is dropped and counted (--log-full=drop, the default) or the caller waits for 
+the writer (--log-full=block).
+*/
 
+#define LOG_RING_SIZE 512          //Records per thread, power of two.
+#define LOG_URL_MAX 384
+#define LOG_MESSAGE_MAX 160
 
+typedef struct log_record{
+    struct timespec time;
+    int code;                      //curl or errno style code, 0 if none.
+    char url[LOG_URL_MAX];
+    char message[LOG_MESSAGE_MAX];
+} log_record;
 
 
+typedef struct log_ring{
+    _Alignas(CACHE_LINE) atomic_size_t head;   //Next record the writer reads.
+    _Alignas(CACHE_LINE) atomic_size_t tail;   //Next record the owning thread writes.
+    atomic_long dropped;
+    int thread;                                //Small sequential id, printed in every line.
+    struct log_ring *next;
+    log_record records[LOG_RING_SIZE];
+} log_ring;
 
-//Remove a URL from the URLQueue.
-char* dequeue_URL(URLQueue *URLS) {
-
-    //pthread_mutex_lock(&queue->lock);
-
-    if(URLS -> head == NULL) {
-        pthread_mutex_unlock(&URLS -> lock);
-        return NULL;
-    }
 
+static struct {
+    log_ring *rings;               //Every ring ever registered; only ever grows.
+    pthread_mutex_t lock;          //Guards registration and the writer's sleep.
+    pthread_cond_t wake;
+    pthread_t writer;
+    atomic_bool running;
+    atomic_bool stopping;
+    atomic_int thread_count;
+    int fd;
+    int fsync_ms;                  //-1 never, 0 after every batch, otherwise an interval.
+    enum log_full_policy full_policy;
+} logger = { NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, false, false, 0, -1, -1, LOG_DROP };
 
-    //URLQueue is not empty.
-    URLQueueNode *temp = URLS -> head;
+static __thread log_ring *thread_log_ring = NULL;
 
-    char *url = temp -> html_url;
 
-    URLS -> head = URLS -> head -> next_URL;
+//Creates and registers the calling thread's ring.
+log_ring* register_log_ring(void){
 
-    if (URLS ->head == NULL) {
+    log_ring *ring = (log_ring *) aligned_alloc(CACHE_LINE, sizeof(log_ring));
 
-        URLS -> tail = NULL;
+    if(ring == NULL){
+        return NULL;
     }
 
-    free(temp);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->thread = atomic_fetch_add(&logger.thread_count, 1);
 
-    pthread_mutex_unlock(&URLS->lock);
+    pthread_mutex_lock(&logger.lock);
+    ring->next = logger.rings;
+    logger.rings = ring;
+    pthread_mutex_unlock(&logger.lock);
 
-    return url;
-}
+    thread_log_ring = ring;
 
+    return ring;
+}
 
 
 /*
-// Placeholder for the function to fetch and process a URL.
-
-
+Queues a structured log record. Safe to call from any thread at any time; records
+are written by the background writer once start_logger() has run. 
 
+@param int code: error code to record, 0 if none.
+@param const char *url: the URL involved, or NULL.
+@param const char *message: what happened.
 */
+void log_event(int code, const char *url, const char *message){
 
+    log_ring *ring = thread_log_ring ? thread_log_ring : register_log_ring();
 
+    if(ring == NULL){
+        return;
+    }
 
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
 
+    while(tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= LOG_RING_SIZE){
 
-/*
-Please read https://curl.se/libcurl/c/CURLOPT_WRITEFUNCTION.html#:~:text=This%20callback%20function%20gets%20called,nmemb%3B%20size%20is%20always%201.
-for a better understanding of the write_callback function and it's arguments. 
+        if(logger.full_policy == LOG_DROP || !atomic_load(&logger.running)){
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
 
-In a brief description, the write_callback() function is responsible for the transfer of data. In this case,
-between the webpage and the caller who is curl. The data being handled in this case is HTML, which comes 
-in the form of strings. We have to implement this method ourselves. 
+        pthread_cond_signal(&logger.wake);
+        sched_yield();
+    }
 
-@param *ptr: ptr to curl handler. 
-@param size_t size: size of data object being transferred. (e.g int = 4 bytes, char = 1 byte)
-@param size_t nmemb: data object total count. In this case, think of chars or strings. 
-@param void *userdata: Data container to be referenced. 
-*/
+    log_record *record = &ring->records[tail & (LOG_RING_SIZE - 1)];
 
-/*
-Checks if url is a sitemap xml. 
-*/
-bool check_ifXML(char *url){
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->code = code;
+    snprintf(record->url, sizeof(record->url), "%s", url ? url : "");
+    snprintf(record->message, sizeof(record->message), "%s", message ? message : "");
 
-    char *needle = ".xml";
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
 
-    if(strstr(url, needle) != NULL){
-        return true;
+    //Nudge the writer when a ring is getting full rather than waiting for its timer.
+    if(tail - atomic_load_explicit(&ring->head, memory_order_relaxed) == LOG_RING_SIZE * 3 / 4){
+        pthread_cond_signal(&logger.wake);
     }
-
-    //Not a sitemap url, must be a regular url. 
-    return false;
 }
 
 
-int write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+void append_to_log_file(const char *message){
 
-    size_t real_size = size * nmemb;
-    struct mem *memory_ = (struct mem *)userdata;
+    log_event(0, NULL, message);
+}
 
-    memory_->memory = realloc(memory_->memory, memory_->size + real_size + 1);
-    if(memory_->memory == NULL){
-        append_to_log_file("Failed to allocate memory.");
-        return 0;
-    }
 
-    memcpy(&(memory_->memory[memory_->size]), ptr, real_size);
-    memory_->size += real_size;
-    //memory_->memory[memory_->size] = 0;
+//Formats one record as a single line. Returns its length.
+static size_t format_log_record(const log_record *record, int thread, char *out, size_t cap){
 
-    memory_->memory[memory_->size] = '\0';
+    struct tm tm;
+    char stamp[32];
 
-    return real_size;
-}
+    gmtime_r(&record->time.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
 
+    int n = snprintf(out, cap, "%s.%06ldZ thread=%d code=%d url=%s msg=\"%s\"\n",
+                     stamp, record->time.tv_nsec / 1000, thread, record->code,
+                     record->url[0] ? record->url : "-", record->message);
 
+    return (n < 0) ? 0 : ((size_t) n >= cap ? cap - 1 : (size_t) n);
+}
 
-void Parse_JSON(const char *json_data){
 
-    //Create CSJON obj
-    //cJSON *json_parsed = cJSON_Parse(json_data);
+/*
+Moves everything currently in the rings to the log file. Each ring's lines are
+formatted into one stretch of the batch buffer and become one iovec of the writev().
 
-    cJSON *json_parsed = cJSON_Parse(json_data);
+@return size_t: number of records written.
+*/
+static size_t drain_log_rings(char *buffer, size_t capacity){
 
-    char *parsed_string = cJSON_Print(json_parsed);
-    
-    //printf("%s", parsed_string);
+    struct iovec iov[64];
+    int iov_count = 0;
+    size_t used = 0, written = 0;
 
-    
-    return;
-}
+    pthread_mutex_lock(&logger.lock);
+    log_ring *rings = logger.rings;
+    pthread_mutex_unlock(&logger.lock);
 
+    for(log_ring *ring = rings; ring != NULL; ring = ring->next){
 
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        long dropped = atomic_exchange(&ring->dropped, 0);
+        size_t start = used;
 
-/*
-The open_url() function takes a string url as input and creates an http
-request to the respective page using libcurl. 
+        if(dropped > 0 && capacity - used > 128){
+            used += snprintf(buffer + used, capacity - used, "thread=%d dropped %ld log records (ring full)\n", ring->thread, dropped);
+        }
 
-@param char *url: pointer to string, the unique resource identifier of the target page. 
-*/
-char* open_url(char *url){
-    
-    /*
-    Create libcurl object, or handler, necessary for http interaction. 
-    The call to curl_easy_init() initializes the handler. 
-    IMPORTANT: Make sure to close the handler when finished. 
-    */
-    CURL *curl_handler = curl_easy_init();
+        while(head != tail && capacity - used > LOG_URL_MAX + LOG_MESSAGE_MAX + 96){
+            used += format_log_record(&ring->records[head & (LOG_RING_SIZE - 1)], ring->thread, buffer + used, capacity - used);
+            head++;
+            written++;
+        }
 
-    
-    //We have to dynamically allocate the userdata struct aswell, as we are passing it to CJSON.
-    struct mem *userdata = malloc(sizeof(struct mem));
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        if(used > start){
+            iov[iov_count].iov_base = buffer + start;
+            iov[iov_count].iov_len = used - start;
+            iov_count++;
+        }
 
+        if(iov_count == 64 || capacity - used <= LOG_URL_MAX + LOG_MESSAGE_MAX + 96){
+            if(writev(logger.fd >= 0 ? logger.fd : STDERR_FILENO, iov, iov_count) < 0){
+                fprintf(stderr, "Error writing log file.\n");
+            }
+            iov_count = 0;
+            used = 0;
+        }
+    }
 
-    //Check if the handler was initialized correctly, dereferencing the handler pointer gives us the error status. 
-    if(curl_handler){
+    if(iov_count > 0 && writev(logger.fd >= 0 ? logger.fd : STDERR_FILENO, iov, iov_count) < 0){
+        fprintf(stderr, "Error writing log file.\n");
+    }
 
-        /*
-        In libcurl a variety of options exist to modify the behaviour of the curl handler. 
-        These options are initialized using curl_set_opt(curl handler, option, option_parameter).
-        
-        What do we want the curl handler to do?
-            -> We want it to establish connection with a web page 
-            
-            -> Retrieve HTML data 
+    return written;
+}
 
-        We must open the url before transferring the data. 
-        */
 
-        /*Since we are going to be reallocating memory in the 
-          writeback function we can allocate a single byte to start with.
-        */
-        userdata->memory = malloc(1); 
-        userdata->size = 0;
+//Background writer: drains the rings every 100ms, or sooner when a ring fills up.
+void * run_log_writer(void *arg){
 
-        struct curl_slist *headers = NULL;
-        //headers = curl_slist_append(headers, "Accept: application/json");
-        //headers = curl_slist_append(headers, "Content-Type: application/json");
-        //headers = curl_slist_append(headers, "charset: utf-8");
+    size_t capacity = 1 << 20;
+    char *buffer = (char *) malloc(capacity);
+    long last_sync = monotonic_ms();
 
-        curl_easy_setopt(curl_handler, CURLOPT_URL, url);
-        curl_easy_setopt(curl_handler, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl_handler, CURLOPT_USERAGENT, "libcurl-agent/1.0"); //Additional information for server requests
-        curl_easy_setopt(curl_handler, CURLOPT_WRITEDATA, userdata); // Pass userdata to write callback
-        curl_easy_setopt(curl_handler, CURLOPT_HEADER, 0);
+    if(buffer == NULL){
+        fprintf(stderr, "Logger: memory allocation failed.\n");
+        return NULL;
+    }
 
+    while(1){
 
+        bool stopping = atomic_load(&logger.stopping);
+        size_t written = drain_log_rings(buffer, capacity);
 
-        //Execute the behaviour (data transfer) attributed to curl_handler.
-        CURLcode flag = curl_easy_perform(curl_handler);
+        if(written > 0 && logger.fd >= 0 && logger.fsync_ms >= 0 && monotonic_ms() - last_sync >= logger.fsync_ms){
+            fdatasync(logger.fd);
+            last_sync = monotonic_ms();
+        }
 
-        if (flag != CURLE_OK) {
-            //fprintf(stderr, "Retrieval of : %s\n", curl_easy_strerror(flag));
-            return NULL;
+        //A full batch means more is probably waiting; go straight round again.
+        if(stopping && written == 0){
+            break;
         }
-        
 
-        //Close the handler. The handler is what performed the data transfer for us. 
-        curl_easy_cleanup(curl_handler);
+        if(written == 0){
+
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += 100 * 1000000L;
 
-        //Data is now preserved in data struct
-        //printf("%s", userdata->memory); 
+            if(until.tv_nsec >= 1000000000L){
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
 
-        return userdata->memory; 
+            pthread_mutex_lock(&logger.lock);
+            if(!atomic_load(&logger.stopping)){
+                pthread_cond_timedwait(&logger.wake, &logger.lock, &until);
+            }
+            pthread_mutex_unlock(&logger.lock);
+        }
     }
 
+    free(buffer);
+
     return NULL;
-    
 }
 
 
- 
-struct URLQueueNode* create_URLQueueNode(char *url){
-  
-    struct URLQueueNode *newNode = (struct URLQueueNode *) malloc(sizeof(struct URLQueueNode));
+/*
+Opens the log file and starts the writer thread. Records logged before this are kept
+in their rings and written by the first batch.
 
-    if (newNode == NULL) {
+@param int fsync_ms: -1 never fsync, 0 after every batch, otherwise at most this often.
+*/
+bool start_logger(const char *path, int fsync_ms, enum log_full_policy full_policy){
 
-        printf("Memory allocation failed.\n");
-        return NULL;
+    logger.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if(logger.fd < 0){
+        fprintf(stderr, "Error opening log file.\n");
     }
-    
-    newNode -> html_url = (char *) malloc(strlen(url) + 1); 
 
-    if(newNode->html_url == NULL) {
+    logger.fsync_ms = fsync_ms;
+    logger.full_policy = full_policy;
 
-        printf("Memory allocation failed.\n");
-        free(newNode); // Free previously allocated memory
-        return NULL;
+    if(pthread_create(&logger.writer, NULL, run_log_writer, NULL) != 0){
+        fprintf(stderr, "Failed to start log writer.\n");
+        return false;
     }
 
- 
-    strcpy(newNode -> html_url, url);
-
-    newNode -> next_URL = NULL;
+    atomic_store(&logger.running, true);
 
-    return newNode;
+    return true;
 }
 
 
+//Flushes every ring and stops the writer. Call after all other threads have finished.
+void stop_logger(void){
 
-// Initialize a URL queue.
-void initQueue(URLQueue *URLS){
-
-    URLS -> head = NULL;
-    URLS -> tail = NULL;
+    if(!atomic_load(&logger.running)){
+        return;
+    }
 
-    pthread_mutex_init(&URLS->lock, NULL);
-}
+    pthread_mutex_lock(&logger.lock);
+    atomic_store(&logger.stopping, true);
+    pthread_cond_signal(&logger.wake);
+    pthread_mutex_unlock(&logger.lock);
 
-void initData(struct data_list *output_q){
-    output_q -> head = NULL;
-    output_q -> tail = NULL;
+    pthread_join(logger.writer, NULL);
+    atomic_store(&logger.running, false);
 
-    pthread_mutex_init(&output_q->lock, NULL);
+    if(logger.fd >= 0){
+        if(logger.fsync_ms >= 0){
+            fdatasync(logger.fd);
+        }
+        close(logger.fd);
+        logger.fd = -1;
+    }
 }
 
 
 /*
-Some websites do not support www.website.com/sitemap.xml. 
-Therefore, our other attempt to retrieve the sitemap will consist
-of analyzing and parsing the robot.txt file.
-The robots.txt file should give us the sitemaps, if any. 
-We are just searching for the sitemap url(s), it is possible for 
-there to be more than one sitemap url. That is the difference between 
-this method and getSiteMaps_XML. The idea is to send the sitemap urls 
-found here to getSiteMaps_XML so that it can search for more sitemap urls. 
-If robot.txt is not available and the sitemap cannot be retrieved, let the
-user know. OPTIONAL: Implement logic to allow user to enter sitemap url manually. 
+-----------------------------------------
+|               Metrics                 |
+-----------------------------------------
+Every thread that fetches or parses keeps its own thread_metrics: counters and one
+latency histogram per stage. Only the owning thread writes them, with plain relaxed
+stores, so recording costs no locked instruction and no shared cache line; readers 
+sum all threads' blocks and may see a value one update old. 
+
+Histograms are HDR-style: values in microseconds go into log-linear buckets, eight per
+power of two, so every bucket is within 12.5% of its values from 1us up to days.
+
+Curl's own timings (curl_easy_getinfo) give the network stages; parsing and the time 
+a worker sits in dequeue_URL() waiting for work are timed around those calls, and 
+"page" runs from the start of a fetch to the end of its parse. With --parse-workers,
+"parse_wait" and "stall" time the parse queue (see submit_page()). With 
+--stats-every the totals are printed to stderr periodically, and with --metrics-port 
+they are served as Prometheus text on 127.0.0.1.
+*/
 
+enum metric_stage { STAGE_DNS, STAGE_CONNECT, STAGE_TLS, STAGE_TTFB, STAGE_TRANSFER,
+                    STAGE_PARSE, STAGE_MATCH, STAGE_QUEUE_WAIT, STAGE_PAGE, STAGE_PARSE_WAIT, STAGE_STALL, STAGE_COUNT };
 
-void get_RobotSiteMaps(char *url, struct sitemap **sitemaps){ //Accept pointer to pointer since we are modifying the url 
+static const char *stage_names[STAGE_COUNT] = { "dns", "connect", "tls", "ttfb", "transfer", "parse", "match", "queue_wait", "page",
+                                                "parse_wait", "stall" };
 
-    char append[12] = "/robots.txt";    //Text to append to URL.
-    char modified_url[100];
+enum metric_counter { COUNT_PAGES, COUNT_BYTES, COUNT_ERRORS, COUNT_ABORTED,
+                      COUNT_2XX, COUNT_3XX, COUNT_4XX, COUNT_5XX, COUNT_COUNT };
 
-    strcpy(modified_url, url);
-    strcat(modified_url, append);
+static const char *counter_names[COUNT_COUNT] = { "pages", "bytes", "errors", "aborted", "2xx", "3xx", "4xx", "5xx" };
 
-    struct mem *memory = open_url(modified_url);
+#define HIST_SUB_BUCKETS 8                       //Per power of two.
+#define HIST_MAX_EXPONENT 39                     //2^40us is almost two weeks.
+#define HIST_BUCKETS ((HIST_MAX_EXPONENT - 1) * HIST_SUB_BUCKETS)
 
-    char *line = strtok((char *) memory->memory, "\n");
-    
-    while (line != NULL) {
+typedef struct latency_histogram{
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_us;
+} latency_histogram;
 
-        if (strstr(line, "Sitemap:") == line) {
+typedef struct thread_metrics{
+    _Atomic uint64_t counters[COUNT_COUNT];
+    latency_histogram stages[STAGE_COUNT];
+    struct thread_metrics *next;
+} thread_metrics;
 
-            char *sitemap_url = line + strlen("Sitemap:");
-            
-            while(*sitemap_url == ' ' || *sitemap_url == '\t'){
 
-                sitemap_url++;
-            }
-            
-            //printf("Hello!");
-            //insertSitemap(&sitemaps, sitemap_url);
+static struct {
+    thread_metrics *threads;         //Every block ever registered; only ever grows.
+    pthread_mutex_t lock;            //Guards registration.
+    bool enabled;
+    URLQueue *URLS;                  //For the frontier gauges.
+    long started_ms;
+    atomic_long parse_queued;        //Pages on the parse queue, kept up to date by the pipeline.
+    long parse_queue_size;           //Its capacity, 0 without --parse-workers.
 
-            printf("URL: %s\n", sitemap_url);
-        }
+    pthread_t thread;
+    atomic_bool stopping;
+    int listen_fd;
+} metrics = { .lock = PTHREAD_MUTEX_INITIALIZER, .listen_fd = -1 };
 
-        line = strtok(NULL, "\n");
-    }
+static __thread thread_metrics *thread_metrics_block = NULL;
 
 
-    //printf("%s", memory->memory);
+long monotonic_us(void){
 
-    /*
-    
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
 
-    if (file == NULL) {
-        perror("Error opening file");
-        return;
-    }
 
-    char line[1000];
-    while (fgets(line, sizeof(line), file)) {
-        if (strstr(line, "Sitemap:") == line) {
-            char *sitemap_url = line + strlen("Sitemap:");
-            // Trim leading and trailing whitespace
-            while (*sitemap_url == ' ' || *sitemap_url == '\t' || *sitemap_url == '\n') {
-                sitemap_url++;
-            }
-            // Print or process the sitemap URL
-            printf("Sitemap URL: %s", sitemap_url);
-        }
+//The calling thread's block, registered on first use. NULL while metrics are off.
+thread_metrics* my_metrics(void){
+
+    if(thread_metrics_block != NULL || !metrics.enabled){
+        return thread_metrics_block;
     }
 
-    fclose(file);
-  
-}
+    thread_metrics *block = (thread_metrics *) calloc(1, sizeof(thread_metrics));
 
-*/
+    if(block == NULL){
+        return NULL;
+    }
 
+    pthread_mutex_lock(&metrics.lock);
+    block->next = metrics.threads;
+    metrics.threads = block;
+    pthread_mutex_unlock(&metrics.lock);
 
-void getTextInsideLoc(xmlNode *node, struct URLQueue *url_q, char *url){
+    thread_metrics_block = block;
 
-    
-    for (xmlNode *cur = node; cur; cur = cur->next){
+    return block;
+}
 
-        if(cur->type == XML_ELEMENT_NODE && xmlStrcmp(cur->name, (const xmlChar *) "loc") == 0){
 
-            xmlNode *child = cur->children;
-            if(child && child->type == XML_TEXT_NODE){
-                
-                enqueue_URL(&url_q, child->content);
-                
-                //printf("Text inside <loc>: %s\n", child->content);
-            }
-        }
+//Single-writer add: a load and a store, both relaxed, instead of a locked read-modify-write.
+static inline void metric_add(_Atomic uint64_t *value, uint64_t n){
 
-        getTextInsideLoc(cur->children, url_q, url);
-    }
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
 }
 
 
+void count_metric(enum metric_counter counter, uint64_t n){
 
-char* getTextInsideElements(TidyDoc doc, TidyNode node, char *elementName) {
-
-    TidyNode child;
+    thread_metrics *block = my_metrics();
 
-    char *target = "window.__PRELOADED_STATE__ =";
+    if(block != NULL){
+        metric_add(&block->counters[counter], n);
+    }
+}
 
-    for (child = tidyGetChild(node); child; child = tidyGetNext(child)) {
-        
-        ctmbstr name = tidyNodeGetName(child);
-        
-        if(name){
-            // Check if the node matches the specified element name
-            if (strcmp(name, elementName) == 0) {
-                TidyBuffer buf;
-                tidyBufInit(&buf);
-                tidyNodeGetText(doc, child, &buf);
-                //printf("Text inside <%s>: %s\n", elementName, buf.bp);
 
-                char* foundit = strstr(buf.bp, target);
+static int histogram_bucket(uint64_t us){
 
-                if(foundit != NULL){
-                    //printf("Found it! \n%s", foundit); 
-                    
-                    char *json = strstr(foundit, "{");
-                    //printf("%s", json);
-                    //Call parseJSON
-                    //Parse_JSON(json);
+    if(us < HIST_SUB_BUCKETS){
+        return (int) us;
+    }
 
-                    tidyBufFree(&buf);
-                    return json;
-                }
+    int exponent = 63 - __builtin_clzll(us);
 
-                ///printf("Didnt find it. ");
+    if(exponent > HIST_MAX_EXPONENT){
+        return HIST_BUCKETS - 1;
+    }
 
-                tidyBufFree(&buf);
-            }
-        }
+    int sub = (int) ((us >> (exponent - 3)) & (HIST_SUB_BUCKETS - 1));
 
-        //Recursively search for the specified elements in child nodes
-        getTextInsideElements(doc, child, elementName);
-        
-    }
+    return (exponent - 2) * HIST_SUB_BUCKETS + sub;
 }
 
 
-void printAnchorHrefs(TidyDoc tdoc) {
-    TidyNode anchor = tidyGetBody(tdoc);  // Start with the body tag
-    anchor = tidyGetChild(anchor);        // Get the first child of the body
+//Smallest value that lands in bucket; the next bucket's is its upper bound.
+static uint64_t histogram_bucket_start(int bucket){
 
-    while (anchor) {
-        TidyAttr attr;
-        if (tidyNodeGetId(anchor) == TidyTag_A) {  // Check if the node is an <a> tag
-            attr = tidyAttrFirst(anchor);
-            while (attr) {
-                if (tidyAttrGetId(attr) == TidyAttr_HREF) {  // Check if the attribute is 'href'
-                    //printf("Found href: %s\n", tidyAttrValue(attr));
-                    break;
-                }
-                attr = tidyAttrNext(attr);
-            }
-        }
-        anchor = tidyGetNext(anchor);  // Get next sibling node
+    if(bucket < HIST_SUB_BUCKETS){
+        return (uint64_t) bucket;
     }
-}
-
-
 
-void crawlElements(xmlNode *node, char *target, struct data_list *output, char *url, int *depth_count){
+    int exponent = bucket / HIST_SUB_BUCKETS + 2;
 
+    return (uint64_t) (HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << (exponent - 3);
+}
 
-    xmlNode *cur = NULL;
-    for (cur = node; cur; cur = cur->next) {
-        if (cur->type == XML_ELEMENT_NODE) {
-            //printf("Element: <%s>\n", cur->name);
 
-            // If the element has children, recursively traverse them
-            if (cur->children) {
-                crawlElements(cur->children, target, output, url, depth_count);
-            }
+void observe_stage(enum metric_stage stage, long us){
 
-            //printf("End Element: <%s>\n", cur->name); // Print end tag
-        } 
-        
-        else if (cur->type == XML_TEXT_NODE) {
-            
-            //printf("Loc has <%s>: %s\n", node->parent->name, cur->content);
-            if(strstr(cur->content, target) != NULL){
-                printf("found it! At ");
-                printf("URL: %s\n", url);
-                (*depth_count) += 1;
-                append_data(&output, url);
+    thread_metrics *block = my_metrics();
 
-                return;
-            }
-        }
+    if(block == NULL || us < 0){
+        return;
     }
 
-    
-}
-
+    latency_histogram *h = &block->stages[stage];
 
+    metric_add(&h->buckets[histogram_bucket((uint64_t) us)], 1);
+    metric_add(&h->count, 1);
+    metric_add(&h->sum_us, (uint64_t) us);
+}
 
-void parseHTMLElements(struct URLQueue *url_q, struct data_list *output, const char *html, char *target, char *url, int *depth_count){
 
-     
-    htmlDocPtr doc = NULL;
-    xmlNode *root = NULL;
+/*
+Records one finished transfer: its status class, size and curl's timings. Curl reports
+each timing from the start of the transfer, so a stage is the difference between two of
+them; stages a reused connection skipped read as zero and are not recorded.
 
-    // Parse the HTML content from the string
-    doc = htmlReadMemory(html, strlen(html), NULL, NULL, HTML_PARSE_NOWARNING | HTML_PARSE_NOERROR);
+@param int result: the CURLcode of the transfer.
+*/
+void record_transfer(CURL *curl_handler, int result, long status, bool aborted){
 
-    if (doc == NULL) {
-        append_to_log_file("Failed to parse document");
+    if(my_metrics() == NULL){
         return;
     }
 
-    // Get the root element of the HTML document
-    root = xmlDocGetRootElement((xmlDoc *)doc);
-    if (root == NULL) {
-        append_to_log_file("Empty document");
-        xmlFreeDoc((xmlDoc *)doc);
+    if(result != CURLE_OK){
+        count_metric(aborted ? COUNT_ABORTED : COUNT_ERRORS, 1);
         return;
     }
 
-    //Start traversing the HTML tree
-    crawlElements(root, target, output, url, depth_count);
-
-    // Cleanup
-    xmlFreeDoc((xmlDoc *)doc);
-    xmlCleanupParser();
-
-    return;
-}
-
+    curl_off_t lookup = 0, connect = 0, tls = 0, pretransfer = 0, first_byte = 0, total = 0, bytes = 0;
 
+    curl_easy_getinfo(curl_handler, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+    curl_easy_getinfo(curl_handler, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl_handler, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl_handler, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl_handler, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl_handler, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl_handler, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
 
+    if(lookup > 0)          observe_stage(STAGE_DNS, (long) lookup);
+    if(connect > lookup)    observe_stage(STAGE_CONNECT, (long) (connect - lookup));
+    if(tls > connect)       observe_stage(STAGE_TLS, (long) (tls - connect));
+    if(first_byte > 0)      observe_stage(STAGE_TTFB, (long) (first_byte - pretransfer));
+    if(total >= first_byte) observe_stage(STAGE_TRANSFER, (long) (total - first_byte));
 
-//printing the href attributes 
-bool parseHTML(struct URLQueue *url_q, const char *html_content){
+    count_metric(COUNT_PAGES, 1);
+    count_metric(COUNT_BYTES, (uint64_t) bytes);
 
-    //Reads the HTML content, htmlReadDoc - converts the HTML string to xmlDoc pointer 
-    htmlDocPtr doc = htmlReadDoc((xmlChar*)html_content, NULL, NULL, HTML_PARSE_NOWARNING | HTML_PARSE_NOERROR); //giving warning and error reports 
-    if (!doc){
-        append_to_log_file("Failed to parse the document");
+    if(status >= 200 && status < 600){
+        count_metric(COUNT_2XX + (status / 100 - 2), 1);
     }
+}
 
-    //for the parsed XML document 
-    xmlXPathContextPtr context = xmlXPathNewContext(doc);
-    if(!context){
-        append_to_log_file("Failed to create XPath context");
-        xmlFreeDoc(doc);
-    }
 
-    //Evaluate XPath expression to find all <a> elements with an href attribute
-    xmlXPathObjectPtr result = xmlXPathEvalExpression((xmlChar*)"//a[@href]", context);
-    if (!result){
-        append_to_log_file("Failed to evaluate XPath expression");
-        xmlXPathFreeContext(context);
-        xmlFreeDoc(doc);
-    }
-    //checking if the node set is empty 
-    if(xmlXPathNodeSetIsEmpty(result->nodesetval)){
-        printf("");
-        return false;
-    }
+//Sums every thread's block into one.
+void collect_metrics(thread_metrics *total){
 
+    memset(total, 0, sizeof(*total));
 
-    else{
+    pthread_mutex_lock(&metrics.lock);
+    thread_metrics *threads = metrics.threads;
+    pthread_mutex_unlock(&metrics.lock);
 
-        //representing a set of nodes in a document 
-        xmlNodeSetPtr nodes = result->nodesetval; //referencing to access the node set from the result of the XPath evaluation.
-        for(int i = 0; i < nodes -> nodeNr; i++){ //accessing each node
+    for(thread_metrics *block = threads; block != NULL; block = block->next){
 
-            xmlNodePtr node = nodes->nodeTab[i];
-            xmlChar *href = xmlGetProp(node, (xmlChar *)"href"); //Retreving the href attribute 
+        for(int c = 0; c < COUNT_COUNT; c++){
+            total->counters[c] += atomic_load_explicit(&block->counters[c], memory_order_relaxed);
+        }
 
-            if(href){
+        for(int s = 0; s < STAGE_COUNT; s++){
 
-                //printf("herf: %s\n", href);
-                //printf("Enqueing URL: %s", href);
-                enqueue_URL(&url_q, href);
-                xmlFree(href);
+            latency_histogram *from = &block->stages[s], *to = &total->stages[s];
+
+            for(int b = 0; b < HIST_BUCKETS; b++){
+                to->buckets[b] += atomic_load_explicit(&from->buckets[b], memory_order_relaxed);
             }
 
+            to->count += atomic_load_explicit(&from->count, memory_order_relaxed);
+            to->sum_us += atomic_load_explicit(&from->sum_us, memory_order_relaxed);
         }
     }
-       
-    xmlXPathFreeObject(result);
-    xmlXPathFreeContext(context);
-    xmlFreeDoc(doc);
-
-    return true; 
 }
 
 
+//Upper bound of the bucket holding the q-th quantile, in microseconds.
+uint64_t histogram_quantile(const latency_histogram *h, double q){
 
-bool parseXML(char *url, char *XML, struct URLQueue *url_q){
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    uint64_t rank = (uint64_t) ceil(q * count), seen = 0;
 
-    xmlDoc *doc = xmlReadMemory(XML, strlen(XML), NULL, NULL, 0);
-    if (!doc){
-        append_to_log_file("Failed to parse XML content");
-        return false;
-    }
+    for(int b = 0; b < HIST_BUCKETS; b++){
 
-    xmlNode *root = xmlDocGetRootElement(doc);
+        seen += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
 
-    if (!root){
-        append_to_log_file("Empty XML document");
-        xmlFreeDoc(doc);
-        return false;
+        if(seen >= rank && seen > 0){
+            return b + 1 < HIST_BUCKETS ? histogram_bucket_start(b + 1) : histogram_bucket_start(b);
+        }
     }
 
-    //Get url from <loc> elements
-    getTextInsideLoc(root, url_q, url);
+    return 0;
+}
 
 
-    xmlFreeDoc(doc);
-    xmlCleanupParser();
+//One stats dump: rates since the start, queue gauges and the quantiles of every stage that has samples.
+void print_metrics(FILE *out){
 
-    return true;
-}
+    thread_metrics *total = (thread_metrics *) malloc(sizeof(thread_metrics));
 
+    if(total == NULL){
+        return;
+    }
 
+    collect_metrics(total);
 
+    double seconds = (monotonic_ms() - metrics.started_ms) / 1000.0;
+    uint64_t pages = total->counters[COUNT_PAGES];
 
-/*
-The execute_page() function is the function we should call to process a web page, or url, within our crawler. 
-Since C does not provide native support for retrieving web pages the process consists of multiple
-steps. This function will begin the execution of those steps. 
+    flockfile(out);
 
-@param char *url 
-@return bool: returns false if error, true otherwise. 
-*/
-void * execute_crawl(void *arg){
+    fprintf(out, "[stats %.0fs] %llu pages (%.1f/s), %.1f MB, %llu errors, %llu aborted, status 2xx %llu 3xx %llu 4xx %llu 5xx %llu\n",
+            seconds, (unsigned long long) pages, seconds > 0 ? pages / seconds : 0.0, total->counters[COUNT_BYTES] / 1048576.0,
+            (unsigned long long) total->counters[COUNT_ERRORS], (unsigned long long) total->counters[COUNT_ABORTED],
+            (unsigned long long) total->counters[COUNT_2XX], (unsigned long long) total->counters[COUNT_3XX],
+            (unsigned long long) total->counters[COUNT_4XX], (unsigned long long) total->counters[COUNT_5XX]);
 
-    struct {
-        struct URLQueue *url_q;
-        struct data_list *output;
-        char *url;
-        char *target;
-        int  depth_limit; 
-        int depth_count;
-    } *args = arg;
-    
-    if (args->output == NULL || args->url_q == NULL) {
-        append_to_log_file("Invalid arguments");
-        return NULL;
+    if(metrics.URLS != NULL){
+        fprintf(out, "[stats] frontier: %ld outstanding, %ld spilled, %d of %d workers idle\n",
+                atomic_load(&metrics.URLS->outstanding), atomic_load(&metrics.URLS->spill.count),
+                atomic_load(&metrics.URLS->idle_workers), atomic_load(&metrics.URLS->workers));
     }
-    
-    
-    // Initialize local variables
-    char *target = args->target;
 
-    //printf("Target: %s", target);
+    if(metrics.parse_queue_size > 0){
+        fprintf(out, "[stats] parse queue: %ld of %ld pages\n", atomic_load(&metrics.parse_queued), metrics.parse_queue_size);
+    }
 
-    while(1){
+    for(int s = 0; s < STAGE_COUNT; s++){
 
-        if(args->depth_count >= args->depth_limit){
+        latency_histogram *h = &total->stages[s];
 
-            printf("Depth limit %ls reached!\n\n", &args->depth_count);
-            break; 
+        if(h->count == 0){
+            continue;
         }
 
-        // Dequeue URL from the queue
-        char *url = dequeue_URL(args->url_q);
-        //printf("%s", url);
-        if (url == NULL) {
-            // No more URLs in the queue
-            break;
-        }
+        fprintf(out, "[stats] %-10s n=%-8llu mean=%.2fms p50=%.2fms p90=%.2fms p99=%.2fms max<%.2fms\n",
+                stage_names[s], (unsigned long long) h->count, h->sum_us / 1000.0 / h->count,
+                histogram_quantile(h, 0.5) / 1000.0, histogram_quantile(h, 0.9) / 1000.0,
+                histogram_quantile(h, 0.99) / 1000.0, histogram_quantile(h, 1.0) / 1000.0);
+    }
 
-        // Process the URL
-        char *data = open_url(url); 
+    funlockfile(out);
+    fflush(out);
 
-        if(data == NULL){
-            printf("HTTP Request failed.");
-            return 1;
-        }
+    free(total);
+}
 
-        if (data != NULL){
 
-            if (check_ifXML(url)) {
-                // Parse XML content
-                if (parseXML(url, data, args->url_q)) {
-                    //printf("XML Parsed.\n");
-                }
-            } else {
-                // Parse HTML content
-                if (parseHTML(args->url_q, data)) {
-                    //printf("HTML URL's Parsed.\n");
-                }
+/*
+Renders the metrics in the Prometheus text format. The fine histogram buckets are 
+folded into a fixed set of le bounds, each fine bucket counted under the first bound 
+its upper edge fits.
 
-                // Parse specific elements in the HTML
-                parseHTMLElements(args->url_q, args->output, data, target, url, &(args->depth_count));
-            }
-            // Free memory allocated for data
-            free(data);
-        } else {
-            // Handle error fetching URL
-            append_to_log_file("Failed to fetch URL");
-        }
-        
-        // Free memory allocated for the URL
-        free(url);
+@return size_t: bytes written to out, at most size - 1.
+*/
+size_t format_prometheus(char *out, size_t size){
+
+    static const double bounds[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+                                     0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
+    int bound_count = (int) (sizeof(bounds) / sizeof(bounds[0]));
+    thread_metrics *total = (thread_metrics *) malloc(sizeof(thread_metrics));
+    size_t used = 0;
+
+    if(total == NULL){
+        return 0;
     }
 
-    return NULL;
-}
-    
+    collect_metrics(total);
 
+    #define EMIT(...) do { if(used < size) used += snprintf(out + used, size - used, __VA_ARGS__); } while(0)
 
+    EMIT("# TYPE crawler_events_total counter\n");
 
-void print_queue(struct URLQueue *url_q){
+    for(int c = 0; c < COUNT_COUNT; c++){
+        EMIT("crawler_events_total{event=\"%s\"} %llu\n", counter_names[c], (unsigned long long) total->counters[c]);
+    }
 
-    struct URLQueueNode *ptr = url_q -> head;
+    if(metrics.URLS != NULL){
+        EMIT("# TYPE crawler_frontier_outstanding gauge\ncrawler_frontier_outstanding %ld\n", atomic_load(&metrics.URLS->outstanding));
+        EMIT("# TYPE crawler_frontier_spilled gauge\ncrawler_frontier_spilled %ld\n", atomic_load(&metrics.URLS->spill.count));
+        EMIT("# TYPE crawler_idle_workers gauge\ncrawler_idle_workers %d\n", atomic_load(&metrics.URLS->idle_workers));
+    }
 
-    while(ptr != NULL){
-        printf("URL: %s\n", ptr->html_url);
-        ptr = ptr -> next_URL;
+    if(metrics.parse_queue_size > 0){
+        EMIT("# TYPE crawler_parse_queue_depth gauge\ncrawler_parse_queue_depth %ld\n", atomic_load(&metrics.parse_queued));
+        EMIT("# TYPE crawler_parse_queue_capacity gauge\ncrawler_parse_queue_capacity %ld\n", metrics.parse_queue_size);
     }
 
-    return;
-}
+    EMIT("# TYPE crawler_stage_seconds histogram\n");
 
+    for(int s = 0; s < STAGE_COUNT; s++){
 
-void printOutput(struct data_list *output){
+        latency_histogram *h = &total->stages[s];
+        uint64_t cumulative = 0;
+        int b = 0;
 
-    struct URL *ptr = output -> head;
-    printf("Printing output...\n");
+        for(int i = 0; i < bound_count; i++){
 
-    while(ptr != NULL){
-        printf("URL: %s\n", ptr->url);
-        ptr = ptr -> next_URL;
+            while(b < HIST_BUCKETS && histogram_bucket_start(b + 1) <= bounds[i] * 1e6){
+                cumulative += h->buckets[b++];
+            }
+
+            EMIT("crawler_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stage_names[s], bounds[i], (unsigned long long) cumulative);
+        }
+
+        EMIT("crawler_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[s], (unsigned long long) h->count);
+        EMIT("crawler_stage_seconds_sum{stage=\"%s\"} %.6f\n", stage_names[s], h->sum_us / 1e6);
+        EMIT("crawler_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[s], (unsigned long long) h->count);
     }
 
-    return;
-}
+    #undef EMIT
 
+    free(total);
 
-int main(int argc, char *argv[]){
+    return used < size ? used : size - 1;
+}
 
-    if(argc < 2) {
-        printf("Usage: %s <starting-url>\n", argv[0]);
-        return 1;
-    }
 
-    
-    //"https://www.ubisoft.com/en-ca/game/assassins-creed/mirage/photomode"
+//Answers one scrape: whatever was asked, the reply is the current metrics.
+void serve_metrics(int client){
 
-    char *first_url = argv[2];
+    char request[1024];
+    size_t size = 256 * 1024;
+    char *body = (char *) malloc(size);
 
-    struct URLQueue *url_q = (struct URLQueue *) malloc(sizeof(struct URLQueue));
-    if (url_q == NULL) {
-        append_to_log_file("Memory allocation failed\n");
-        return 1;
+    //The request itself does not matter, but reading it keeps clients from seeing a reset.
+    if(read(client, request, sizeof(request)) < 0 || body == NULL){
+        free(body);
+        return;
     }
-    initQueue(url_q);
-    enqueue_URL(&url_q, first_url);
 
-    struct data_list *output = (struct data_list *)malloc(sizeof(struct data_list)); // Initialize output structure
-    if (output == NULL) {
-        append_to_log_file("Memory allocation failed");
-        free(url_q);
-        return 1;
+    size_t len = format_prometheus(body, size);
+    char header[160];
+    int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    struct iovec iov[2] = { { header, (size_t) header_len }, { body, len } };
+
+    if(writev(client, iov, 2) < 0){
+        log_event(errno, NULL, "Failed to send metrics");
     }
-    output->head = output->tail = NULL; // Set head and tail to NULL initially
 
-    char *target = "About";
+    free(body);
+}
 
-    int depth_limit = atoi(argv[1]);
 
-    //printf("%ls %s", &depth_limit, first_url);
+//Metrics thread: serves scrapes as they arrive and prints a dump every --stats-every seconds.
+void * run_metrics(void *arg){
 
-    printf("We will scrape URL's that contain the following target.\n");
-    printf("Target: %s\n", target);
+    long next_dump = config.stats_every > 0 ? monotonic_ms() + config.stats_every * 1000L : -1;
 
-    //execute_crawl(url_q, output, target);
+    while(!atomic_load(&metrics.stopping)){
 
-    
-    // Placeholder for creating and joining threads.
-    // You will need to create multiple threads and distribute the work of URL fetching among them.
-    const int NUM_THREADS = 10; // Example thread count, adjust as needed.
+        //Short timeout so stopping is noticed promptly.
+        long wait = 200;
 
-    pthread_t threads[NUM_THREADS]; 
+        if(next_dump >= 0 && next_dump - monotonic_ms() < wait){
+            wait = next_dump - monotonic_ms();
+        }
 
+        struct pollfd pfd = { metrics.listen_fd, POLLIN, 0 };
 
-    struct {
-        struct URLQueue *url_q;
-        struct data_list *output;
-        char *url;
-        char *target;
-        int  depth_limit; 
-        int depth_count;
-    } args = {url_q, output, first_url, target, 4, 0};
+        if(poll(&pfd, metrics.listen_fd >= 0 ? 1 : 0, wait > 0 ? (int) wait : 0) > 0){
 
+            int client = accept(metrics.listen_fd, NULL, NULL);
 
-    // Create the thread and pass the arguments
-    
-    //Create worker threads
-    for (int i = 0; i < NUM_THREADS; i++) {
-        if (pthread_create(&threads[i], NULL, execute_crawl, &args) != 0){
-            //fprintf(stderr, "Failed to create thread\n");
-            free(url_q);
-            free(output);
-        }
+            if(client >= 0){
+
+                struct timeval timeout = { 1, 0 };
+                setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+                serve_metrics(client);
+                close(client);
+            }
+        }
+
+        if(next_dump >= 0 && monotonic_ms() >= next_dump){
+            print_metrics(stderr);
+            next_dump += config.stats_every * 1000L;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+Turns recording on and, if --stats-every or --metrics-port asks for it, starts the 
+metrics thread. Call before any worker starts.
+
+@return bool: false if the metrics port could not be opened.
+*/
+bool start_metrics(URLQueue *URLS){
+
+    metrics.enabled = true;
+    metrics.URLS = URLS;
+    metrics.started_ms = monotonic_ms();
+
+    if(config.metrics_port > 0){
+
+        struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons((uint16_t) config.metrics_port),
+                                       .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        int one = 1;
+
+        metrics.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if(metrics.listen_fd < 0 || setsockopt(metrics.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+           bind(metrics.listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(metrics.listen_fd, 16) != 0){
+            log_event(errno, NULL, "Failed to open the metrics port");
+            return false;
+        }
+    }
+
+    if(pthread_create(&metrics.thread, NULL, run_metrics, NULL) != 0){
+        append_to_log_file("Failed to start the metrics thread.");
+        return false;
+    }
+
+    return true;
+}
+
+
+//Stops the metrics thread and, with --stats-every, prints the final totals.
+void stop_metrics(void){
+
+    if(!metrics.enabled){
+        return;
+    }
+
+    atomic_store(&metrics.stopping, true);
+    pthread_join(metrics.thread, NULL);
+
+    if(metrics.listen_fd >= 0){
+        close(metrics.listen_fd);
+        metrics.listen_fd = -1;
+    }
+
+    if(config.stats_every > 0){
+        print_metrics(stderr);
+    }
+
+    metrics.enabled = false;
+}
+
+
+
+//URLQUEUE struct 
+struct URL * create_URL(char *url){
+  
+    struct URL *newNode = (struct URL *) malloc(sizeof(struct URL));
+
+    if (newNode == NULL) {
+
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    
+    newNode -> url = (char *) malloc(strlen(url) + 1); 
+
+    if(newNode->url == NULL) {
+
+        printf("Memory allocation failed.\n");
+        free(newNode); // Free previously allocated memory
+        return NULL;
+    }
+
+ 
+    strcpy(newNode -> url, url);
+
+    newNode -> next_URL = NULL;
+
+    return newNode;
+}
+
+/*
+64-bit hash of len bytes. Reads eight bytes at a time and mixes them with a 
+multiply-rotate step, then runs the splitmix64 finalizer so every input bit 
+reaches every output bit. Never returns 0, which the seen-set uses for empty slots.
+*/
+uint64_t hash_bytes(const char *data, size_t len){
+
+    const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = len * prime;
+    uint64_t word;
+
+    while(len >= 8){
+        memcpy(&word, data, 8);
+        h ^= word * 0xBF58476D1CE4E5B9ULL;
+        h = ((h << 31) | (h >> 33)) * prime;
+        data += 8;
+        len -= 8;
+    }
+
+    word = 0;
+    memcpy(&word, data, len);
+    h ^= word * 0xBF58476D1CE4E5B9ULL;
+
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+
+    return h ? h : 1;
+}
+
+
+//Fingerprint of a URL, see hash_bytes().
+uint64_t url_fingerprint(const char *url){
+
+    return hash_bytes(url, strlen(url));
+}
+
+
+bool init_bloom_filter(bloom_filter *bloom){
+
+    //Standard sizing: m = -n ln(p) / ln(2)^2 bits and k = m/n ln(2) hash functions.
+    double bits = -(double) config.bloom_items * log(config.bloom_fpr) / (M_LN2 * M_LN2);
+    double ceiling = (double) config.bloom_memory_mb * 1024.0 * 1024.0 * 8.0;
+
+    if(bits > ceiling){
+        bits = ceiling;
+    }
+
+    bloom->block_count = (size_t) (bits / 512.0) + 1;
+    bloom->k = (int) lround(bits / (double) config.bloom_items * M_LN2);
+
+    if(bloom->k < 1)  bloom->k = 1;
+    if(bloom->k > 16) bloom->k = 16;
+
+    bloom->blocks = aligned_alloc(CACHE_LINE, bloom->block_count * CACHE_LINE);
+
+    if(bloom->blocks == NULL){
+        append_to_log_file("Memory allocation failed");
+        return false;
+    }
+
+    memset((void *) bloom->blocks, 0, bloom->block_count * CACHE_LINE);
+    atomic_init(&bloom->inserted, 0);
+
+    return true;
+}
+
+
+bool init_seen_spill(seen_spill *spill){
+
+    //A resumed crawl keeps the fingerprints its Bloom filter was checkpointed with.
+    spill->fd = open(config.seen_spill_path, O_RDWR | O_CREAT | (config.resume ? 0 : O_TRUNC) | O_CLOEXEC, 0644);
+
+    if(spill->fd < 0){
+        append_to_log_file("Failed to open seen-set spill file");
+        return false;
+    }
+
+    //Twice the expected URL count keeps probe chains short; the file is sparse until written.
+    spill->partition_slots = (size_t) (config.bloom_items * 2) / SEEN_SHARDS + 1024;
+
+    if(ftruncate(spill->fd, (off_t) (spill->partition_slots * SEEN_SHARDS * sizeof(uint64_t))) != 0){
+        append_to_log_file("Failed to size seen-set spill file");
+        close(spill->fd);
+        spill->fd = -1;
+        return false;
+    }
+
+    for(int i = 0; i < SEEN_SHARDS; i++){
+        pthread_mutex_init(&spill->locks[i], NULL);
+    }
+
+    atomic_init(&spill->false_positives, 0);
+    atomic_init(&spill->full, 0);
+
+    return true;
+}
+
+
+/*
+Sets up a seen-set with the given backend. The output list always uses SEEN_EXACT;
+the frontier follows config.seen_backend.
+*/
+bool init_seen_set(seen_set *set, enum seen_backend backend){
+
+    set->backend = backend;
+    set->spill.fd = -1;
+
+    if(backend == SEEN_BLOOM){
+        return init_bloom_filter(&set->bloom) && (config.seen_spill_path == NULL || init_seen_spill(&set->spill));
+    }
+
+    for(int i = 0; i < SEEN_SHARDS; i++){
+
+        seen_shard *shard = &set->shards[i];
+
+        shard->capacity = 1024;
+        shard->count = 0;
+        shard->slots = (uint64_t *) calloc(shard->capacity, sizeof(uint64_t));
+
+        if(shard->slots == NULL){
+            append_to_log_file("Memory allocation failed");
+            return false;
+        }
+
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
+    return true;
+}
+
+
+//Doubles a shard's table. Called with the shard lock held.
+bool grow_seen_shard(seen_shard *shard){
+
+    size_t capacity = shard->capacity * 2;
+    uint64_t *slots = (uint64_t *) calloc(capacity, sizeof(uint64_t));
+
+    if(slots == NULL){
+        return false;
+    }
+
+    for(size_t i = 0; i < shard->capacity; i++){
+
+        uint64_t fp = shard->slots[i];
+
+        if(fp != 0){
+            size_t pos = fp & (capacity - 1);
+
+            while(slots[pos] != 0){
+                pos = (pos + 1) & (capacity - 1);
+            }
+
+            slots[pos] = fp;
+        }
+    }
+
+    free(shard->slots);
+    shard->slots = slots;
+    shard->capacity = capacity;
+
+    return true;
+}
+
+
+/*
+Sets the fingerprint's k bits in its block. The block comes from the fingerprint
+itself (multiply-shift onto block_count); the bit positions come from a remixed
+copy, combined by double hashing. 
+
+@return bool: true if at least one bit was clear, i.e. the URL is definitely new.
+*/
+bool bloom_insert(bloom_filter *bloom, uint64_t fp){
+
+    size_t block = (size_t) (((unsigned __int128) fp * bloom->block_count) >> 64);
+    _Atomic uint64_t *words = &bloom->blocks[block * 8];
+
+    uint64_t g = (fp ^ (fp >> 31)) * 0x94D049BB133111EBULL;
+    uint32_t h1 = (uint32_t) g;
+    uint32_t h2 = (uint32_t) (g >> 32) | 1;
+    bool was_new = false;
+
+    for(int i = 0; i < bloom->k; i++){
+
+        uint32_t bit = (h1 + (uint32_t) i * h2) & 511;
+        uint64_t mask = 1ULL << (bit & 63);
+
+        //Skip the atomic write when the bit is already set; that is the common case on a busy filter.
+        if((atomic_load_explicit(&words[bit >> 6], memory_order_relaxed) & mask) == 0){
+            if((atomic_fetch_or_explicit(&words[bit >> 6], mask, memory_order_relaxed) & mask) == 0){
+                was_new = true;
+            }
+        }
+    }
+
+    if(was_new){
+        atomic_fetch_add_explicit(&bloom->inserted, 1, memory_order_relaxed);
+    }
+
+    return was_new;
+}
+
+
+/*
+Looks the fingerprint up in the spill file and adds it if absent. 
+
+@param bool insert_only: the filter already proved the URL new, so skip straight to the first free slot.
+@return bool: true if the fingerprint was not in the file.
+*/
+bool spill_insert(seen_spill *spill, uint64_t fp, bool insert_only){
+
+    int part = (int) (fp >> 58);
+    size_t base = (size_t) part * spill->partition_slots;
+    size_t pos = fp % spill->partition_slots;
+    bool inserted = false;
+    uint64_t slot;
+
+    pthread_mutex_lock(&spill->locks[part]);
+
+    for(size_t probes = 0; probes < spill->partition_slots; probes++){
+
+        off_t offset = (off_t) ((base + pos) * sizeof(uint64_t));
+
+        if(pread(spill->fd, &slot, sizeof(slot), offset) != sizeof(slot)){
+            slot = 0;
+        }
+
+        if(slot == fp && !insert_only){
+            break;
+        }
+
+        if(slot == 0){
+            inserted = pwrite(spill->fd, &fp, sizeof(fp), offset) == sizeof(fp);
+            break;
+        }
+
+        pos = (pos + 1) % spill->partition_slots;
+    }
+
+    pthread_mutex_unlock(&spill->locks[part]);
+
+    if(!inserted && slot != fp){
+        atomic_fetch_add(&spill->full, 1);
+    }
+
+    return inserted;
+}
+
+
+/*
+Adds a fingerprint to the set. The top bits pick the shard and the low bits the
+starting slot, so the two choices are independent. 
+
+In SEEN_BLOOM mode a filter hit is only trusted when there is no spill file; with one,
+the file decides, so no URL is wrongly skipped. 
+
+@return bool: true if the fingerprint was new, false if it was already present.
+*/
+bool seen_insert(seen_set *set, uint64_t fp){
+
+    if(set->backend == SEEN_BLOOM){
+
+        bool was_new = bloom_insert(&set->bloom, fp);
+
+        if(set->spill.fd < 0){
+            return was_new;
+        }
+
+        if(was_new){
+            spill_insert(&set->spill, fp, true);
+            return true;
+        }
+
+        if(spill_insert(&set->spill, fp, false)){
+            atomic_fetch_add(&set->spill.false_positives, 1);
+            return true;
+        }
+
+        return false;
+    }
+
+    seen_shard *shard = &set->shards[fp >> 58];
+    bool inserted = false;
+
+    pthread_mutex_lock(&shard->lock);
+
+    //Keep the load factor under 0.7 so probe chains stay short.
+    if((shard->count + 1) * 10 > shard->capacity * 7 && !grow_seen_shard(shard)){
+        append_to_log_file("Memory allocation failed");
+    }
+
+    size_t mask = shard->capacity - 1;
+    size_t pos = fp & mask;
+
+    while(shard->slots[pos] != 0 && shard->slots[pos] != fp){
+        pos = (pos + 1) & mask;
+    }
+
+    if(shard->slots[pos] == 0 && shard->count < shard->capacity - 1){
+        shard->slots[pos] = fp;
+        shard->count++;
+        inserted = true;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return inserted;
+}
+
+
+
+/*
+Prints how the frontier's seen-set held up. For the Bloom filter the false-positive
+rate is estimated from the fraction of bits set; with a spill file we also know how
+many filter hits were actually new URLs.
+*/
+void report_seen_set(seen_set *set){
+
+    if(set->backend != SEEN_BLOOM){
+        return;
+    }
+
+    bloom_filter *bloom = &set->bloom;
+    size_t words = bloom->block_count * 8;
+    uint64_t ones = 0;
+
+    for(size_t i = 0; i < words; i++){
+        ones += __builtin_popcountll(atomic_load_explicit(&bloom->blocks[i], memory_order_relaxed));
+    }
+
+    double fill = (double) ones / (double) (words * 64);
+
+    printf("Seen-set: bloom filter, %.1f MB, k=%d, %ld URLs, %.2f%% of bits set, estimated false-positive rate %.6f\n",
+           (double) bloom->block_count * CACHE_LINE / (1024.0 * 1024.0), bloom->k, atomic_load(&bloom->inserted),
+           fill * 100.0, pow(fill, bloom->k));
+
+    if(set->spill.fd >= 0){
+        printf("Seen-set: spill file caught %ld false positives, %ld inserts dropped (partition full)\n",
+               atomic_load(&set->spill.false_positives), atomic_load(&set->spill.full));
+    }
+}
+
+
+
+/*
+-----------------------------------------
+|      URL resolution and interning     |
+-----------------------------------------
+Every link goes through resolve_url() before it is queued. It resolves the href 
+against the page's base URL (RFC 3986 section 5.2) and normalizes the result: scheme 
+and host in lower case, default port dropped, dot segments removed, fragment dropped, 
+percent escapes of unreserved characters decoded and the rest in upper case, and 
+session parameters (--strip-param) removed from the query and from ";name=" path 
+parameters. Links that are not http or https (javascript:, mailto:, ...) and links 
+that only point elsewhere in the same page are rejected. The resolver works entirely
+in the caller's buffer and a few on the stack.
+
+A URL that makes it into the frontier is interned once in an append-only arena: a 
+64-bit fingerprint followed by the NUL terminated string, addressed by a 32-bit id 
+(block number in the top 8 bits, offset in the low 24). Queue nodes and ring slots 
+carry only the id. Nothing in the arena is freed before the crawl ends, so the 
+strings can be handed around without copying.
+*/
+
+//A piece of a URL; ptr is NULL when the component is absent, which differs from empty.
+typedef struct url_part{
+    const char *ptr;
+    size_t len;
+} url_part;
+
+typedef struct url_parts{
+    url_part scheme, authority, path, query;
+} url_parts;
+
+
+//Splits a URL reference into its components (RFC 3986 appendix B). The fragment is dropped.
+static void split_url(const char *s, size_t len, url_parts *u){
+
+    const char *end = s + len;
+    const char *p = s;
+
+    memset(u, 0, sizeof(*u));
+
+    //A scheme is a letter followed by letters, digits, '+', '-' or '.', then ':'.
+    if(p < end && isalpha((unsigned char) *p)){
+
+        const char *q = p + 1;
+
+        while(q < end && (isalnum((unsigned char) *q) || *q == '+' || *q == '-' || *q == '.')) q++;
+
+        if(q < end && *q == ':'){
+            u->scheme = (url_part) { p, (size_t) (q - p) };
+            p = q + 1;
+        }
+    }
+
+    if(end - p >= 2 && p[0] == '/' && p[1] == '/'){
+        const char *q = p + 2;
+        while(q < end && *q != '/' && *q != '?' && *q != '#') q++;
+        u->authority = (url_part) { p + 2, (size_t) (q - p - 2) };
+        p = q;
+    }
+
+    const char *q = p;
+    while(q < end && *q != '?' && *q != '#') q++;
+    u->path = (url_part) { p, (size_t) (q - p) };
+    p = q;
+
+    if(p < end && *p == '?'){
+        q = p + 1;
+        while(q < end && *q != '#') q++;
+        u->query = (url_part) { p + 1, (size_t) (q - p - 1) };
+    }
+}
+
+
+//Removes "." and ".." segments (RFC 3986 section 5.2.4). out needs room for len bytes.
+static size_t remove_dot_segments(const char *in, size_t len, char *out){
+
+    size_t i = 0, o = 0;
+
+    while(i < len){
+
+        const char *p = in + i;
+        size_t r = len - i;
+
+        if(r >= 3 && memcmp(p, "../", 3) == 0)      i += 3;
+        else if(r >= 2 && memcmp(p, "./", 2) == 0)  i += 2;
+        else if(r >= 3 && memcmp(p, "/./", 3) == 0) i += 2;
+        else if(r == 2 && memcmp(p, "/.", 2) == 0)  { out[o++] = '/'; i = len; }
+
+        else if((r >= 4 && memcmp(p, "/../", 4) == 0) || (r == 3 && memcmp(p, "/..", 3) == 0)){
+
+            while(o > 0 && out[o - 1] != '/') o--;
+            if(o > 0) o--;
+
+            if(r == 3){
+                out[o++] = '/';
+                i = len;
+            }
+
+            else {
+                i += 3;
+            }
+        }
+
+        else if((r == 1 && p[0] == '.') || (r == 2 && memcmp(p, "..", 2) == 0)){
+            i = len;
+        }
+
+        else {
+            do {
+                out[o++] = in[i++];
+            } while(i < len && in[i] != '/');
+        }
+    }
+
+    return o;
+}
+
+
+//Is name one of the session parameters we strip?
+static bool is_session_param(const char *name, size_t len){
+
+    for(size_t i = 0; i < sizeof(default_strip_params) / sizeof(default_strip_params[0]); i++){
+        if(strlen(default_strip_params[i]) == len && strncasecmp(default_strip_params[i], name, len) == 0){
+            return true;
+        }
+    }
+
+    for(int i = 0; i < config.strip_param_count; i++){
+        if(strlen(config.strip_params[i]) == len && strncasecmp(config.strip_params[i], name, len) == 0){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static int hex_value(char c){
+
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+/*
+Appends src to out, decoding %XX escapes of unreserved characters and putting the
+hex digits of the others in upper case. Spaces become %20.
+
+@return bool: false if out is full.
+*/
+static bool append_escaped(char *out, size_t *o, size_t cap, const char *src, size_t len){
+
+    static const char hex[] = "0123456789ABCDEF";
+
+    for(size_t i = 0; i < len; i++){
+
+        char c = src[i];
+
+        if(c == '%' && i + 2 < len && hex_value(src[i + 1]) >= 0 && hex_value(src[i + 2]) >= 0){
+
+            char decoded = (char) (hex_value(src[i + 1]) * 16 + hex_value(src[i + 2]));
+
+            if(isalnum((unsigned char) decoded) || decoded == '-' || decoded == '.' || decoded == '_' || decoded == '~'){
+                if(*o + 1 >= cap) return false;
+                out[(*o)++] = decoded;
+            }
+
+            else {
+                if(*o + 3 >= cap) return false;
+                out[(*o)++] = '%';
+                out[(*o)++] = (char) toupper((unsigned char) src[i + 1]);
+                out[(*o)++] = (char) toupper((unsigned char) src[i + 2]);
+            }
+
+            i += 2;
+        }
+
+        else if(c == ' '){
+            if(*o + 3 >= cap) return false;
+            out[(*o)++] = '%';
+            out[(*o)++] = hex[(unsigned char) c >> 4];
+            out[(*o)++] = hex[(unsigned char) c & 15];
+        }
+
+        else {
+            if(*o + 1 >= cap) return false;
+            out[(*o)++] = c;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+Resolves href against base and writes the normalized absolute URL into out.
+
+@param const char *base: absolute URL of the page the link is on, or NULL for a URL that must already be absolute.
+@param const char *href: the link as written; need not be NUL terminated.
+@param size_t len: its length.
+@return size_t: length of the URL in out, or 0 if the link is rejected.
+*/
+size_t resolve_url(const char *base, const char *href, size_t len, char *out, size_t cap){
+
+    char ref[URL_MAX];
+    size_t n = 0;
+
+    //Leading and trailing blanks are dropped and tabs and newlines inside removed, as browsers do.
+    while(len > 0 && (unsigned char) *href <= ' ') { href++; len--; }
+    while(len > 0 && (unsigned char) href[len - 1] <= ' ') len--;
+
+    for(size_t i = 0; i < len; i++){
+
+        if(href[i] == '\t' || href[i] == '\n' || href[i] == '\r'){
+            continue;
+        }
+
+        if(n + 1 >= sizeof(ref)){
+            return 0;
+        }
+
+        ref[n++] = href[i];
+    }
+
+    url_parts r, b, t;
+    split_url(ref, n, &r);
+
+    if(r.scheme.ptr != NULL){
+        t = r;
+    }
+
+    else {
+
+        if(base == NULL){
+            return 0;
+        }
+
+        split_url(base, strlen(base), &b);
+
+        if(b.scheme.ptr == NULL || b.authority.ptr == NULL){
+            return 0;
+        }
+
+        t.scheme = b.scheme;
+
+        if(r.authority.ptr != NULL){
+            t.authority = r.authority;
+            t.path = r.path;
+            t.query = r.query;
+        }
+
+        //"" and "#top" are the page itself.
+        else if(r.path.len == 0 && r.query.ptr == NULL){
+            return 0;
+        }
+
+        else {
+            t.authority = b.authority;
+            t.path = (r.path.len == 0) ? b.path : r.path;
+            t.query = (r.path.len == 0 && r.query.ptr == NULL) ? b.query : r.query;
+        }
+    }
+
+    bool https = (t.scheme.len == 5 && strncasecmp(t.scheme.ptr, "https", 5) == 0);
+
+    if(!(https || (t.scheme.len == 4 && strncasecmp(t.scheme.ptr, "http", 4) == 0)) || t.authority.ptr == NULL){
+        return 0;
+    }
+
+    //Scheme, then the authority with the host in lower case and a default or empty port dropped.
+    size_t o = 0;
+    const char *auth = t.authority.ptr;
+    size_t auth_len = t.authority.len;
+    const char *host = auth;
+
+    for(size_t i = 0; i < auth_len; i++){
+        if(auth[i] == '@') host = auth + i + 1;
+    }
+
+    const char *auth_end = auth + auth_len;
+    const char *port = NULL;
+
+    for(const char *c = auth_end; c > host; c--){
+        if(c[-1] == ':') { port = c - 1; break; }
+        if(c[-1] == ']') break;
+    }
+
+    if(port != NULL){
+        size_t port_len = auth_end - port - 1;
+        if(port_len == 0 || (!https && port_len == 2 && memcmp(port + 1, "80", 2) == 0) ||
+           (https && port_len == 3 && memcmp(port + 1, "443", 3) == 0)){
+            auth_end = port;
+        }
+    }
+
+    if(host == auth_end || t.scheme.len + 3 + (auth_end - auth) + 1 >= cap){
+        return 0;
+    }
+
+    for(size_t i = 0; i < t.scheme.len; i++) out[o++] = (char) tolower((unsigned char) t.scheme.ptr[i]);
+    memcpy(out + o, "://", 3);
+    o += 3;
+
+    for(const char *c = auth; c < auth_end; c++){
+        out[o++] = (c >= host) ? (char) tolower((unsigned char) *c) : *c;
+    }
+
+    //Path: merge a relative one with the base directory, then drop dot segments.
+    char merged[URL_MAX];
+    char path[URL_MAX];
+    size_t merged_len = 0;
+
+    if(t.path.len > 0 && t.path.ptr[0] != '/' && r.scheme.ptr == NULL && r.authority.ptr == NULL){
+
+        size_t dir = 0;
+
+        for(size_t i = 0; i < b.path.len; i++){
+            if(b.path.ptr[i] == '/') dir = i + 1;
+        }
+
+        if(dir == 0){
+            merged[merged_len++] = '/';
+        }
+
+        if(dir + t.path.len >= sizeof(merged)){
+            return 0;
+        }
+
+        memcpy(merged + merged_len, b.path.ptr, dir);
+        merged_len += dir;
+        memcpy(merged + merged_len, t.path.ptr, t.path.len);
+        merged_len += t.path.len;
+    }
+
+    else {
+        memcpy(merged, t.path.ptr, t.path.len);
+        merged_len = t.path.len;
+    }
+
+    size_t path_len = remove_dot_segments(merged, merged_len, path);
+
+    if(path_len == 0 || path[0] != '/'){
+
+        if(path_len + 1 >= sizeof(path)){
+            return 0;
+        }
+
+        memmove(path + 1, path, path_len);
+        path[0] = '/';
+        path_len++;
+    }
+
+    //Copy segment by segment so ";jsessionid=..." style parameters can be left out.
+    for(size_t i = 0; i < path_len; ){
+
+        size_t seg_end = i + 1;
+        while(seg_end < path_len && path[seg_end] != '/') seg_end++;
+
+        const char *semi = memchr(path + i, ';', seg_end - i);
+
+        if(semi != NULL){
+
+            //The path is not NUL terminated here, so the name is scanned only up to the segment's end.
+            const char *name = semi + 1;
+            size_t name_len = 0;
+
+            while(name + name_len < path + seg_end && name[name_len] != '=' && name[name_len] != ';') name_len++;
+
+            if(is_session_param(name, name_len)){
+                if(!append_escaped(out, &o, cap, path + i, semi - (path + i))) return 0;
+                i = seg_end;
+                continue;
+            }
+        }
+
+        if(!append_escaped(out, &o, cap, path + i, seg_end - i)) return 0;
+        i = seg_end;
+    }
+
+    //Query, without the session parameters.
+    if(t.query.ptr != NULL){
+
+        size_t query_start = o;
+        const char *q = t.query.ptr;
+        const char *q_end = q + t.query.len;
+
+        while(q < q_end){
+
+            const char *amp = memchr(q, '&', q_end - q);
+            const char *param_end = amp ? amp : q_end;
+            const char *equals = memchr(q, '=', param_end - q);
+            size_t name_len = (equals ? equals : param_end) - q;
+
+            if(param_end > q && !is_session_param(q, name_len)){
+
+                if(o + 1 >= cap) return 0;
+                out[o] = (o == query_start) ? '?' : '&';
+                o++;
+
+                if(!append_escaped(out, &o, cap, q, param_end - q)) return 0;
+            }
+
+            q = amp ? amp + 1 : q_end;
+        }
+    }
+
+    out[o] = '\0';
+
+    return o;
+}
+
+
+
+#define ARENA_BLOCK_BITS 24
+#define ARENA_BLOCK_SIZE ((size_t) 1 << ARENA_BLOCK_BITS)    //16 MB
+#define ARENA_BLOCKS 256                                      //So ids fit in 32 bits.
+static struct {
+    char *blocks[ARENA_BLOCKS];
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t cursor;   //Block in the high 32 bits, offset in the low 32.
+    pthread_mutex_t lock;                               //Taken only to open or move past a block.
+    atomic_long strings;
+    atomic_long bytes;
+} url_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+/*
+Stores a URL in the arena. Lock-free except when a block fills up.
+
+@param uint64_t fingerprint: url_fingerprint(url), kept next to the string.
+@return url_id: the URL's id, or URL_NONE once the arena is exhausted.
+*/
+url_id intern_url(const char *url, size_t len, uint64_t fingerprint){
+
+    size_t need = (sizeof(uint64_t) + len + 1 + 7) & ~(size_t) 7;
+
+    if(need > ARENA_BLOCK_SIZE){
+        return URL_NONE;
+    }
+
+    while(1){
+
+        uint64_t cur = atomic_fetch_add(&url_arena.cursor, need);
+        uint64_t block = cur >> 32;
+        uint64_t offset = cur & 0xFFFFFFFFu;
+
+        if(block >= ARENA_BLOCKS){
+            append_to_log_file("URL arena is full");
+            return URL_NONE;
+        }
+
+        if(offset + need <= ARENA_BLOCK_SIZE){
+
+            char *base = atomic_load_explicit((_Atomic(char *) *) &url_arena.blocks[block], memory_order_acquire);
+
+            //The first URL to land in a block opens it.
+            if(base == NULL){
+
+                pthread_mutex_lock(&url_arena.lock);
+
+                base = url_arena.blocks[block];
+
+                if(base == NULL && (base = (char *) malloc(ARENA_BLOCK_SIZE)) != NULL){
+                    atomic_store_explicit((_Atomic(char *) *) &url_arena.blocks[block], base, memory_order_release);
+                }
+
+                pthread_mutex_unlock(&url_arena.lock);
+
+                if(base == NULL){
+                    append_to_log_file("Memory allocation failed");
+                    return URL_NONE;
+                }
+            }
+
+            memcpy(base + offset, &fingerprint, sizeof(uint64_t));
+            memcpy(base + offset + sizeof(uint64_t), url, len);
+            base[offset + sizeof(uint64_t) + len] = '\0';
+
+            atomic_fetch_add(&url_arena.strings, 1);
+            atomic_fetch_add(&url_arena.bytes, need);
+
+            return (url_id) ((block << ARENA_BLOCK_BITS) | offset);
+        }
+
+        //The block is full: the first thread to notice moves the cursor on to the next one.
+        pthread_mutex_lock(&url_arena.lock);
+
+        if((atomic_load(&url_arena.cursor) >> 32) == block){
+            atomic_store(&url_arena.cursor, (block + 1) << 32);
+        }
+
+        pthread_mutex_unlock(&url_arena.lock);
+    }
+}
+
+
+//The string of an interned URL.
+const char* url_string(url_id id){
+
+    return url_arena.blocks[id >> ARENA_BLOCK_BITS] + (id & (ARENA_BLOCK_SIZE - 1)) + sizeof(uint64_t);
+}
+
+
+//The fingerprint of an interned URL.
+uint64_t url_hash(url_id id){
+
+    uint64_t fingerprint;
+
+    memcpy(&fingerprint, url_arena.blocks[id >> ARENA_BLOCK_BITS] + (id & (ARENA_BLOCK_SIZE - 1)), sizeof(uint64_t));
+
+    return fingerprint;
+}
+
+
+void report_url_arena(void){
+
+    printf("URL arena: %ld URLs in %.1f MB\n", atomic_load(&url_arena.strings), atomic_load(&url_arena.bytes) / 1048576.0);
+}
+
+
+
+/*
+Lock-free push onto the frontier ring (Vyukov's bounded MPMC queue). 
+
+@return bool: false if the ring is full.
+*/
+bool ring_push(URLQueue *URLS, const frontier_item *item){
+
+    size_t pos = atomic_load_explicit(&URLS->enqueue_pos, memory_order_relaxed);
+    URLQueueSlot *slot;
+
+    while(1){
+
+        slot = &URLS->slots[pos & URLS->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+
+        if(dif == 0){
+            if(atomic_compare_exchange_weak_explicit(&URLS->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+        }
+
+        else if(dif < 0){
+            return false;
+        }
+
+        else {
+            pos = atomic_load_explicit(&URLS->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->html_url = item->id;
+    slot->depth = item->depth;
+    slot->kind = item->kind;
+    slot->host = item->host;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+    return true;
+}
+
+
+/*
+Lock-free pop from the frontier ring. 
+
+@param frontier_item *item: receives the URL, its depth and its host.
+@return bool: false if the ring is empty.
+*/
+bool ring_pop(URLQueue *URLS, frontier_item *item){
+
+    size_t pos = atomic_load_explicit(&URLS->dequeue_pos, memory_order_relaxed);
+    URLQueueSlot *slot;
+
+    while(1){
+
+        slot = &URLS->slots[pos & URLS->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if(dif == 0){
+            if(atomic_compare_exchange_weak_explicit(&URLS->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+        }
+
+        else if(dif < 0){
+            return false;
+        }
+
+        else {
+            pos = atomic_load_explicit(&URLS->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    item->id = slot->html_url;
+    item->url = url_string(slot->html_url);
+    item->depth = slot->depth;
+    item->kind = slot->kind;
+    item->host = slot->host;
+    atomic_store_explicit(&slot->sequence, pos + URLS->mask + 1, memory_order_release);
+
+    return true;
+}
+
+
+/*
+Hands a URL that is allowed to be fetched now to the workers: onto the ring, or the
+overflow list if the ring is full. Takes ownership of node.
+*/
+void frontier_push(URLQueue *URLS, URLQueueNode *node){
+
+    frontier_item item = { node->html_url, NULL, node->depth, node->kind, node->host };
+
+    if(ring_push(URLS, &item)){
+        free(node);
+    }
+
+    else {
+
+        //Ring is full, spill to the overflow list.
+        node -> next_URL = NULL;
+
+        pthread_mutex_lock(&URLS->lock);
+        
+        if(URLS -> tail) {
+
+            URLS->tail->next_URL = node;
+        } 
+        
+        else {
+            URLS -> head = node;
+        }
+
+        URLS -> tail = node;
+        atomic_fetch_add(&URLS->overflow_count, 1);
+        pthread_mutex_unlock(&URLS->lock);
+    }
+
+    //Wake a parked worker, if any. Pairs with the idle_workers increment in dequeue_URL().
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(atomic_load(&URLS->idle_workers) > 0){
+        pthread_mutex_lock(&URLS->lock);
+        pthread_cond_signal(&URLS->wake);
+        pthread_mutex_unlock(&URLS->lock);
+    }
+}
+
+
+
+/*
+-----------------------------------------
+|          robots.txt rules             |
+-----------------------------------------
+The Allow and Disallow lines that apply to us are compiled into a trie over their 
+path patterns. A '*' in a pattern becomes a ROBOTS_STAR edge that matches any run of 
+bytes and a trailing '$' becomes a ROBOTS_END edge that only matches at the end of 
+the path. A node where a rule ends carries its verdict. Checking a path is one pass 
+over its bytes with every still-matching rule advanced in step, so a robots.txt full 
+of stars cannot make it backtrack; of all the rules that match, the longest wins, and
+Allow wins a tie (RFC 9309).
+*/
+
+#define ROBOTS_STAR 256
+#define ROBOTS_END 257
+
+
+//Adds one rule to the trie. An empty pattern matches nothing and is skipped.
+bool robots_add_rule(robots_rules *rules, const char *pattern, size_t len, int verdict){
+
+    if(len == 0){
+        return true;
+    }
+
+    int node = 0;
+
+    for(size_t i = 0; i < len; i++){
+
+        int label = (unsigned char) pattern[i];
+
+        if(pattern[i] == '*'){
+
+            //A run of stars matches what one does.
+            if(i > 0 && pattern[i - 1] == '*'){
+                continue;
+            }
+
+            label = ROBOTS_STAR;
+        }
+
+        else if(pattern[i] == '$' && i == len - 1){
+            label = ROBOTS_END;
+        }
+
+        int child = rules->nodes[node].first_child;
+
+        while(child >= 0 && rules->nodes[child].label != label){
+            child = rules->nodes[child].next_sibling;
+        }
+
+        if(child < 0){
+
+            if(rules->count == rules->capacity){
+
+                int capacity = rules->capacity * 2;
+                robots_node *nodes = (robots_node *) realloc(rules->nodes, capacity * sizeof(robots_node));
+
+                if(nodes == NULL){
+                    return false;
+                }
+
+                rules->nodes = nodes;
+                rules->capacity = capacity;
+            }
+
+            child = rules->count++;
+            rules->nodes[child] = (robots_node) { (int16_t) label, 0, 0, -1, rules->nodes[node].first_child };
+            rules->nodes[node].first_child = child;
+        }
+
+        node = child;
+    }
+
+    robots_node *end = &rules->nodes[node];
+
+    //The same pattern twice: Allow wins, as it would on a tie between different patterns.
+    if(end->verdict == 0 || verdict > 0){
+        end->verdict = (int8_t) verdict;
+        end->length = (int) len;
+    }
+
+    return true;
+}
+
+
+//An empty rule set, which allows everything.
+robots_rules* create_robots_rules(void){
+
+    robots_rules *rules = (robots_rules *) malloc(sizeof(robots_rules));
+
+    if(rules == NULL){
+        return NULL;
+    }
+
+    rules->capacity = 16;
+    rules->count = 1;
+    rules->nodes = (robots_node *) malloc(rules->capacity * sizeof(robots_node));
+
+    if(rules->nodes == NULL){
+        free(rules);
+        return NULL;
+    }
+
+    rules->nodes[0] = (robots_node) { -1, 0, 0, -1, -1 };
+
+    return rules;
+}
+
+
+void free_robots_rules(robots_rules *rules){
+
+    if(rules != NULL){
+        free(rules->nodes);
+        free(rules);
+    }
+}
+
+
+/*
+Thread-local scratch for robots_allowed(): two node lists and a stamp per node, so a
+node is entered at most once per path byte.
+*/
+static __thread int *robots_sets = NULL;
+static __thread unsigned *robots_marks = NULL;
+static __thread int robots_scratch_nodes = 0;
+static __thread unsigned robots_stamp = 0;
+
+
+//Makes room for a trie of count nodes in this thread's scratch.
+static bool robots_reserve(int count){
+
+    if(count <= robots_scratch_nodes){
+        return true;
+    }
+
+    int *sets = (int *) realloc(robots_sets, 2 * (size_t) count * sizeof(int));
+
+    if(sets == NULL){
+        return false;
+    }
+
+    robots_sets = sets;
+
+    unsigned *marks = (unsigned *) realloc(robots_marks, (size_t) count * sizeof(unsigned));
+
+    if(marks == NULL){
+        return false;
+    }
+
+    memset(marks, 0, (size_t) count * sizeof(unsigned));
+    robots_marks = marks;
+    robots_scratch_nodes = count;
+    robots_stamp = 0;
+
+    return true;
+}
+
+
+/*
+Adds a node to the active set unless it is already there for this byte, records its
+verdict, and follows any '*' edge out of it, since a star also matches the empty run.
+
+@return int: the new size of the set.
+*/
+static int robots_enter(const robots_rules *rules, int node, int *set, int size, int *best_length, int *best_verdict){
+
+    if(robots_marks[node] == robots_stamp){
+        return size;
+    }
+
+    robots_marks[node] = robots_stamp;
+    set[size++] = node;
+
+    const robots_node *n = &rules->nodes[node];
+
+    if(n->verdict != 0 && (n->length > *best_length || (n->length == *best_length && n->verdict > 0))){
+        *best_length = n->length;
+        *best_verdict = n->verdict;
+    }
+
+    for(int child = n->first_child; child >= 0; child = rules->nodes[child].next_sibling){
+        if(rules->nodes[child].label == ROBOTS_STAR){
+            size = robots_enter(rules, child, set, size, best_length, best_verdict);
+        }
+    }
+
+    return size;
+}
+
+
+//Starts a fresh stamp for the next path byte, clearing the marks when it wraps.
+static void robots_next_stamp(void){
+
+    if(++robots_stamp == 0){
+        memset(robots_marks, 0, (size_t) robots_scratch_nodes * sizeof(unsigned));
+        robots_stamp = 1;
+    }
+}
+
+
+/*
+Runs the path through the trie as a set of active nodes, one step per byte: every rule
+that can still match is advanced together, so the check is linear in the path length
+however many '*' the patterns hold. A star node stays active on any byte.
+*/
+static void robots_walk(const robots_rules *rules, const char *path, size_t len, int *best_length, int *best_verdict){
+
+    int *active = robots_sets;
+    int *next = robots_sets + rules->count;
+
+    robots_next_stamp();
+    int active_size = robots_enter(rules, 0, active, 0, best_length, best_verdict);
+
+    for(size_t pos = 0; pos < len && active_size > 0; pos++){
+
+        int label = (unsigned char) path[pos];
+        int next_size = 0;
+
+        robots_next_stamp();
+
+        for(int i = 0; i < active_size; i++){
+
+            int node = active[i];
+
+            if(rules->nodes[node].label == ROBOTS_STAR){
+                next_size = robots_enter(rules, node, next, next_size, best_length, best_verdict);
+            }
+
+            for(int child = rules->nodes[node].first_child; child >= 0; child = rules->nodes[child].next_sibling){
+                if(rules->nodes[child].label == label){
+                    next_size = robots_enter(rules, child, next, next_size, best_length, best_verdict);
+                }
+            }
+        }
+
+        int *swap = active;
+        active = next;
+        next = swap;
+        active_size = next_size;
+    }
+
+    //A '$' edge matches once the whole path is consumed.
+    robots_next_stamp();
+
+    for(int i = 0; i < active_size; i++){
+        for(int child = rules->nodes[active[i]].first_child; child >= 0; child = rules->nodes[child].next_sibling){
+            if(rules->nodes[child].label == ROBOTS_END){
+                robots_enter(rules, child, next, 0, best_length, best_verdict);
+            }
+        }
+    }
+}
+
+
+/*
+Checks a URL against compiled rules. The path that is matched runs from the first '/' 
+after the host up to any fragment, query string included.
+
+@return bool: true if the URL may be fetched.
+*/
+bool robots_allowed(const robots_rules *rules, const char *url){
+
+    if(rules == NULL || rules->count == 1){
+        return true;
+    }
+
+    const char *path = strstr(url, "://");
+    path = (path == NULL) ? url : path + 3;
+    path += strcspn(path, "/?#");
+
+    size_t len = strcspn(path, "#");
+    int best_length = -1, best_verdict = 1;
+
+    if(len == 0){
+        path = "/";
+        len = 1;
+    }
+
+    //Out of scratch memory: allow, as with no rules at all.
+    if(!robots_reserve(rules->count)){
+        return true;
+    }
+
+    robots_walk(rules, path, len, &best_length, &best_verdict);
+
+    return best_verdict > 0;
+}
+
+
+//Does a User-agent line name us? "*" is handled separately as the fallback group.
+static bool robots_agent_matches(const char *agent, size_t len){
+
+    size_t ours = strlen(ROBOTS_AGENT);
+
+    for(size_t i = 0; i + ours <= len; i++){
+        if(strncasecmp(agent + i, ROBOTS_AGENT, ours) == 0){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*
+Parses a robots.txt body. Only the group naming our agent is used, or the "*" group
+if none does. Sitemap lines apply whatever group they are in; each is passed to 
+on_sitemap.
+
+@return robots_rules*: NULL if memory ran out.
+*/
+robots_rules* parse_robots(const char *body, void (*on_sitemap)(const char *url, void *ctx), void *ctx){
+
+    robots_rules *ours = create_robots_rules();
+    robots_rules *star = create_robots_rules();
+    bool any_ours = false;
+    bool group_ours = false, group_star = false, in_agents = false;
+
+    if(ours == NULL || star == NULL){
+        free_robots_rules(ours);
+        free_robots_rules(star);
+        return NULL;
+    }
+
+    for(const char *line = body; *line != '\0'; ){
+
+        size_t line_len = strcspn(line, "\r\n");
+        const char *next = line + line_len;
+        next += strspn(next, "\r\n");
+
+        //Cut comments and surrounding white space.
+        const char *hash = memchr(line, '#', line_len);
+        size_t len = hash ? (size_t) (hash - line) : line_len;
+
+        while(len > 0 && isspace((unsigned char) line[len - 1])) len--;
+        while(len > 0 && isspace((unsigned char) *line)) { line++; len--; }
+
+        const char *colon = memchr(line, ':', len);
+
+        if(colon != NULL){
+
+            size_t key_len = colon - line;
+            const char *value = colon + 1;
+            size_t value_len = len - key_len - 1;
+
+            while(key_len > 0 && isspace((unsigned char) line[key_len - 1])) key_len--;
+            while(value_len > 0 && isspace((unsigned char) *value)) { value++; value_len--; }
+
+            if(key_len == 10 && strncasecmp(line, "user-agent", 10) == 0){
+
+                //A run of User-agent lines shares the rules that follow it.
+                if(!in_agents){
+                    group_ours = group_star = false;
+                }
+
+                in_agents = true;
+
+                if(value_len == 1 && *value == '*'){
+                    group_star = true;
+                }
+
+                else if(robots_agent_matches(value, value_len)){
+                    group_ours = any_ours = true;
+                }
+            }
+
+            else if((key_len == 5 && strncasecmp(line, "allow", 5) == 0) || (key_len == 8 && strncasecmp(line, "disallow", 8) == 0)){
+
+                int verdict = (key_len == 5) ? 1 : -1;
+
+                in_agents = false;
+
+                if(group_ours) robots_add_rule(ours, value, value_len, verdict);
+                if(group_star) robots_add_rule(star, value, value_len, verdict);
+            }
+
+            else if(key_len == 7 && strncasecmp(line, "sitemap", 7) == 0 && value_len > 0 && on_sitemap != NULL){
+
+                char *url = strndup(value, value_len);
+
+                if(url != NULL){
+                    on_sitemap(url, ctx);
+                    free(url);
+                }
+            }
+        }
+
+        line = next;
+    }
+
+    if(any_ours){
+        free_robots_rules(star);
+        return ours;
+    }
+
+    free_robots_rules(ours);
+    return star;
+}
+
+
+
+/*
+-----------------------------------------
+|             DNS prefetch              |
+-----------------------------------------
+With --dns-prefetch, a host's name is looked up the moment its first URL enters the
+frontier (see lookup_host()), not when a worker gets round to fetching it. A resolver
+thread drives c-ares, so thousands of lookups are in flight at once without a thread
+each, and the answers go into a cache shared by every fetch thread, kept for the
+record's TTL (clamped to DNS_MIN_TTL..DNS_MAX_TTL).
+
+When a fetch starts, init_response() looks its host up in the cache. A fresh answer is
+handed to curl with CURLOPT_RESOLVE, so curl_easy_perform() does not resolve at all.
+A name the server said does not exist (NXDOMAIN or no addresses) is cached for
+--dns-negative-ttl seconds, and fetches of it fail at once without touching the network.
+Anything else, such as a lookup still in flight, a timeout or an expired answer, leaves
+the lookup to curl as before; an expired answer is also looked up again in the background.
+
+CURLOPT_RESOLVE entries never expire in curl's shared DNS cache, and each is for one
+port. So the ports a name was handed out for are remembered: later fetches either 
+replace an entry with a fresh one or, once ours has expired, the next fetch of the name
+removes all of them ("-host:port") so curl looks the name up itself.
+*/
+
+#define DNS_SHARDS 64
+#define DNS_MIN_TTL 30                  //Seconds; very short TTLs would only cause lookups.
+#define DNS_MAX_TTL 3600
+#define DNS_RETRY_AFTER 30              //Seconds before a failed lookup is tried again.
+#define DNS_MAX_INFLIGHT 512            //Lookups c-ares runs at once; the rest wait their turn.
+#define DNS_MAX_ADDRESSES 8             //Addresses handed to curl per name.
+#define DNS_MAX_PORTS 4                 //Ports a name is handed to curl for; others leave it to curl.
+
+enum dns_state { DNS_PENDING, DNS_READY, DNS_MISSING, DNS_FAILED };
+
+//One host name. Entries live until the program exits, so c-ares callbacks can keep a pointer.
+typedef struct dns_entry{
+    char *name;
+    uint64_t hash;
+    enum dns_state state;
+    long expires_ms;                    //When the answer, or the failure, stops counting.
+    char addresses[DNS_MAX_ADDRESSES * 48];   //Comma separated, IPv6 in brackets, as CURLOPT_RESOLVE wants them.
+    int  ports[DNS_MAX_PORTS];          //Curl's shared cache holds an entry we gave it for these.
+    int  port_count;
+    struct dns_entry *next;             //Bucket chain.
+    struct dns_entry *next_request;     //Resolver's wait list.
+} dns_entry;
+
+typedef struct dns_shard{
+    pthread_mutex_t lock;
+    dns_entry **buckets;
+    size_t mask;
+    size_t count;
+} dns_shard;
+
+
+static struct {
+    bool enabled;
+    dns_shard shards[DNS_SHARDS];
+
+    pthread_mutex_t request_lock;       //Guards requests.
+    dns_entry *requests;                //Names waiting for the resolver thread.
+    int wake_pipe[2];
+
+    ares_channel channel;               //Resolver thread only.
+    int inflight;                       //Resolver thread only.
+    pthread_t thread;
+    atomic_bool stopping;
+
+    atomic_long lookups, resolved, missing, failed, injected, skipped;
+} dns = { .request_lock = PTHREAD_MUTEX_INITIALIZER, .wake_pipe = { -1, -1 } };
+
+
+
+/*
+Splits a host_key() into the name and port a fetch connects to. IP literals need no
+lookup and other schemes are not ours to resolve.
+
+@return bool: false if the key has no name worth resolving.
+*/
+bool dns_target(const char *key, char *name, size_t cap, int *port){
+
+    const char *host;
+
+    if(strncmp(key, "http://", 7) == 0){
+        host = key + 7;
+        *port = 80;
+    }
+
+    else if(strncmp(key, "https://", 8) == 0){
+        host = key + 8;
+        *port = 443;
+    }
+
+    else {
+        return false;
+    }
+
+    size_t len = strcspn(host, ":");
+
+    if(len == 0 || len >= cap || host[0] == '['){
+        return false;
+    }
+
+    memcpy(name, host, len);
+    name[len] = '\0';
+
+    if(host[len] == ':'){
+        *port = atoi(host + len + 1);
+    }
+
+    //Dotted quads are already addresses.
+    struct in_addr literal;
+
+    return inet_pton(AF_INET, name, &literal) != 1;
+}
+
+
+//Finds a name's entry, creating it when create is set. Called with its shard locked.
+static dns_entry* find_dns_entry(dns_shard *shard, const char *name, uint64_t hash, bool create){
+
+    size_t b = (hash >> 6) & shard->mask;
+
+    for(dns_entry *e = shard->buckets[b]; e != NULL; e = e->next){
+        if(e->hash == hash && strcmp(e->name, name) == 0){
+            return e;
+        }
+    }
+
+    if(!create){
+        return NULL;
+    }
+
+    dns_entry *e = (dns_entry *) calloc(1, sizeof(dns_entry));
+
+    if(e == NULL || (e->name = strdup(name)) == NULL){
+        free(e);
+        return NULL;
+    }
+
+    e->hash = hash;
+    e->state = DNS_FAILED;      //Expired at 0, so the caller starts a lookup.
+    e->next = shard->buckets[b];
+    shard->buckets[b] = e;
+
+    //Keep chains short: double the buckets whenever there are more entries than buckets.
+    if(++shard->count > shard->mask){
+
+        size_t capacity = (shard->mask + 1) * 2;
+        dns_entry **buckets = (dns_entry **) calloc(capacity, sizeof(dns_entry *));
+
+        if(buckets != NULL){
+
+            for(size_t i = 0; i <= shard->mask; i++){
+
+                dns_entry *chain = shard->buckets[i];
+
+                while(chain != NULL){
+                    dns_entry *next = chain->next;
+                    size_t nb = (chain->hash >> 6) & (capacity - 1);
+                    chain->next = buckets[nb];
+                    buckets[nb] = chain;
+                    chain = next;
+                }
+            }
+
+            free(shard->buckets);
+            shard->buckets = buckets;
+            shard->mask = capacity - 1;
+        }
+    }
+
+    return e;
+}
+
+
+//Interrupts the resolver's poll(). A full pipe already means it is due to wake up, so a failed write is fine.
+static void wake_resolver(void){
+
+    char byte = 0;
+
+    if(write(dns.wake_pipe[1], &byte, 1) < 0){
+        return;
+    }
+}
+
+
+//Puts an entry on the resolver's wait list. Called with its shard locked and the entry marked pending.
+static void request_lookup(dns_entry *e){
+
+    pthread_mutex_lock(&dns.request_lock);
+    e->next_request = dns.requests;
+    dns.requests = e;
+    pthread_mutex_unlock(&dns.request_lock);
+
+    wake_resolver();
+}
+
+
+//Starts a background lookup of the name behind a host_key(), unless a fresh answer or a lookup is already there.
+void dns_prefetch(const char *key){
+
+    char name[256];
+    int port;
+
+    if(!dns.enabled || !dns_target(key, name, sizeof(name), &port)){
+        return;
+    }
+
+    uint64_t hash = hash_bytes(name, strlen(name));
+    dns_shard *shard = &dns.shards[hash & (DNS_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+
+    dns_entry *e = find_dns_entry(shard, name, hash, true);
+
+    if(e != NULL && e->state != DNS_PENDING && e->expires_ms <= monotonic_ms()){
+        e->state = DNS_PENDING;
+        request_lookup(e);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+/*
+Decides how a fetch gets its address. Called by init_response() for every fetch.
+
+@param const char *key: host_key() of the URL being fetched.
+@param struct curl_slist **resolve: receives the CURLOPT_RESOLVE list for the fetch, or stays NULL.
+@return bool: false if the name is known not to exist and the fetch should be skipped.
+*/
+bool dns_prepare(const char *key, struct curl_slist **resolve){
+
+    char name[256], entry[sizeof(((dns_entry *) 0)->addresses) + 300];
+    int port, stale_ports[DNS_MAX_PORTS], stale_count = 0;
+
+    *resolve = NULL;
+
+    if(!dns.enabled){
+        return true;
+    }
+
+    if(!dns_target(key, name, sizeof(name), &port)){
+        return true;
+    }
+
+    uint64_t hash = hash_bytes(name, strlen(name));
+    dns_shard *shard = &dns.shards[hash & (DNS_SHARDS - 1)];
+    long now = monotonic_ms();
+    bool exists = true;
+
+    entry[0] = '\0';
+
+    pthread_mutex_lock(&shard->lock);
+
+    dns_entry *e = find_dns_entry(shard, name, hash, true);
+
+    if(e != NULL){
+
+        bool fresh = (e->expires_ms > now);
+
+        if(e->state == DNS_READY && fresh){
+
+            bool known = false;
+
+            for(int i = 0; i < e->port_count; i++){
+                known |= (e->ports[i] == port);
+            }
+
+            //Only ports we can take out again later are handed out.
+            if(known || e->port_count < DNS_MAX_PORTS){
+
+                if(!known){
+                    e->ports[e->port_count++] = port;
+                }
+
+                snprintf(entry, sizeof(entry), "%s:%d:%s", name, port, e->addresses);
+            }
+        }
+
+        else if(e->state == DNS_MISSING && fresh){
+            exists = false;
+        }
+
+        else if(e->port_count > 0){
+            //Ours are stale; this fetch takes them out of curl's cache, for every port, so curl resolves the name itself.
+            memcpy(stale_ports, e->ports, sizeof(int) * e->port_count);
+            stale_count = e->port_count;
+            e->port_count = 0;
+        }
+
+        if(e->state != DNS_PENDING && !fresh){
+            e->state = DNS_PENDING;
+            request_lookup(e);
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if(!exists){
+        atomic_fetch_add(&dns.skipped, 1);
+        return false;
+    }
+
+    for(int i = 0; i < stale_count; i++){
+
+        char removal[300];
+        snprintf(removal, sizeof(removal), "-%s:%d", name, stale_ports[i]);
+
+        struct curl_slist *list = curl_slist_append(*resolve, removal);
+
+        if(list != NULL){
+            *resolve = list;
+        }
+    }
+
+    if(entry[0] != '\0'){
+
+        *resolve = curl_slist_append(NULL, entry);
+
+        if(*resolve != NULL){
+            atomic_fetch_add(&dns.injected, 1);
+        }
+    }
+
+    return true;
+}
+
+
+//c-ares callback, on the resolver thread: files the answer under the entry.
+static void dns_resolved(void *arg, int status, int timeouts, struct ares_addrinfo *result){
+
+    dns_entry *e = (dns_entry *) arg;
+    dns_shard *shard = &dns.shards[e->hash & (DNS_SHARDS - 1)];
+    char addresses[sizeof(e->addresses)];
+    size_t used = 0;
+    int count = 0, ttl = DNS_MAX_TTL;
+
+    dns.inflight--;
+    addresses[0] = '\0';
+
+    if(status == ARES_SUCCESS && result != NULL){
+
+        for(struct ares_addrinfo_node *node = result->nodes; node != NULL && count < DNS_MAX_ADDRESSES; node = node->ai_next){
+
+            char text[INET6_ADDRSTRLEN];
+            const void *address = (node->ai_family == AF_INET6) ? (const void *) &((struct sockaddr_in6 *) node->ai_addr)->sin6_addr
+                                                                 : (const void *) &((struct sockaddr_in *) node->ai_addr)->sin_addr;
+
+            if((node->ai_family != AF_INET && node->ai_family != AF_INET6) ||
+               inet_ntop(node->ai_family, address, text, sizeof(text)) == NULL){
+                continue;
+            }
+
+            used += snprintf(addresses + used, sizeof(addresses) - used, node->ai_family == AF_INET6 ? "%s[%s]" : "%s%s",
+                             count > 0 ? "," : "", text);
+            count++;
+
+            if(node->ai_ttl < ttl){
+                ttl = node->ai_ttl;
+            }
+        }
+    }
+
+    if(result != NULL){
+        ares_freeaddrinfo(result);
+    }
+
+    //Shutting down: the entry stays pending, nobody asks any more.
+    if(status == ARES_EDESTRUCTION){
+        return;
+    }
+
+    long now = monotonic_ms();
+
+    pthread_mutex_lock(&shard->lock);
+
+    if(count > 0){
+        e->state = DNS_READY;
+        e->expires_ms = now + (ttl < DNS_MIN_TTL ? DNS_MIN_TTL : ttl) * 1000L;
+        memcpy(e->addresses, addresses, used + 1);
+        atomic_fetch_add(&dns.resolved, 1);
+    }
+
+    else if(status == ARES_ENOTFOUND || status == ARES_ENODATA || status == ARES_SUCCESS){
+        e->state = DNS_MISSING;
+        e->expires_ms = now + config.dns_negative_ttl * 1000L;
+        atomic_fetch_add(&dns.missing, 1);
+    }
+
+    else {
+        e->state = DNS_FAILED;
+        e->expires_ms = now + DNS_RETRY_AFTER * 1000L;
+        atomic_fetch_add(&dns.failed, 1);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if(count == 0 && status != ARES_ENOTFOUND && status != ARES_ENODATA && status != ARES_SUCCESS){
+        log_event(status, e->name, ares_strerror(status));
+    }
+}
+
+
+//Hands waiting names to c-ares, as many as DNS_MAX_INFLIGHT allows.
+static void start_lookups(void){
+
+    struct ares_addrinfo_hints hints = { .ai_flags = 0, .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+
+    while(dns.inflight < DNS_MAX_INFLIGHT){
+
+        pthread_mutex_lock(&dns.request_lock);
+        dns_entry *e = dns.requests;
+
+        if(e != NULL){
+            dns.requests = e->next_request;
+        }
+
+        pthread_mutex_unlock(&dns.request_lock);
+
+        if(e == NULL){
+            return;
+        }
+
+        dns.inflight++;
+        atomic_fetch_add(&dns.lookups, 1);
+
+        //May call dns_resolved() right away, e.g. for names in /etc/hosts.
+        ares_getaddrinfo(dns.channel, e->name, NULL, &hints, dns_resolved, e);
+    }
+}
+
+
+//Resolver thread: one poll() over the wake pipe and every socket c-ares has open.
+void * run_resolver(void *arg){
+
+    while(!atomic_load(&dns.stopping)){
+
+        struct pollfd fds[ARES_GETSOCK_MAXNUM + 1];
+        ares_socket_t sockets[ARES_GETSOCK_MAXNUM];
+        int bits = ares_getsock(dns.channel, sockets, ARES_GETSOCK_MAXNUM);
+        int count = 1;
+
+        fds[0] = (struct pollfd) { dns.wake_pipe[0], POLLIN, 0 };
+
+        for(int i = 0; i < ARES_GETSOCK_MAXNUM; i++){
+
+            short events = (ARES_GETSOCK_READABLE(bits, i) ? POLLIN : 0) | (ARES_GETSOCK_WRITABLE(bits, i) ? POLLOUT : 0);
+
+            if(events != 0){
+                fds[count++] = (struct pollfd) { sockets[i], events, 0 };
+            }
+        }
+
+        struct timeval longest = { 0, 200000 }, wait;
+        struct timeval *timeout = ares_timeout(dns.channel, &longest, &wait);
+
+        poll(fds, count, (int) (timeout->tv_sec * 1000 + timeout->tv_usec / 1000));
+
+        if(fds[0].revents & POLLIN){
+
+            char drain[256];
+
+            while(read(dns.wake_pipe[0], drain, sizeof(drain)) > 0){
+                continue;
+            }
+        }
+
+        //Sockets that are ready, then timeouts: ares_process_fd() with no sockets handles those.
+        for(int i = 1; i < count; i++){
+            ares_process_fd(dns.channel, (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) ? fds[i].fd : ARES_SOCKET_BAD,
+                                         (fds[i].revents & POLLOUT) ? fds[i].fd : ARES_SOCKET_BAD);
+        }
+
+        ares_process_fd(dns.channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+
+        start_lookups();
+    }
+
+    return NULL;
+}
+
+
+/*
+Sets up the cache and starts the resolver thread. Call before the first URL is queued.
+
+@return bool: false if c-ares or the thread could not be started.
+*/
+bool start_dns_prefetch(void){
+
+    struct ares_options options = { .timeout = 2000, .tries = 2 };
+    int status;
+
+    for(int i = 0; i < DNS_SHARDS; i++){
+
+        pthread_mutex_init(&dns.shards[i].lock, NULL);
+        dns.shards[i].mask = 63;
+        dns.shards[i].buckets = (dns_entry **) calloc(64, sizeof(dns_entry *));
+
+        if(dns.shards[i].buckets == NULL){
+            append_to_log_file("Memory allocation failed");
+            return false;
+        }
+    }
+
+    if((status = ares_library_init(ARES_LIB_INIT_ALL)) != ARES_SUCCESS ||
+       (status = ares_init_options(&dns.channel, &options, ARES_OPT_TIMEOUTMS | ARES_OPT_TRIES)) != ARES_SUCCESS){
+        log_event(status, NULL, ares_strerror(status));
+        return false;
+    }
+
+    if(pipe2(dns.wake_pipe, O_NONBLOCK | O_CLOEXEC) != 0){
+        log_event(errno, NULL, "Failed to create the resolver's wake pipe");
+        return false;
+    }
+
+    if(pthread_create(&dns.thread, NULL, run_resolver, NULL) != 0){
+        append_to_log_file("Failed to start the resolver thread.");
+        return false;
+    }
+
+    dns.enabled = true;
+
+    return true;
+}
+
+
+void stop_dns_prefetch(void){
+
+    if(!dns.enabled){
+        return;
+    }
+
+    dns.enabled = false;
+    atomic_store(&dns.stopping, true);
+    wake_resolver();
+
+    pthread_join(dns.thread, NULL);
+
+    ares_destroy(dns.channel);
+    ares_library_cleanup();
+    close(dns.wake_pipe[0]);
+    close(dns.wake_pipe[1]);
+}
+
+
+void report_dns(void){
+
+    printf("DNS prefetch: %ld lookups, %ld answered, %ld names do not exist, %ld failed; "
+           "%ld fetches used a prefetched address, %ld skipped as nonexistent\n",
+           atomic_load(&dns.lookups), atomic_load(&dns.resolved), atomic_load(&dns.missing), atomic_load(&dns.failed),
+           atomic_load(&dns.injected), atomic_load(&dns.skipped));
+}
+
+
+
+/*
+-----------------------------------------
+|         Per-host politeness           |
+-----------------------------------------
+URLs do not go straight to the workers. Each one first waits in its host's own queue,
+and a host hands URLs to the frontier ring only while it has a token in its bucket
+(--host-rate per second, up to --host-burst saved up) and fewer than 
+--host-connections of its pages are being fetched. So everything on the ring can be
+fetched right away, and a page with hundreds of same-host links is paced instead of
+burst at the server.
+
+A host that runs out of tokens is parked on a timer wheel: 1ms ticks, WHEEL_SLOTS 
+slots, each holding a list of hosts due in that tick. Parking and firing are O(1); 
+a host due beyond one turn of the wheel simply stays in its slot until its tick comes 
+round. A host held back by its connection limit needs no timer; URL_done() releases 
+its next URL when one of its fetches finishes.
+
+Lock order: host, then wheel or frontier. The wheel thread never holds the wheel lock 
+while it releases a host.
+*/
+
+
+/*
+Writes the host part of url, "scheme://host:port" in lower case without any user 
+info, into key. URLs without a scheme get the empty key and share one host.
+*/
+void host_key(const char *url, char *key, size_t cap){
+
+    const char *scheme_end = strstr(url, "://");
+    size_t n = 0;
+
+    if(scheme_end != NULL){
+
+        const char *start = scheme_end + 3;
+        const char *end = start + strcspn(start, "/?#");
+
+        //Drop user:password@ so it neither leaks into logs nor splits a host in two.
+        for(const char *at = start; at < end; at++){
+            if(*at == '@'){
+                start = at + 1;
+            }
+        }
+
+        for(const char *c = url; c < end && n + 1 < cap; c++){
+
+            if(c == scheme_end + 3){
+                c = start;
+            }
+
+            key[n++] = (char) tolower((unsigned char) *c);
+        }
+    }
+
+    key[n] = '\0';
+}
+
+
+bool init_host_table(host_table *table){
+
+    for(int i = 0; i < HOST_SHARDS; i++){
+
+        host_shard *shard = &table->shards[i];
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->count = 0;
+        shard->mask = 63;
+        shard->buckets = (host_entry **) calloc(shard->mask + 1, sizeof(host_entry *));
+
+        if(shard->buckets == NULL){
+            append_to_log_file("Memory allocation failed");
+            return false;
+        }
+    }
+
+    atomic_init(&table->hosts, 0);
+    atomic_init(&table->throttled, 0);
+    atomic_init(&table->disallowed, 0);
+
+    pthread_mutex_init(&table->wheel_lock, NULL);
+    pthread_cond_init(&table->wheel_wake, NULL);
+    memset(table->wheel, 0, sizeof(table->wheel));
+    table->wheel_tick = 0;
+    table->wheel_count = 0;
+    table->stopping = false;
+
+    return true;
+}
+
+
+//Doubles a shard's bucket array. Called with the shard lock held.
+void grow_host_shard(host_shard *shard){
+
+    size_t capacity = (shard->mask + 1) * 2;
+    host_entry **buckets = (host_entry **) calloc(capacity, sizeof(host_entry *));
+
+    if(buckets == NULL){
+        return;
+    }
+
+    for(size_t i = 0; i <= shard->mask; i++){
+
+        host_entry *h = shard->buckets[i];
+
+        while(h != NULL){
+            host_entry *next = h->next;
+            size_t b = (h->hash >> 6) & (capacity - 1);
+            h->next = buckets[b];
+            buckets[b] = h;
+            h = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->mask = capacity - 1;
+}
+
+
+/*
+Finds the politeness state for url's host, creating it on first sight. Entries live 
+until the program exits, so the pointer can travel with the URL.
+
+@return host_entry*: NULL only if memory ran out.
+*/
+host_entry* lookup_host(host_table *table, const char *url){
+
+    char key[512];
+    host_key(url, key, sizeof(key));
+
+    uint64_t hash = url_fingerprint(key);
+    host_shard *shard = &table->shards[hash & (HOST_SHARDS - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+
+    size_t b = (hash >> 6) & shard->mask;
+
+    for(host_entry *h = shard->buckets[b]; h != NULL; h = h->next){
+        if(h->hash == hash && strcmp(h->name, key) == 0){
+            pthread_mutex_unlock(&shard->lock);
+            return h;
+        }
+    }
+
+    host_entry *h = (host_entry *) calloc(1, sizeof(host_entry));
+
+    if(h == NULL || (h->name = strdup(key)) == NULL){
+        pthread_mutex_unlock(&shard->lock);
+        free(h);
+        append_to_log_file("Memory allocation failed");
+        return NULL;
+    }
+
+    h->hash = hash;
+    h->tokens = config.host_burst;
+    h->refilled_ms = monotonic_ms();
+    pthread_mutex_init(&h->lock, NULL);
+
+    h->next = shard->buckets[b];
+    shard->buckets[b] = h;
+
+    if(++shard->count > shard->mask){
+        grow_host_shard(shard);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add(&table->hosts, 1);
+
+    //First URL of a new host: resolve its name while the URL waits its turn.
+    dns_prefetch(key);
+
+    return h;
+}
+
+
+//Parks a host on the timer wheel until due_ms. Called with the host lock held.
+void schedule_host(host_table *table, host_entry *h, long due_ms){
+
+    pthread_mutex_lock(&table->wheel_lock);
+
+    //An empty wheel has not been ticking; restart it at the present.
+    if(table->wheel_count == 0){
+        table->wheel_tick = monotonic_ms();
+    }
+
+    if(due_ms < table->wheel_tick){
+        due_ms = table->wheel_tick;
+    }
+
+    h->on_wheel = true;
+    h->wheel_due = due_ms;
+    h->wheel_next = table->wheel[due_ms & (WHEEL_SLOTS - 1)];
+    table->wheel[due_ms & (WHEEL_SLOTS - 1)] = h;
+
+    if(table->wheel_count++ == 0){
+        pthread_cond_signal(&table->wheel_wake);
+    }
+
+    pthread_mutex_unlock(&table->wheel_lock);
+}
+
+
+/*
+Moves as many of a host's waiting URLs to the frontier as its token bucket and 
+connection limit allow, and parks the host on the wheel if it ran out of tokens. 
+Called with the host lock held.
+*/
+void host_release(URLQueue *URLS, host_entry *h){
+
+    while(h->head != NULL && (config.host_connections <= 0 || h->inflight < config.host_connections)){
+
+        if(config.host_rate > 0){
+
+            long now = monotonic_ms();
+
+            h->tokens += (now - h->refilled_ms) * config.host_rate / 1000.0;
+            h->refilled_ms = now;
+
+            if(h->tokens > config.host_burst){
+                h->tokens = config.host_burst;
+            }
+
+            if(h->tokens < 1.0){
+
+                if(!h->on_wheel){
+                    schedule_host(&URLS->hosts, h, now + (long) ceil((1.0 - h->tokens) * 1000.0 / config.host_rate));
+                    atomic_fetch_add(&URLS->hosts.throttled, 1);
+                }
+
+                return;
+            }
+
+            h->tokens -= 1.0;
+        }
+
+        URLQueueNode *node = h->head;
+
+        h->head = node->next_URL;
+
+        if(h->head == NULL){
+            h->tail = NULL;
+        }
+
+        h->inflight++;
+        frontier_push(URLS, node);
+    }
+}
+
+
+/*
+Queues a robots.txt fetch for a host, ahead of its other URLs. Called with the host
+lock held.
+*/
+void request_robots(URLQueue *URLS, host_entry *h){
+
+    URLQueueNode *node = (URLQueueNode *) malloc(sizeof(URLQueueNode));
+    char url[URL_MAX];
+    int len = snprintf(url, sizeof(url), "%s/robots.txt", h->name);
+
+    if(node == NULL || len >= (int) sizeof(url) || (node->html_url = intern_url(url, len, url_fingerprint(url))) == URL_NONE){
+        free(node);
+        append_to_log_file("Memory allocation failed");
+        return;
+    }
+
+    node->depth = 0;
+    node->kind = ITEM_ROBOTS;
+    node->host = h;
+    node->next_URL = h->head;
+
+    h->head = node;
+
+    if(h->tail == NULL){
+        h->tail = node;
+    }
+
+    h->robots_state = ROBOTS_FETCHING;
+    atomic_fetch_add(&URLS->outstanding, 1);
+}
+
+
+/*
+Puts a URL in its host's queue and releases it at once if the host has room. The 
+host's robots.txt is consulted first; the first URL of a host triggers the fetch of
+robots.txt, and URLs that arrive before it is in wait for it.
+
+@return bool: false if robots.txt disallows the URL. The node is not used then, and 
+the caller has to drop it.
+*/
+bool host_enqueue(URLQueue *URLS, URLQueueNode *node){
+
+    const char *url = url_string(node->html_url);
+    host_entry *h = lookup_host(&URLS->hosts, url);
+
+    node->host = h;
+    node->next_URL = NULL;
+
+    //No host state to pace by; better to fetch unpaced than to lose the URL.
+    if(h == NULL){
+        frontier_push(URLS, node);
+        return true;
+    }
+
+    pthread_mutex_lock(&h->lock);
+
+    if(config.obey_robots && h->name[0] != '\0' && node->kind != ITEM_SITEMAP){
+
+        //Refetched once the TTL runs out; the old rules stay in force meanwhile.
+        if(h->robots_state == ROBOTS_NONE || (h->robots_state == ROBOTS_READY && monotonic_ms() >= h->robots_expires_ms)){
+            request_robots(URLS, h);
+            host_release(URLS, h);
+        }
+
+        if(h->robots == NULL && h->robots_state == ROBOTS_FETCHING){
+
+            if(h->robots_wait_tail){
+                h->robots_wait_tail->next_URL = node;
+            }
+
+            else {
+                h->robots_wait_head = node;
+            }
+
+            h->robots_wait_tail = node;
+            pthread_mutex_unlock(&h->lock);
+
+            return true;
+        }
+
+        if(!robots_allowed(h->robots, url)){
+            atomic_fetch_add(&URLS->hosts.disallowed, 1);
+            pthread_mutex_unlock(&h->lock);
+            return false;
+        }
+    }
+
+    if(h->tail){
+        h->tail->next_URL = node;
+    }
+
+    else {
+        h->head = node;
+    }
+
+    h->tail = node;
+
+    host_release(URLS, h);
+    pthread_mutex_unlock(&h->lock);
+
+    return true;
+}
+
+
+/*
+The wheel thread. Each tick it takes the hosts whose time has come out of the 
+current slot and lets them release URLs again. Sleeps while the wheel is empty.
+*/
+void * run_host_timer(void *arg){
+
+    URLQueue *URLS = (URLQueue *) arg;
+    host_table *table = &URLS->hosts;
+
+    pthread_mutex_lock(&table->wheel_lock);
+
+    while(!table->stopping){
+
+        if(table->wheel_count == 0){
+            pthread_cond_wait(&table->wheel_wake, &table->wheel_lock);
+            continue;
+        }
+
+        long now = monotonic_ms();
+        host_entry *fired = NULL;
+
+        //After a long sleep one pass over every slot is enough to catch up.
+        if(now - table->wheel_tick >= WHEEL_SLOTS){
+            table->wheel_tick = now - WHEEL_SLOTS + 1;
+        }
+
+        for(; table->wheel_tick <= now; table->wheel_tick++){
+
+            host_entry **link = &table->wheel[table->wheel_tick & (WHEEL_SLOTS - 1)];
+
+            while(*link != NULL){
+
+                host_entry *h = *link;
+
+                if(h->wheel_due <= now){
+                    *link = h->wheel_next;
+                    h->wheel_next = fired;
+                    fired = h;
+                    table->wheel_count--;
+                }
+
+                else {
+                    link = &h->wheel_next;
+                }
+            }
+        }
+
+        pthread_mutex_unlock(&table->wheel_lock);
+
+        while(fired != NULL){
+
+            host_entry *h = fired;
+            fired = h->wheel_next;
+
+            pthread_mutex_lock(&h->lock);
+            h->on_wheel = false;
+            host_release(URLS, h);
+            pthread_mutex_unlock(&h->lock);
+        }
+
+        pthread_mutex_lock(&table->wheel_lock);
+
+        if(table->wheel_count > 0 && !table->stopping){
+
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += 1000000L;
+
+            if(until.tv_nsec >= 1000000000L){
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+
+            pthread_cond_timedwait(&table->wheel_wake, &table->wheel_lock, &until);
+        }
+    }
+
+    pthread_mutex_unlock(&table->wheel_lock);
+
+    return NULL;
+}
+
+
+void stop_host_timer(URLQueue *URLS){
+
+    pthread_mutex_lock(&URLS->hosts.wheel_lock);
+    URLS->hosts.stopping = true;
+    pthread_cond_signal(&URLS->hosts.wheel_wake);
+    pthread_mutex_unlock(&URLS->hosts.wheel_lock);
+
+    pthread_join(URLS->hosts.timer, NULL);
+}
+
+
+void report_hosts(host_table *table){
+
+    printf("Hosts: %ld, paced %ld times by their request rate, %ld URLs disallowed by robots.txt\n",
+           atomic_load(&table->hosts), atomic_load(&table->throttled), atomic_load(&table->disallowed));
+}
+
+
+
+/*
+-----------------------------------------
+|       Frontier spill segments         |
+-----------------------------------------
+Once the frontier holds --frontier-memory URLs, newly found ones are appended to 
+numbered segment files in the state directory instead of being interned and queued.
+Writes go through one buffer and are strictly sequential; a segment is closed at 
+SPILL_SEGMENT_SIZE and the next one started. When the URLs in memory drop to half the
+limit, refill_frontier() maps the oldest segment and queues the next batch from it. 
+Each record is a spill_record followed by the URL, no terminator.
+*/
+
+#define SPILL_SEGMENT_SIZE (64L * 1024 * 1024)
+#define SPILL_BUFFER (1024 * 1024)
+
+typedef struct spill_record{
+    int32_t  depth;          //-1 marks the end of a list in a checkpoint.
+    uint16_t length;
+    uint8_t  kind;
+    uint8_t  reserved;
+} spill_record;
+
+
+void segment_path(char *path, size_t size, int segment){
+
+    snprintf(path, size, "%s/frontier-%06d.seg", config.state_dir, segment);
+}
+
+
+bool init_frontier_spill(frontier_spill *spill){
+
+    pthread_mutex_init(&spill->lock, NULL);
+    pthread_mutex_init(&spill->refill_lock, NULL);
+
+    spill->tail = spill->head = spill->deleted = 0;
+    spill->fd = -1;
+    spill->tail_size = spill->tail_flushed = spill->head_offset = 0;
+    spill->buffered = 0;
+    spill->buffered_records = 0;
+    spill->records = NULL;
+    spill->records_capacity = 0;
+    atomic_init(&spill->count, 0);
+    atomic_init(&spill->total, 0);
+
+    if(config.state_dir == NULL){
+        spill->buffer = NULL;
+        return true;
+    }
+
+    if(mkdir(config.state_dir, 0755) != 0 && errno != EEXIST){
+        log_event(errno, config.state_dir, "Failed to create state directory");
+        return false;
+    }
+
+    spill->buffer = (char *) malloc(SPILL_BUFFER);
+
+    if(spill->buffer == NULL){
+        append_to_log_file("Memory allocation failed");
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+Writes out the buffer. Called with the spill lock held. If the write fails part way,
+what did get out is dropped from the buffer, so a later flush carries on right after it.
+
+@return bool: false if the buffer could not be written out entirely.
+*/
+bool flush_spill(frontier_spill *spill){
+
+    size_t done = 0;
+
+    while(done < spill->buffered){
+
+        ssize_t n = write(spill->fd, spill->buffer + done, spill->buffered - done);
+
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+
+        if(n <= 0){
+            log_event(errno, NULL, "Failed to write frontier segment");
+            memmove(spill->buffer, spill->buffer + done, spill->buffered - done);
+            spill->buffered -= done;
+            return false;
+        }
+
+        done += n;
+    }
+
+    spill->buffered = 0;
+    spill->buffered_records = 0;
+    spill->tail_flushed = spill->tail_size;
+
+    return true;
+}
+
+
+/*
+Gives up the URLs of the tail segment that never made it to the file, cutting it back
+to the last whole record. Called with the spill lock held, after a failed flush.
+
+@return long: URLs given up, which the caller takes off outstanding.
+*/
+long drop_spill_buffer(frontier_spill *spill){
+
+    long lost = spill->buffered_records;
+
+    if(ftruncate(spill->fd, (off_t) spill->tail_flushed) != 0){
+        log_event(errno, NULL, "Failed to truncate frontier segment");
+    }
+
+    lseek(spill->fd, 0, SEEK_END);
+
+    spill->records[spill->tail] -= lost;
+    atomic_fetch_sub(&spill->count, lost);
+
+    spill->tail_size = spill->tail_flushed;
+    spill->buffered = 0;
+    spill->buffered_records = 0;
+
+    return lost;
+}
+
+
+/*
+Finishes the tail segment so it can be read; the next URL starts a new one. Called with
+the spill lock held.
+
+@return bool: false if the buffer could not be written; the segment then stays open.
+*/
+bool close_tail_segment(frontier_spill *spill){
+
+    if(spill->fd < 0){
+        return true;
+    }
+
+    if(!flush_spill(spill)){
+        return false;
+    }
+
+    close(spill->fd);
+
+    spill->fd = -1;
+    spill->tail++;
+    spill->tail_size = spill->tail_flushed = 0;
+
+    return true;
+}
+
+
+//Makes room in records[] up to segment, new entries zero. Called with the spill lock held.
+bool reserve_segment_records(frontier_spill *spill, int segment){
+
+    if(segment < spill->records_capacity){
+        return true;
+    }
+
+    int capacity = (spill->records_capacity > 0) ? spill->records_capacity : 64;
+
+    while(capacity <= segment){
+        capacity *= 2;
+    }
+
+    long *records = (long *) realloc(spill->records, (size_t) capacity * sizeof(long));
+
+    if(records == NULL){
+        append_to_log_file("Memory allocation failed");
+        return false;
+    }
+
+    memset(records + spill->records_capacity, 0, (size_t) (capacity - spill->records_capacity) * sizeof(long));
+    spill->records = records;
+    spill->records_capacity = capacity;
+
+    return true;
+}
+
+
+/*
+Appends a URL to the tail segment. The caller has already counted it as outstanding.
+
+@return bool: false if the segment could not be written; the URL then has to stay in memory.
+*/
+bool spill_url(frontier_spill *spill, const char *url, int depth, enum item_kind kind){
+
+    size_t len = strlen(url);
+    spill_record record = { depth, (uint16_t) len, (uint8_t) kind, 0 };
+    bool ok = true;
+
+    pthread_mutex_lock(&spill->lock);
+
+    if(spill->fd < 0){
+
+        char path[PATH_MAX];
+        segment_path(path, sizeof(path), spill->tail);
+
+        spill->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if(spill->fd < 0){
+            log_event(errno, path, "Failed to create frontier segment");
+            ok = false;
+        }
+    }
+
+    if(ok){
+        ok = reserve_segment_records(spill, spill->tail);
+    }
+
+    if(ok && spill->buffered + sizeof(record) + len > SPILL_BUFFER){
+        ok = flush_spill(spill);
+    }
+
+    if(ok){
+
+        memcpy(spill->buffer + spill->buffered, &record, sizeof(record));
+        memcpy(spill->buffer + spill->buffered + sizeof(record), url, len);
+
+        spill->buffered += sizeof(record) + len;
+        spill->tail_size += sizeof(record) + len;
+        spill->buffered_records++;
+        spill->records[spill->tail]++;
+
+        atomic_fetch_add(&spill->count, 1);
+        atomic_fetch_add(&spill->total, 1);
+
+        //If the buffer cannot be written, the segment just grows until it can.
+        if(spill->tail_size >= SPILL_SEGMENT_SIZE){
+            close_tail_segment(spill);
+        }
+    }
+
+    pthread_mutex_unlock(&spill->lock);
+
+    return ok;
+}
+
+
+
+//Appends len bytes to buffer, at least doubling its capacity whenever it is full.
+bool append_bytes(struct mem *buffer, const char *data, size_t len){
+
+    if(buffer->size + len > buffer->capacity){
+
+        size_t capacity = (buffer->size + len) * 2;
+        char *memory = (char *) realloc(buffer->memory, capacity);
+
+        if(memory == NULL){
+            append_to_log_file("Failed to allocate memory.");
+            return false;
+        }
+
+        buffer->memory = memory;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->memory + buffer->size, data, len);
+    buffer->size += len;
+
+    return true;
+}
+
+
+/*
+-----------------------------------------
+|          Cluster partitioning         |
+-----------------------------------------
+With --cluster, several crawler processes share one crawl. Every node reads the same
+membership file, one address per line ("host:port" or "unix:/path"), and places each
+member at CLUSTER_VNODES points of a 64-bit hash ring. A host belongs to the first
+member point at or after the hash of its host_key(), so a node owns a fixed slice of
+the hostnames, and when a member joins only the hosts that land on its points move.
+
+enqueue_batch() routes every URL before the seen-set: URLs of our own hosts are queued
+as usual, the rest are appended to their owner's outgoing buffer, which the sender
+thread writes out every CLUSTER_FLUSH_MS as one batch. So each node's seen-set, robots
+cache and host queues cover only its own hosts, and nothing is shared across nodes.
+
+The membership file is checked for changes every second. A new ring is swapped in as
+a whole, and URLs already queued for hosts that moved are forwarded when they are
+dequeued (see cluster_handoff()). The new owner has not seen their hosts' URLs before,
+so pages fetched before the move may be fetched once more.
+*/
+
+#define CLUSTER_MAX_NODES 64
+#define CLUSTER_VNODES 128                  //Ring points per member; more evens out the slices.
+#define CLUSTER_FLUSH_MS 5                  //Longest a forwarded URL waits before it is sent.
+#define CLUSTER_BATCH_BYTES (64 * 1024)     //Pending bytes that wake the sender before that.
+#define CLUSTER_RECENT 65536                //Fingerprints of recently forwarded URLs, see cluster_forward().
+
+
+typedef struct cluster_peer{
+    char address[256];
+
+    pthread_mutex_t lock;        //Guards pending and pending_urls.
+    struct mem pending;          //Protocol lines not written yet.
+    long pending_urls;           //"U" lines among them.
+
+    //Sender thread only.
+    int  fd;                     //Connection to the peer, -1 if none.
+    long retry_ms;               //No new connection attempt before this.
+    bool unreachable;            //The failure has been logged.
+    struct mem unacked;          //Lines written on fd that the peer has not acknowledged yet.
+    long unacked_urls;           //"U" lines among them.
+    char ack[32];                //A partial acknowledgement line.
+    size_t ack_size;
+
+    //The coordinator's view of this node, from its last status line. Guarded by cluster.lock.
+    bool idle;
+    long sent, received;
+    long round;                  //Status round that line answered.
+    long checked_sent, checked_received;   //Its counters in the last round checked.
+} cluster_peer;
+
+
+typedef struct ring_point{
+    uint64_t point;
+    int peer;                    //Index into cluster.peers.
+} ring_point;
+
+
+//Immutable once published; replaced as a whole when the membership changes.
+typedef struct cluster_ring{
+    ring_point *points;          //Sorted by point.
+    int count;
+    int members[CLUSTER_MAX_NODES];
+    int member_count;            //members[0] is the coordinator, see check_cluster_done().
+    struct cluster_ring *retired;   //The ring this one replaced; lookups may still be reading it.
+} cluster_ring;
+
+
+static struct {
+    bool enabled;
+    URLQueue *URLS;
+
+    cluster_peer peers[CLUSTER_MAX_NODES];   //Every address ever listed; indices never change.
+    int peer_count;
+    int self;
+
+    _Atomic(cluster_ring *) ring;
+    atomic_bool rebalanced;       //The ring changed since start-up, so queued URLs may belong elsewhere.
+    time_t membership_mtime;
+
+    atomic_long sent;             //URLs other nodes have acknowledged.
+    atomic_long received;         //URLs read from other nodes.
+    atomic_long pending_urls;     //URLs in outgoing buffers or written and not acknowledged yet.
+    atomic_long repeats;          //Forwards skipped because the same URL went out just before.
+    _Alignas(CACHE_LINE) _Atomic uint64_t recent[CLUSTER_RECENT];
+
+    int listen_fd;
+    pthread_t sender, receiver;
+    pthread_mutex_t lock;         //Guards the peers' coordinator fields and the round below.
+    pthread_cond_t wake;          //Signalled when an outgoing buffer is full.
+    atomic_bool holding;          //Our extra count on outstanding, see start_cluster().
+    atomic_bool done;             //The whole cluster has finished.
+    atomic_bool stopping;
+    atomic_long probe;            //The status round the coordinator last asked us about.
+    atomic_bool probed;           //Its question has not been answered yet.
+    atomic_int admitting;         //Cluster threads queueing URLs right now, see begin_admitting().
+    long round;                   //Coordinator only: the status round being collected.
+    long round_ms;                //Coordinator only: when its question last went out.
+    bool idle_round;              //Coordinator only: the last round checked found every node idle.
+} cluster = { .listen_fd = -1 };
+
+
+
+static int compare_ring_points(const void *a, const void *b){
+
+    uint64_t x = ((const ring_point *) a)->point, y = ((const ring_point *) b)->point;
+
+    return (x > y) - (x < y);
+}
+
+
+//Index of the peer with this address, adding it if it is new. -1 when the table is full. Sender thread only.
+int cluster_peer_index(const char *address){
+
+    for(int i = 0; i < cluster.peer_count; i++){
+        if(strcmp(cluster.peers[i].address, address) == 0){
+            return i;
+        }
+    }
+
+    if(cluster.peer_count == CLUSTER_MAX_NODES){
+        return -1;
+    }
+
+    cluster_peer *p = &cluster.peers[cluster.peer_count];
+
+    snprintf(p->address, sizeof(p->address), "%s", address);
+    pthread_mutex_init(&p->lock, NULL);
+    p->fd = -1;
+
+    //The receiver looks peers up by address under the lock.
+    pthread_mutex_lock(&cluster.lock);
+    int index = cluster.peer_count++;
+    pthread_mutex_unlock(&cluster.lock);
+
+    return index;
+}
+
+
+/*
+Reads the membership file and publishes a ring built from it. Only the sender thread
+calls this after start-up, so the peer table has a single writer.
+
+@return bool: false if the file cannot be read, lists no one, or does not list us.
+*/
+bool load_membership(const char *path){
+
+    FILE *file = fopen(path, "r");
+    char line[512];
+    struct stat st;
+
+    if(file == NULL || fstat(fileno(file), &st) != 0){
+        log_event(errno, NULL, "Cannot read the cluster membership file");
+        if(file) fclose(file);
+        return false;
+    }
+
+    cluster_ring *ring = (cluster_ring *) calloc(1, sizeof(cluster_ring));
+
+    if(ring == NULL){
+        fclose(file);
+        return false;
+    }
+
+    while(fgets(line, sizeof(line), file) && ring->member_count < CLUSTER_MAX_NODES){
+
+        char *address = line + strspn(line, " \t");
+        address[strcspn(address, " \t\r\n#")] = '\0';
+
+        if(address[0] == '\0'){
+            continue;
+        }
+
+        int peer = cluster_peer_index(address);
+
+        if(peer >= 0){
+            ring->members[ring->member_count++] = peer;
+        }
+    }
+
+    fclose(file);
+
+    bool listed = false;
+
+    for(int i = 0; i < ring->member_count; i++){
+        listed |= (ring->members[i] == cluster.self);
+    }
+
+    if(!listed){
+        append_to_log_file("The cluster membership file does not list this node.");
+        free(ring);
+        return false;
+    }
+
+    ring->points = (ring_point *) malloc(sizeof(ring_point) * CLUSTER_VNODES * (size_t) ring->member_count);
+
+    if(ring->points == NULL){
+        append_to_log_file("Memory allocation failed");
+        free(ring);
+        return false;
+    }
+
+    for(int i = 0; i < ring->member_count; i++){
+
+        const char *address = cluster.peers[ring->members[i]].address;
+
+        for(int v = 0; v < CLUSTER_VNODES; v++){
+
+            char label[300];
+            int n = snprintf(label, sizeof(label), "%s#%d", address, v);
+
+            ring->points[ring->count++] = (ring_point) { hash_bytes(label, n), ring->members[i] };
+        }
+    }
+
+    qsort(ring->points, ring->count, sizeof(ring_point), compare_ring_points);
+
+    cluster_ring *old = atomic_load(&cluster.ring);
+    ring->retired = old;
+    cluster.membership_mtime = st.st_mtime;
+
+    atomic_store(&cluster.ring, ring);
+
+    if(old != NULL){
+        atomic_store(&cluster.rebalanced, true);
+
+        //Where recent URLs were sent no longer says where they belong.
+        for(int i = 0; i < CLUSTER_RECENT; i++){
+            atomic_store_explicit(&cluster.recent[i], 0, memory_order_relaxed);
+        }
+
+        log_event(0, NULL, "Cluster membership changed");
+    }
+
+    return true;
+}
+
+
+//Peer that owns url's host.
+int cluster_owner(const char *url){
+
+    cluster_ring *ring = atomic_load_explicit(&cluster.ring, memory_order_acquire);
+
+    if(ring->member_count == 1){
+        return ring->members[0];
+    }
+
+    char key[512];
+    host_key(url, key, sizeof(key));
+
+    uint64_t h = hash_bytes(key, strlen(key));
+    int low = 0, high = ring->count;
+
+    //First point at or after h, wrapping round to the start.
+    while(low < high){
+
+        int mid = (low + high) / 2;
+
+        if(ring->points[mid].point < h){
+            low = mid + 1;
+        }
+
+        else {
+            high = mid;
+        }
+    }
+
+    return ring->points[low == ring->count ? 0 : low].peer;
+}
+
+
+//Appends a "U" line to a peer's outgoing buffer.
+static void queue_url_line(int peer, const char *line, size_t len){
+
+    cluster_peer *p = &cluster.peers[peer];
+
+    pthread_mutex_lock(&p->lock);
+
+    if(append_bytes(&p->pending, line, len)){
+
+        p->pending_urls++;
+        atomic_fetch_add(&cluster.pending_urls, 1);
+
+        if(p->pending.size >= CLUSTER_BATCH_BYTES){
+            pthread_cond_signal(&cluster.wake);
+        }
+    }
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+/*
+Appends a URL to its owner's outgoing buffer. A page often links the same foreign URL
+many times and its neighbours link it again, so a small lossy table of fingerprints
+sent recently drops most repeats here; whatever gets through is dropped by the owner's
+seen-set.
+*/
+void cluster_forward(int peer, const char *url, uint64_t fingerprint, int depth, enum item_kind kind){
+
+    _Atomic uint64_t *slot = &cluster.recent[fingerprint & (CLUSTER_RECENT - 1)];
+
+    if(atomic_exchange_explicit(slot, fingerprint, memory_order_relaxed) == fingerprint){
+        atomic_fetch_add_explicit(&cluster.repeats, 1, memory_order_relaxed);
+        return;
+    }
+
+    char line[URL_MAX + 32];
+    int n = snprintf(line, sizeof(line), "U %d %d %s\n", depth, (int) kind, url);
+
+    queue_url_line(peer, line, n);
+}
+
+
+
+/*
+Makes a list of new nodes part of the frontier: counts them as outstanding, holds them
+back for the next level under --bfs-barrier, and hands the rest to their hosts.
+
+@param long added: nodes in the list from batch to last.
+@param int depth: their depth.
+*/
+void admit_batch(URLQueue *URLS, URLQueueNode *batch, URLQueueNode *last, long added, int depth){
+
+    bool level_counted = false;
+
+    //Count the URLs before they become visible so the crawl cannot look finished in between.
+    atomic_fetch_add(&URLS->outstanding, added);
+
+    if(URLS->bfs_barrier){
+
+        pthread_mutex_lock(&URLS->lock);
+
+        //Only the starting URL and sitemaps are on the level being fetched; anything else waits for the next level.
+        if(depth > URLS->level){
+
+            if(URLS -> next_tail) {
+                URLS->next_tail->next_URL = batch;
+            }
+
+            else {
+                URLS -> next_head = batch;
+            }
+
+            URLS -> next_tail = last;
+            URLS -> next_count += added;
+            pthread_mutex_unlock(&URLS->lock);
+
+            return;
+        }
+
+        atomic_fetch_add(&URLS->level_outstanding, added);
+        level_counted = true;
+        pthread_mutex_unlock(&URLS->lock);
+    }
+
+    while(batch != NULL){
+
+        URLQueueNode *next = batch->next_URL;
+
+        /*
+        Disallowed. Whoever is enqueueing is itself still outstanding, so neither count 
+        can reach zero here.
+        */
+        if(!host_enqueue(URLS, batch)){
+
+            if(level_counted){
+                atomic_fetch_sub(&URLS->level_outstanding, 1);
+            }
+
+            atomic_fetch_sub(&URLS->outstanding, 1);
+            free(batch);
+        }
+
+        batch = next;
+    }
+}
+
+
+/*
+Add URLs to the queue. URLs that were queued before, that lie beyond the depth limit,
+or that robots.txt disallows are dropped, and with --cluster URLs of other nodes' hosts
+are forwarded to them. New URLs are interned, so the frontier only
+carries their ids. Each URL reaches the workers once its 
+host's politeness limits allow. A batch shares the depth limit check, one update of
+the outstanding count and, with --bfs-barrier, one trip through the lock.
+
+@param const char **urls: count absolute, normalized URLs (see resolve_url()), all found on the same page or sitemap.
+@param int depth: links followed from the starting URL to reach them.
+@param enum item_kind kind: page or sitemap.
+*/
+void enqueue_batch(URLQueue *URLS, const char **urls, int count, int depth, enum item_kind kind){
+
+    //Checked before the seen-set so the same URL can still be queued if it turns up on a shallower page.
+    if(depth > URLS->max_depth){
+        return;
+    }
+
+    URLQueueNode *batch = NULL, *last = NULL;
+    long added = 0;
+    bool spilling = (URLS->spill.buffer != NULL && config.frontier_memory > 0 && !URLS->bfs_barrier &&
+                     atomic_load(&URLS->outstanding) - atomic_load(&URLS->spill.count) > config.frontier_memory);
+
+    for(int i = 0; i < count; i++){
+
+        uint64_t fingerprint = url_fingerprint(urls[i]);
+
+        //Another node's host: its seen-set decides, not ours.
+        if(cluster.enabled){
+
+            int owner = cluster_owner(urls[i]);
+
+            if(owner != cluster.self){
+                cluster_forward(owner, urls[i], fingerprint, depth, kind);
+                continue;
+            }
+        }
+
+        if(!seen_insert(&URLS->seen, fingerprint)){
+            continue;
+        }
+
+        //Counted first, like queued URLs, so the crawl cannot end while it is only on disk.
+        if(spilling){
+
+            atomic_fetch_add(&URLS->outstanding, 1);
+
+            if(spill_url(&URLS->spill, urls[i], depth, kind)){
+                continue;
+            }
+
+            atomic_fetch_sub(&URLS->outstanding, 1);
+        }
+
+        struct URLQueueNode *newURL = (struct URLQueueNode *) malloc( sizeof(URLQueueNode) );
+
+        if(newURL == NULL || (newURL -> html_url = intern_url(urls[i], strlen(urls[i]), fingerprint)) == URL_NONE){
+            append_to_log_file("Memory allocation failed.");
+            free(newURL);
+            continue;
+        }
+
+        newURL -> depth = depth;
+        newURL -> kind = kind;
+        newURL -> host = NULL;
+        newURL -> next_URL = NULL;
+
+        if(last){
+            last->next_URL = newURL;
+        }
+
+        else {
+            batch = newURL;
+        }
+
+        last = newURL;
+        added++;
+    }
+
+    if(added > 0){
+        admit_batch(URLS, batch, last, added, depth);
+    }
+}
+
+
+void enqueue_item(URLQueue *URLS, const char *url, int depth, enum item_kind kind){
+
+    enqueue_batch(URLS, &url, 1, depth, kind);
+}
+
+
+/*
+The page whose links and matches the validator cache is collecting on this thread. It
+is only set around a call into a page's parser, so an event loop that interleaves many
+transfers still attributes each link to the right page.
+*/
+static __thread page_validators *capturing_page = NULL;
+
+
+//Resolves a link found on the page at base and queues the result.
+void enqueue_link(URLQueue *URLS, const char *base, const char *href, size_t len, int depth){
+
+    char url[URL_MAX];
+    size_t n = resolve_url(base, href, len, url, sizeof(url));
+
+    if(n == 0){
+        return;
+    }
+
+    //Kept whether or not it is queued now: next run it may be new again.
+    if(capturing_page != NULL){
+        append_bytes(&capturing_page->links, url, n + 1);
+    }
+
+    enqueue_item(URLS, url, depth, ITEM_PAGE);
+}
+
+
+//Queues a URL given on its own, such as the starting URL; it has to be absolute.
+void enqueue_URL(URLQueue **url_q, const char *url, int depth){
+
+    enqueue_link(*url_q, NULL, url, strlen(url), depth);
+}
+
+
+// Add a URL to the output queue.
+void append_data(struct data_list **output_q, const char *url){
+
+    
+    //check if URL already exists
+    if(!seen_insert(&(*output_q)->seen, url_fingerprint(url))){
+        return;
+    }
+
+    struct URL *newURL = (struct URL *) malloc( sizeof(URL) );
+    
+    newURL -> url = strdup(url);
+    newURL -> next_URL = NULL;
+
+    pthread_mutex_lock(&((*output_q)->lock));
+
+    if((*output_q) -> tail) {
+
+        (*output_q)->tail->next_URL = newURL;
+    } 
+    
+    else {
+
+        (*output_q) -> head = newURL;
+    }
+
+    (*output_q) -> tail = newURL;
+
+    pthread_mutex_unlock(&((*output_q)->lock));
+
+    return;
+}
+
+
+
+
+
+
+
+//How many more URLs the in-memory part of the frontier can take, not counting the URL being finished.
+static long frontier_room(URLQueue *URLS){
+
+    return config.frontier_memory - (atomic_load(&URLS->outstanding) - atomic_load(&URLS->spill.count) - 1);
+}
+
+
+/*
+Moves URLs from the oldest spill segments back into memory once the in-memory part of
+the frontier has shrunk to half of --frontier-memory, until it is full again. URLs 
+that robots.txt turns away do not count, so a refill never ends with nothing to do.
+Called from URL_done() while the finished URL still counts as outstanding, so taking 
+the spilled URLs off the count and putting them back on cannot make the crawl look 
+finished. If another thread is already refilling, returns at once.
+*/
+void refill_frontier(URLQueue *URLS){
+
+    frontier_spill *spill = &URLS->spill;
+
+    if(atomic_load(&spill->count) == 0 || frontier_room(URLS) < config.frontier_memory - config.frontier_memory / 2){
+        return;
+    }
+
+    if(pthread_mutex_trylock(&spill->refill_lock) != 0){
+        return;
+    }
+
+    while(frontier_room(URLS) > 0 && atomic_load(&spill->count) > 0){
+
+        //Never read the segment that is still being written.
+        pthread_mutex_lock(&spill->lock);
+
+        //Nothing else would ever read what cannot be written, so it is given up rather than keep the crawl from ending.
+        if(spill->head == spill->tail && !close_tail_segment(spill)){
+
+            long lost = drop_spill_buffer(spill);
+
+            log_event(0, NULL, "Frontier URLs lost: the spill segment could not be written");
+            atomic_fetch_sub(&URLS->outstanding, lost);
+            close_tail_segment(spill);
+        }
+
+        long left = (spill->head < spill->records_capacity) ? spill->records[spill->head] : 0;
+
+        pthread_mutex_unlock(&spill->lock);
+
+        char path[PATH_MAX];
+        struct stat st;
+
+        segment_path(path, sizeof(path), spill->head);
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        if(fd < 0 || fstat(fd, &st) != 0){
+            log_event(errno, path, "Failed to open frontier segment");
+            if(fd >= 0) close(fd);
+            break;
+        }
+
+        size_t size = (size_t) st.st_size;
+        char *map = (size > 0) ? (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+
+        close(fd);
+
+        if(size > 0 && map == MAP_FAILED){
+            log_event(errno, path, "Failed to map frontier segment");
+            break;
+        }
+
+        if(map != NULL){
+            madvise(map, size, MADV_SEQUENTIAL);
+        }
+
+        size_t pos = spill->head_offset;
+
+        //Consecutive records came from the same page, so they go back in batches of one depth and kind.
+        long wanted;
+
+        while((wanted = frontier_room(URLS)) > 0 && pos + sizeof(spill_record) <= size){
+
+            URLQueueNode *batch = NULL, *last = NULL;
+            long added = 0, taken = 0;
+            spill_record first;
+
+            memcpy(&first, map + pos, sizeof(first));
+
+            while(taken < 128 && taken < wanted && pos + sizeof(spill_record) <= size){
+
+                spill_record record;
+                memcpy(&record, map + pos, sizeof(record));
+
+                if(record.depth != first.depth || record.kind != first.kind || pos + sizeof(record) + record.length > size){
+                    break;
+                }
+
+                char url[URL_MAX];
+                size_t len = (record.length < URL_MAX) ? record.length : URL_MAX - 1;
+                URLQueueNode *node = (URLQueueNode *) malloc(sizeof(URLQueueNode));
+
+                memcpy(url, map + pos + sizeof(record), len);
+                url[len] = '\0';
+
+                pos += sizeof(record) + record.length;
+                taken++;
+
+                if(node == NULL || (node->html_url = intern_url(url, len, url_fingerprint(url))) == URL_NONE){
+                    append_to_log_file("Memory allocation failed");
+                    free(node);
+                    continue;
+                }
+
+                node->depth = record.depth;
+                node->kind = (enum item_kind) record.kind;
+                node->host = NULL;
+                node->next_URL = NULL;
+
+                if(last){
+                    last->next_URL = node;
+                }
+
+                else {
+                    batch = node;
+                }
+
+                last = node;
+                added++;
+            }
+
+            /*
+            A truncated record: the rest of the segment is unusable. Its URLs are given
+            up, and taken off the counts so the crawl can still finish.
+            */
+            if(taken == 0){
+                log_event(0, path, "Corrupt frontier segment");
+                atomic_fetch_sub(&spill->count, left);
+                atomic_fetch_sub(&URLS->outstanding, left);
+                left = 0;
+                pos = size;
+                break;
+            }
+
+            if(added > 0){
+                admit_batch(URLS, batch, last, added, first.depth);
+            }
+
+            left -= taken;
+            atomic_fetch_sub(&spill->count, taken);
+            atomic_fetch_sub(&URLS->outstanding, taken);
+        }
+
+        if(map != NULL){
+            munmap(map, size);
+        }
+
+        spill->head_offset = pos;
+
+        //Whatever is left past the last whole record is given up the same way.
+        if(pos + sizeof(spill_record) > size && left > 0){
+            log_event(0, path, "Corrupt frontier segment");
+            atomic_fetch_sub(&spill->count, left);
+            atomic_fetch_sub(&URLS->outstanding, left);
+            left = 0;
+        }
+
+        pthread_mutex_lock(&spill->lock);
+
+        if(spill->head < spill->records_capacity){
+            spill->records[spill->head] = left;
+        }
+
+        pthread_mutex_unlock(&spill->lock);
+
+        if(pos + sizeof(spill_record) > size){
+
+            //Without checkpoints nobody will read it again; otherwise the next checkpoint deletes it.
+            if(config.checkpoint_every == 0 && spill->deleted == spill->head){
+                unlink(path);
+                spill->deleted++;
+            }
+
+            spill->head++;
+            spill->head_offset = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&spill->refill_lock);
+}
+
+
+
+/*
+Removes a URL without blocking. Event loops use this while they still have transfers to drive.
+
+@param frontier_item *item: receives the URL, its depth and its host.
+@return bool: false if nothing is queued right now.
+*/
+bool try_dequeue_URL(URLQueue *URLS, frontier_item *item){
+
+    //A checkpoint is waiting for every worker to go idle.
+    if(atomic_load_explicit(&URLS->pausing, memory_order_relaxed)){
+        return false;
+    }
+
+    if(ring_pop(URLS, item)){
+        return true;
+    }
+
+    if(atomic_load(&URLS->overflow_count) == 0){
+        return false;
+    }
+
+    pthread_mutex_lock(&URLS->lock);
+
+    //URLQueue is not empty.
+    URLQueueNode *temp = URLS -> head;
+    bool found = (temp != NULL);
+
+    if(temp != NULL){
+
+        item->id = temp -> html_url;
+        item->url = url_string(temp -> html_url);
+        item->depth = temp -> depth;
+        item->kind = temp -> kind;
+        item->host = temp -> host;
+
+        URLS -> head = URLS -> head -> next_URL;
+
+        if (URLS ->head == NULL) {
+
+            URLS -> tail = NULL;
+        }
+
+        atomic_fetch_sub(&URLS->overflow_count, 1);
+        free(temp);
+    }
+
+    pthread_mutex_unlock(&URLS->lock);
+
+    return found;
+}
+
+
+//Remove a URL from the URLQueue.
+//Blocks while the queue is empty but other workers are busy. Returns false once the crawl is finished.
+bool dequeue_URL(URLQueue *URLS, frontier_item *item) {
+
+    while(1){
+
+        if(atomic_load(&URLS->finished)){
+            return false;
+        }
+
+        //Spin briefly before parking; new links usually arrive within a few microseconds.
+        for(int spin = 0; spin < 64; spin++){
+
+            if(try_dequeue_URL(URLS, item)){
+                return true;
+            }
+
+            sched_yield();
+        }
+
+        pthread_mutex_lock(&URLS->lock);
+        atomic_fetch_add(&URLS->idle_workers, 1);
+
+        while(!atomic_load(&URLS->finished)){
+
+            if(atomic_load(&URLS->outstanding) == 0){
+                atomic_store(&URLS->finished, true);
+                pthread_cond_broadcast(&URLS->wake);
+                break;
+            }
+
+            //Re-check after announcing ourselves as idle so a concurrent enqueue cannot be missed.
+            size_t head = atomic_load(&URLS->dequeue_pos);
+            size_t tail = atomic_load(&URLS->enqueue_pos);
+
+            if((head != tail || URLS->head != NULL) && !atomic_load(&URLS->pausing)){
+                break;
+            }
+
+            pthread_cond_wait(&URLS->wake, &URLS->lock);
+        }
+
+        atomic_fetch_sub(&URLS->idle_workers, 1);
+        pthread_mutex_unlock(&URLS->lock);
+    }
+}
+
+
+//Ends the crawl early (or normally, from URL_done()): wakes every parked worker and makes dequeue_URL() return NULL.
+void stop_queue(URLQueue *URLS){
+
+    pthread_mutex_lock(&URLS->lock);
+    atomic_store(&URLS->finished, true);
+    pthread_cond_broadcast(&URLS->wake);
+    pthread_mutex_unlock(&URLS->lock);
+}
+
+
+/*
+Starts the next level once the current one has drained. Called with the lock held;
+returns the held-back URLs, already counted in outstanding, for the caller to hand 
+to their hosts after unlocking.
+*/
+URLQueueNode* advance_level(URLQueue *URLS){
+
+    URLQueueNode *level = URLS->next_head;
+
+    URLS->level++;
+    atomic_store(&URLS->level_outstanding, URLS->next_count);
+
+    URLS->next_head = URLS->next_tail = NULL;
+    URLS->next_count = 0;
+
+    return level;
+}
+
+
+/*
+Marks a dequeued URL as fully processed. Must be called after its links have been
+enqueued; frees a connection slot on the URL's host and, after the last call of the 
+crawl, wakes every parked worker so they can exit.
+*/
+void URL_done(URLQueue *URLS, const frontier_item *item){
+
+    if(URLS->spill.buffer != NULL){
+        refill_frontier(URLS);
+    }
+
+    if(item->host != NULL){
+        pthread_mutex_lock(&item->host->lock);
+        item->host->inflight--;
+        host_release(URLS, item->host);
+        pthread_mutex_unlock(&item->host->lock);
+    }
+
+    //The URL itself still counts as outstanding here, so the crawl cannot end between levels. robots.txt belongs to no level.
+    if(URLS->bfs_barrier && item->kind != ITEM_ROBOTS && atomic_fetch_sub(&URLS->level_outstanding, 1) == 1){
+
+        pthread_mutex_lock(&URLS->lock);
+        URLQueueNode *level = advance_level(URLS);
+        pthread_mutex_unlock(&URLS->lock);
+
+        while(level != NULL){
+
+            URLQueueNode *next = level->next_URL;
+
+            //Disallowed by robots.txt: retire it like a fetched page.
+            if(!host_enqueue(URLS, level)){
+                frontier_item dropped = { level->html_url, NULL, level->depth, level->kind, NULL };
+                free(level);
+                URL_done(URLS, &dropped);
+            }
+
+            level = next;
+        }
+    }
+
+    if(atomic_fetch_sub(&URLS->outstanding, 1) == 1){
+        stop_queue(URLS);
+    }
+}
+
+
+//Forgets a queued URL that will not be fetched after all, e.g. because robots.txt disallows it.
+void drop_node(URLQueue *URLS, URLQueueNode *node){
+
+    frontier_item item = { node->html_url, NULL, node->depth, node->kind, NULL };
+
+    free(node);
+    URL_done(URLS, &item);
+}
+
+
+
+/*
+-----------------------------------------
+|            Cluster transport          |
+-----------------------------------------
+Nodes talk over one stream socket per direction, TCP or Unix, in newline-terminated
+text lines:
+
+    U <depth> <kind> <url>             a URL for the receiver's frontier
+    P <round>                          the coordinator asks for a node's status
+    S <address> <idle> <sent> <received> <round>   the answer
+    T                                  the crawl is over
+    A <lines>                          sent back: that many lines have been handled
+
+A sender keeps every line it wrote until the receiver acknowledges it, and the receiver
+acknowledges only once the URLs are queued. When a connection drops, whatever was not
+acknowledged goes out again on the next one, so a peer that restarts still gets it;
+a URL that arrives twice is dropped by the seen-set. URLs waiting for a node that left
+the membership are routed again under the new ring.
+
+Termination: a node never lets its own frontier drain while the cluster may still send
+it work. start_cluster() adds one to outstanding, so its workers park instead of
+exiting. A node is idle when only that extra count is outstanding and none of its URLs
+wait to be sent or acknowledged. The coordinator, the first member listed, asks every
+member for its status and starts the next round only once all have answered, so each
+round's answers are taken after all of the previous round's. Work can only reach an 
+idle node from a node that was busy while the URL waited for its acknowledgement, or
+by moving the receiver's counts between two answers. So when two rounds in a row find
+every member idle and no member's sent and received counts moved in between, the crawl
+is over. The coordinator then sends T to everyone, and each node drops its extra count 
+so its crawl ends like a single-process one. Members that left are no longer asked.
+
+There is no authentication. The socket is bound to this node's own address and TCP
+connections are only taken from the members' addresses, but the port must still never
+be reachable from outside the network the nodes share.
+*/
+
+//Fills in the socket address for "unix:/path" or "host:port".
+bool parse_cluster_address(const char *address, struct sockaddr_storage *sa, socklen_t *length){
+
+    memset(sa, 0, sizeof(*sa));
+
+    if(strncmp(address, "unix:", 5) == 0){
+
+        struct sockaddr_un *un = (struct sockaddr_un *) sa;
+
+        if(strlen(address + 5) >= sizeof(un->sun_path)){
+            return false;
+        }
+
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address + 5);
+        *length = sizeof(struct sockaddr_un);
+
+        return true;
+    }
+
+    char host[256];
+    const char *colon = strrchr(address, ':');
+
+    if(colon == NULL || colon == address || (size_t) (colon - address) >= sizeof(host)){
+        return false;
+    }
+
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *found;
+
+    if(getaddrinfo(host, colon + 1, &hints, &found) != 0){
+        return false;
+    }
+
+    memcpy(sa, found->ai_addr, found->ai_addrlen);
+    *length = found->ai_addrlen;
+    freeaddrinfo(found);
+
+    return true;
+}
+
+
+/*
+Puts the lines a peer never acknowledged back in front of those added since, followed
+by out if given. Called once the connection is closed, so the next one starts afresh.
+*/
+static void requeue_unacked(cluster_peer *p, const struct mem *out, long out_urls){
+
+    struct mem lines = p->unacked;
+    long urls = p->unacked_urls + out_urls;
+    bool ok = true;
+
+    p->unacked = (struct mem) { NULL, 0, 0 };
+    p->unacked_urls = 0;
+    p->ack_size = 0;
+
+    if(out != NULL && out->size > 0){
+        ok = append_bytes(&lines, out->memory, out->size);
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    if(ok && p->pending.size > 0){
+        ok = append_bytes(&lines, p->pending.memory, p->pending.size);
+    }
+
+    if(ok){
+        free(p->pending.memory);
+        p->pending = lines;
+        p->pending_urls += urls;
+    }
+
+    else {
+        //Out of memory: the older lines are lost, so stop counting them as pending.
+        atomic_fetch_sub(&cluster.pending_urls, urls);
+        free(lines.memory);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+//The peer has handled the oldest lines written to it: forgets them and counts their URLs as sent.
+static void retire_lines(cluster_peer *p, long lines){
+
+    size_t used = 0;
+    long urls = 0;
+    const char *newline;
+
+    while(lines > 0 && used < p->unacked.size && (newline = memchr(p->unacked.memory + used, '\n', p->unacked.size - used)) != NULL){
+        urls += (p->unacked.memory[used] == 'U');
+        used = newline + 1 - p->unacked.memory;
+        lines--;
+    }
+
+    if(used > 0){
+        memmove(p->unacked.memory, p->unacked.memory + used, p->unacked.size - used);
+        p->unacked.size -= used;
+    }
+
+    p->unacked_urls -= urls;
+    atomic_fetch_add(&cluster.sent, urls);
+    atomic_fetch_sub(&cluster.pending_urls, urls);
+}
+
+
+//Reads the peer's acknowledgements without blocking. If it has closed the connection, what it did not acknowledge is queued again.
+static void read_acks(cluster_peer *p){
+
+    char chunk[1024];
+
+    while(p->fd >= 0){
+
+        ssize_t n = recv(p->fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+            return;
+        }
+
+        if(n <= 0){
+            close(p->fd);
+            p->fd = -1;
+            p->retry_ms = monotonic_ms() + 500;
+            requeue_unacked(p, NULL, 0);
+            return;
+        }
+
+        for(ssize_t i = 0; i < n; i++){
+
+            if(chunk[i] != '\n'){
+
+                if(p->ack_size < sizeof(p->ack) - 1){
+                    p->ack[p->ack_size++] = chunk[i];
+                }
+
+                continue;
+            }
+
+            long lines;
+
+            p->ack[p->ack_size] = '\0';
+            p->ack_size = 0;
+
+            if(sscanf(p->ack, "A %ld", &lines) == 1){
+                retire_lines(p, lines);
+            }
+        }
+    }
+}
+
+
+/*
+Takes in the peer's acknowledgements, then writes out its pending lines, which are kept
+until they are acknowledged in turn. If the connection fails, everything not yet
+acknowledged goes back in front of lines added in the meantime and is retried after a
+pause. The receiver drops a partial last line, so each URL is counted as sent once,
+and it is only counted when the peer has queued it.
+*/
+void flush_peer(cluster_peer *p){
+
+    long now = monotonic_ms();
+
+    if(p->fd >= 0){
+        read_acks(p);
+    }
+
+    if(now < p->retry_ms){
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    struct mem out = p->pending;
+    long urls = p->pending_urls;
+    p->pending = (struct mem) { NULL, 0, 0 };
+    p->pending_urls = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    if(out.size == 0){
+        free(out.memory);
+        return;
+    }
+
+    size_t written = 0;
+
+    if(p->fd < 0){
+
+        struct sockaddr_storage sa;
+        socklen_t length;
+
+        if(parse_cluster_address(p->address, &sa, &length)){
+
+            p->fd = socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+            if(p->fd >= 0 && connect(p->fd, (struct sockaddr *) &sa, length) != 0){
+                close(p->fd);
+                p->fd = -1;
+            }
+        }
+
+        if(p->fd >= 0){
+
+            struct timeval timeout = { 5, 0 };
+            setsockopt(p->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            if(p->unreachable){
+                log_event(0, NULL, "Cluster peer reachable again");
+            }
+
+            p->unreachable = false;
+        }
+
+        //Peers that are still starting up are the usual case; say so once.
+        else if(!p->unreachable){
+            log_event(errno, NULL, "Cannot reach a cluster peer, will keep retrying");
+            p->unreachable = true;
+        }
+    }
+
+    while(p->fd >= 0 && written < out.size){
+
+        ssize_t n = send(p->fd, out.memory + written, out.size - written, MSG_NOSIGNAL);
+
+        if(n <= 0){
+            close(p->fd);
+            p->fd = -1;
+            break;
+        }
+
+        written += n;
+    }
+
+    if(written == out.size && append_bytes(&p->unacked, out.memory, out.size)){
+        p->unacked_urls += urls;
+        free(out.memory);
+        return;
+    }
+
+    //Acknowledgements match lines by position, so a line that cannot be tracked ends the connection.
+    if(p->fd >= 0){
+        close(p->fd);
+        p->fd = -1;
+    }
+
+    p->retry_ms = now + 500;
+    requeue_unacked(p, &out, urls);
+    free(out.memory);
+}
+
+
+static void queue_cluster_line(int peer, const char *line){
+
+    cluster_peer *p = &cluster.peers[peer];
+
+    pthread_mutex_lock(&p->lock);
+    append_bytes(&p->pending, line, strlen(line));
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+//Drops our extra count on outstanding, once; the crawl then ends when the local frontier drains.
+void release_cluster_hold(void){
+
+    if(atomic_exchange(&cluster.holding, false) && atomic_fetch_sub(&cluster.URLS->outstanding, 1) == 1){
+        stop_queue(cluster.URLS);
+    }
+}
+
+
+static bool cluster_idle(void){
+
+    return atomic_load(&cluster.URLS->outstanding) <= 1 && atomic_load(&cluster.pending_urls) == 0;
+}
+
+
+/*
+Cluster threads call this before they queue URLs, so pause_crawl() can wait until none
+is doing so. While the crawl is paused for a checkpoint it returns false and the caller
+queues nothing; otherwise the caller calls end_admitting() when it is done.
+*/
+static bool begin_admitting(void){
+
+    atomic_fetch_add(&cluster.admitting, 1);
+
+    if(atomic_load(&cluster.URLS->pausing)){
+        atomic_fetch_sub(&cluster.admitting, 1);
+        return false;
+    }
+
+    return true;
+}
+
+
+static void end_admitting(void){
+
+    atomic_fetch_sub(&cluster.admitting, 1);
+}
+
+
+static bool cluster_member(const cluster_ring *ring, int peer){
+
+    for(int i = 0; i < ring->member_count; i++){
+        if(ring->members[i] == peer){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*
+Routes the URLs still waiting for a node that left the membership again, under the
+current ring; its other lines are dropped. Sender thread only.
+*/
+static void reroute_peer(cluster_peer *p){
+
+    if(p->fd >= 0){
+        close(p->fd);
+        p->fd = -1;
+        requeue_unacked(p, NULL, 0);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    struct mem lines = p->pending;
+    long urls = p->pending_urls;
+    p->pending = (struct mem) { NULL, 0, 0 };
+    p->pending_urls = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    char *line = lines.memory, *end = lines.memory + lines.size, *newline;
+
+    while(line < end && (newline = memchr(line, '\n', end - line)) != NULL){
+
+        int depth, kind, offset = 0;
+
+        *newline = '\0';
+
+        if(line[0] == 'U' && sscanf(line, "U %d %d %n", &depth, &kind, &offset) == 2 && offset > 0){
+
+            int owner = cluster_owner(line + offset);
+
+            if(owner == cluster.self){
+                enqueue_item(cluster.URLS, line + offset, depth, (enum item_kind) kind);
+            }
+
+            //Not through cluster_forward(): the URL went out once already, so its repeat filter would drop it.
+            else {
+                *newline = '\n';
+                queue_url_line(owner, line, newline + 1 - line);
+            }
+        }
+
+        line = newline + 1;
+    }
+
+    //Counted as waiting until they were queued again, so the node could not look idle in between.
+    atomic_fetch_sub(&cluster.pending_urls, urls);
+    free(lines.memory);
+}
+
+
+/*
+Coordinator only: collects the current status round and, once every member has
+answered, checks it and asks for the next one. Ends the crawl when two rounds in a row
+found every member idle and no counts moved in between.
+*/
+void check_cluster_done(void){
+
+    cluster_ring *ring = atomic_load(&cluster.ring);
+    cluster_peer *me = &cluster.peers[cluster.self];
+    bool fresh = true, idle = true, steady = true;
+    long now = monotonic_ms();
+
+    pthread_mutex_lock(&cluster.lock);
+
+    me->idle = cluster_idle();
+    me->received = atomic_load(&cluster.received);
+    me->sent = atomic_load(&cluster.sent);
+    me->round = cluster.round;
+
+    for(int i = 0; i < ring->member_count; i++){
+        fresh &= (cluster.peers[ring->members[i]].round == cluster.round);
+    }
+
+    if(!fresh){
+
+        /*
+        A member that restarted, or joined since the question went out, will not answer it.
+        Ask those with nothing on its way to them again, once a second.
+        */
+        if(now - cluster.round_ms >= 1000){
+
+            char line[32];
+            snprintf(line, sizeof(line), "P %ld\n", cluster.round);
+            cluster.round_ms = now;
+
+            for(int i = 0; i < ring->member_count; i++){
+
+                cluster_peer *p = &cluster.peers[ring->members[i]];
+
+                if(p->round != cluster.round && p->unacked.size == 0){
+
+                    pthread_mutex_lock(&p->lock);
+                    bool empty = (p->pending.size == 0);
+                    pthread_mutex_unlock(&p->lock);
+
+                    if(empty){
+                        queue_cluster_line(ring->members[i], line);
+                    }
+                }
+            }
+        }
+
+        pthread_mutex_unlock(&cluster.lock);
+        return;
+    }
+
+    for(int i = 0; i < ring->member_count; i++){
+
+        cluster_peer *p = &cluster.peers[ring->members[i]];
+
+        idle &= p->idle;
+        steady &= (p->sent == p->checked_sent && p->received == p->checked_received);
+        p->checked_sent = p->sent;
+        p->checked_received = p->received;
+    }
+
+    bool finished = idle && steady && cluster.idle_round;
+    long round = ++cluster.round;
+
+    cluster.idle_round = idle;
+    cluster.round_ms = now;
+
+    pthread_mutex_unlock(&cluster.lock);
+
+    char line[32] = "T\n";
+
+    if(!finished){
+        snprintf(line, sizeof(line), "P %ld\n", round);
+    }
+
+    for(int i = 0; i < ring->member_count; i++){
+        if(ring->members[i] != cluster.self){
+            queue_cluster_line(ring->members[i], line);
+        }
+    }
+
+    if(finished){
+        atomic_store(&cluster.done, true);
+        release_cluster_hold();
+    }
+}
+
+
+/*
+Sender thread: flushes the outgoing buffers, answers the coordinator's status rounds (or
+is the coordinator), and reloads the membership file when it changes.
+*/
+void * run_cluster_sender(void *arg){
+
+    long next_status = 0, next_membership = monotonic_ms() + 1000;
+    cluster_ring *ring = atomic_load(&cluster.ring);
+
+    while(!atomic_load(&cluster.stopping)){
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += CLUSTER_FLUSH_MS * 1000000L;
+
+        if(until.tv_nsec >= 1000000000L){
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&cluster.lock);
+        pthread_cond_timedwait(&cluster.wake, &cluster.lock, &until);
+        pthread_mutex_unlock(&cluster.lock);
+
+        long now = monotonic_ms();
+
+        if(now >= next_membership){
+
+            struct stat st;
+
+            if(stat(config.cluster_file, &st) == 0 && st.st_mtime != cluster.membership_mtime){
+                load_membership(config.cluster_file);
+                ring = atomic_load(&cluster.ring);
+            }
+
+            next_membership = now + 1000;
+        }
+
+        bool coordinator = (ring->members[0] == cluster.self), reporting = !atomic_load(&cluster.done);
+
+        if(reporting && coordinator && now >= next_status){
+            check_cluster_done();
+            next_status = now + 100;
+        }
+
+        //The answer is taken after the question arrived, which is what keeps the rounds apart.
+        else if(reporting && !coordinator && atomic_exchange(&cluster.probed, false)){
+
+            char line[400];
+            long round = atomic_load(&cluster.probe);
+            //Idle is read first: if it flips to busy after, the counters below can only have moved on.
+            bool idle = cluster_idle();
+            long received = atomic_load(&cluster.received);
+
+            snprintf(line, sizeof(line), "S %s %d %ld %ld %ld\n", cluster.peers[cluster.self].address, idle ? 1 : 0,
+                     atomic_load(&cluster.sent), received, round);
+            queue_cluster_line(ring->members[0], line);
+        }
+
+        for(int i = 0; i < cluster.peer_count; i++){
+
+            if(i == cluster.self){
+                continue;
+            }
+
+            if(cluster_member(ring, i)){
+                flush_peer(&cluster.peers[i]);
+            }
+
+            //Rerouting may queue URLs here, so it waits while a checkpoint is written.
+            else if(begin_admitting()){
+                reroute_peer(&cluster.peers[i]);
+                end_admitting();
+            }
+        }
+    }
+
+    /*
+    Last chance for anything still queued. The coordinator waits up to five seconds for
+    its T lines to be acknowledged, as a node that misses one would never stop.
+    */
+    bool coordinator = atomic_load(&cluster.done) && ring->members[0] == cluster.self;
+
+    for(int attempt = 0; attempt < (coordinator ? 50 : 1); attempt++){
+
+        bool delivered = true;
+
+        for(int i = 0; i < cluster.peer_count; i++){
+
+            cluster_peer *p = &cluster.peers[i];
+
+            if(i == cluster.self || !cluster_member(ring, i)){
+                continue;
+            }
+
+            p->retry_ms = 0;
+            flush_peer(p);
+
+            pthread_mutex_lock(&p->lock);
+            delivered &= (p->pending.size == 0 && p->unacked.size == 0);
+            pthread_mutex_unlock(&p->lock);
+        }
+
+        if(delivered){
+            break;
+        }
+
+        struct timespec pause = { 0, 100 * 1000000L };
+        nanosleep(&pause, NULL);
+    }
+
+    for(int i = 0; i < cluster.peer_count; i++){
+        if(cluster.peers[i].fd >= 0){
+            close(cluster.peers[i].fd);
+            cluster.peers[i].fd = -1;
+        }
+    }
+
+    return NULL;
+}
+
+
+//Queues a run of received URLs that share a depth and kind.
+static void admit_received(const char **urls, int count, int depth, enum item_kind kind){
+
+    if(count > 0){
+        enqueue_batch(cluster.URLS, urls, count, depth, kind);
+        atomic_fetch_add(&cluster.received, count);
+    }
+}
+
+
+/*
+Handles the complete lines in buf and returns how many bytes they took. URLs are queued
+in runs, so a batch from a busy node costs one enqueue_batch() per run, not per URL.
+
+@param long *lines: receives the number of lines handled, for the acknowledgement.
+*/
+size_t handle_cluster_lines(char *buf, size_t len, long *lines){
+
+    const char *urls[256];
+    int count = 0, run_depth = 0, run_kind = 0;
+    size_t used = 0;
+    char *newline;
+
+    *lines = 0;
+
+    while((newline = memchr(buf + used, '\n', len - used)) != NULL){
+
+        char *line = buf + used;
+        int depth, kind, offset = 0;
+
+        *newline = '\0';
+        used = newline + 1 - buf;
+        (*lines)++;
+
+        if(line[0] == 'U' && sscanf(line, "U %d %d %n", &depth, &kind, &offset) == 2 && offset > 0 &&
+           (kind == ITEM_PAGE || kind == ITEM_SITEMAP)){
+
+            if(count == 256 || (count > 0 && (depth != run_depth || kind != run_kind))){
+                admit_received(urls, count, run_depth, (enum item_kind) run_kind);
+                count = 0;
+            }
+
+            run_depth = depth;
+            run_kind = kind;
+            urls[count++] = line + offset;
+            continue;
+        }
+
+        //Anything else is a control line; the URLs before it are queued first.
+        admit_received(urls, count, run_depth, (enum item_kind) run_kind);
+        count = 0;
+
+        if(line[0] == 'S'){
+
+            char address[256];
+            int idle;
+            long sent, received, round;
+
+            if(sscanf(line, "S %255s %d %ld %ld %ld", address, &idle, &sent, &received, &round) == 5){
+
+                pthread_mutex_lock(&cluster.lock);
+
+                for(int i = 0; i < cluster.peer_count; i++){
+
+                    cluster_peer *p = &cluster.peers[i];
+
+                    //An answer sent again after a reconnect may be older than one already here.
+                    if(strcmp(p->address, address) == 0 && round >= p->round){
+                        p->idle = idle;
+                        p->sent = sent;
+                        p->received = received;
+                        p->round = round;
+                    }
+                }
+
+                pthread_mutex_unlock(&cluster.lock);
+            }
+        }
+
+        else if(line[0] == 'P'){
+
+            long round;
+
+            if(sscanf(line, "P %ld", &round) == 1){
+                atomic_store(&cluster.probe, round);
+                atomic_store(&cluster.probed, true);
+            }
+        }
+
+        else if(line[0] == 'T'){
+            atomic_store(&cluster.done, true);
+            release_cluster_hold();
+        }
+    }
+
+    admit_received(urls, count, run_depth, (enum item_kind) run_kind);
+
+    return used;
+}
+
+
+//The IP address of sa as 16 bytes, IPv4 in its IPv6-mapped form. False for other families.
+static bool socket_ip(const struct sockaddr *sa, unsigned char ip[16]){
+
+    if(sa->sa_family == AF_INET6){
+        memcpy(ip, &((const struct sockaddr_in6 *) sa)->sin6_addr, 16);
+        return true;
+    }
+
+    if(sa->sa_family == AF_INET){
+        memset(ip, 0, 10);
+        ip[10] = ip[11] = 0xff;
+        memcpy(ip + 12, &((const struct sockaddr_in *) sa)->sin_addr, 4);
+        return true;
+    }
+
+    return false;
+}
+
+
+/*
+Whether a connection comes from the address of a current member. Unix sockets are left
+to the permissions of the socket file. Receiver thread only.
+*/
+static bool cluster_source_allowed(const struct sockaddr_storage *from){
+
+    unsigned char source[16], member[16];
+
+    if(from->ss_family == AF_UNIX){
+        return true;
+    }
+
+    if(!socket_ip((const struct sockaddr *) from, source)){
+        return false;
+    }
+
+    cluster_ring *ring = atomic_load(&cluster.ring);
+
+    for(int i = 0; i < ring->member_count; i++){
+
+        const char *address = cluster.peers[ring->members[i]].address;
+        const char *colon = strrchr(address, ':');
+        char host[256];
+
+        if(strncmp(address, "unix:", 5) == 0 || colon == NULL || (size_t) (colon - address) >= sizeof(host)){
+            continue;
+        }
+
+        memcpy(host, address, colon - address);
+        host[colon - address] = '\0';
+
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *found;
+        bool match = false;
+
+        if(getaddrinfo(host, NULL, &hints, &found) != 0){
+            continue;
+        }
+
+        for(struct addrinfo *a = found; a != NULL && !match; a = a->ai_next){
+            match = socket_ip(a->ai_addr, member) && memcmp(source, member, 16) == 0;
+        }
+
+        freeaddrinfo(found);
+
+        if(match){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+//Receiver thread: accepts peers, reads their lines and acknowledges them, all through one poll() set.
+void * run_cluster_receiver(void *arg){
+
+    struct pollfd fds[CLUSTER_MAX_NODES * 2 + 1];
+    struct mem buffers[CLUSTER_MAX_NODES * 2 + 1];
+    static char chunk[64 * 1024];
+    int count = 1;
+
+    memset(buffers, 0, sizeof(buffers));
+    fds[0] = (struct pollfd) { cluster.listen_fd, POLLIN, 0 };
+
+    while(!atomic_load(&cluster.stopping)){
+
+        if(poll(fds, count, 200) <= 0){
+            continue;
+        }
+
+        /*
+        While a checkpoint is written nothing is read, so nothing is queued or acknowledged;
+        the lines wait in the sockets, and the senders keep them until they are.
+        */
+        if(!begin_admitting()){
+            struct timespec pause = { 0, 10 * 1000000L };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        if((fds[0].revents & POLLIN) && count < CLUSTER_MAX_NODES * 2 + 1){
+
+            struct sockaddr_storage from;
+            socklen_t from_length = sizeof(from);
+            int fd = accept4(cluster.listen_fd, (struct sockaddr *) &from, &from_length, SOCK_CLOEXEC);
+
+            if(fd >= 0 && !cluster_source_allowed(&from)){
+                log_event(0, NULL, "Refused a cluster connection from outside the membership");
+                close(fd);
+            }
+
+            else if(fd >= 0){
+
+                struct timeval timeout = { 5, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+                fds[count] = (struct pollfd) { fd, POLLIN, 0 };
+                buffers[count] = (struct mem) { NULL, 0, 0 };
+                count++;
+            }
+        }
+
+        for(int i = 1; i < count; i++){
+
+            if(fds[i].revents == 0){
+                continue;
+            }
+
+            struct mem *b = &buffers[i];
+            ssize_t n = read(fds[i].fd, chunk, sizeof(chunk));
+            bool open = (n > 0 && append_bytes(b, chunk, n));
+
+            if(open){
+
+                long lines;
+                size_t used = handle_cluster_lines(b->memory, b->size, &lines);
+
+                memmove(b->memory, b->memory + used, b->size - used);
+                b->size -= used;
+
+                //Their URLs are queued by now, so the sender may count them as delivered.
+                if(lines > 0){
+                    char ack[32];
+                    int length = snprintf(ack, sizeof(ack), "A %ld\n", lines);
+                    open = (send(fds[i].fd, ack, length, MSG_NOSIGNAL) == length);
+                }
+            }
+
+            if(!open){
+
+                //A partial last line is dropped; it was never acknowledged, so the sender will send it again.
+                close(fds[i].fd);
+                free(b->memory);
+                fds[i] = fds[count - 1];
+                buffers[i] = buffers[count - 1];
+                count--;
+                i--;
+            }
+        }
+
+        end_admitting();
+    }
+
+    for(int i = 1; i < count; i++){
+        close(fds[i].fd);
+        free(buffers[i].memory);
+    }
+
+    return NULL;
+}
+
+
+/*
+Joins the cluster: loads the membership, listens on our address and starts the sender
+and receiver threads. Call after the frontier is set up and before the first URL is 
+queued, so the starting URL is routed like any other.
+
+@return bool: false if the membership is unusable or our address cannot be bound.
+*/
+bool start_cluster(URLQueue *URLS){
+
+    struct sockaddr_storage sa;
+    socklen_t length;
+
+    cluster.URLS = URLS;
+    pthread_mutex_init(&cluster.lock, NULL);
+    pthread_cond_init(&cluster.wake, NULL);
+
+    cluster.self = cluster_peer_index(config.node_address);
+
+    if(cluster.self < 0 || !load_membership(config.cluster_file)){
+        return false;
+    }
+
+    if(!parse_cluster_address(config.node_address, &sa, &length)){
+        append_to_log_file("Invalid cluster node address.");
+        return false;
+    }
+
+    if(sa.ss_family == AF_UNIX){
+        unlink(((struct sockaddr_un *) &sa)->sun_path);
+    }
+
+    int one = 1;
+    cluster.listen_fd = socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(cluster.listen_fd < 0 || setsockopt(cluster.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+       bind(cluster.listen_fd, (struct sockaddr *) &sa, length) != 0 || listen(cluster.listen_fd, CLUSTER_MAX_NODES) != 0){
+        log_event(errno, NULL, "Failed to listen on the cluster node address");
+        return false;
+    }
+
+    //Keeps our workers waiting for URLs from other nodes until the coordinator says the crawl is over.
+    atomic_fetch_add(&URLS->outstanding, 1);
+    atomic_store(&cluster.holding, true);
+    cluster.enabled = true;
+
+    if(pthread_create(&cluster.receiver, NULL, run_cluster_receiver, NULL) != 0 ||
+       pthread_create(&cluster.sender, NULL, run_cluster_sender, NULL) != 0){
+        append_to_log_file("Failed to start the cluster threads.");
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+Called right after a URL is dequeued. If the membership changed since start-up and the
+URL's host has moved to another node, forwards it there and retires it here.
+
+@return bool: true if the URL was handed off and must not be fetched.
+*/
+bool cluster_handoff(URLQueue *URLS, frontier_item *item){
+
+    if(!cluster.enabled || !atomic_load_explicit(&cluster.rebalanced, memory_order_relaxed) || item->kind == ITEM_ROBOTS){
+        return false;
+    }
+
+    int owner = cluster_owner(item->url);
+
+    if(owner == cluster.self){
+        return false;
+    }
+
+    cluster_forward(owner, item->url, url_fingerprint(item->url), item->depth, item->kind);
+    URL_done(URLS, item);
+
+    return true;
+}
+
+
+//Stops the cluster threads once the local crawl is over.
+void stop_cluster(void){
+
+    if(!cluster.enabled){
+        return;
+    }
+
+    atomic_store(&cluster.stopping, true);
+    pthread_cond_signal(&cluster.wake);
+    pthread_join(cluster.sender, NULL);
+    pthread_join(cluster.receiver, NULL);
+
+    close(cluster.listen_fd);
+    cluster.listen_fd = -1;
+    cluster.enabled = false;
+}
+
+
+void report_cluster(void){
+
+    cluster_ring *ring = atomic_load(&cluster.ring);
+
+    printf("Cluster: node %s of %d, %ld URLs forwarded, %ld received, %ld repeats not sent%s\n",
+           cluster.peers[cluster.self].address, ring->member_count, atomic_load(&cluster.sent),
+           atomic_load(&cluster.received), atomic_load(&cluster.repeats),
+           atomic_load(&cluster.done) ? "" : " (ended before the cluster finished)");
+}
+
+
+
+/*
+-----------------------------------------
+|        Checkpoint and resume          |
+-----------------------------------------
+A checkpoint is a single file in the state directory, written to a temporary name 
+and renamed over the previous one, so a crash leaves either the old or the new file.
+It holds the BFS level, the spill position, the seen-set, every URL still waiting in
+memory, and the output list. While it is written the crawl is paused: workers take 
+no new URLs and the checkpoint waits until every crawl thread is idle, so nothing is
+in flight. With --cluster, the receiver leaves incoming lines unread and unacknowledged
+and the sender reroutes nothing (see begin_admitting()), so the only thread still 
+moving URLs is the host timer. Hosts are dumped
+before the overflow list and the ring it feeds, so a URL it moves meanwhile is 
+written twice at worst; the duplicate is filtered by the seen-set on resume.
+
+Spilled URLs stay where they are. The checkpoint records where the head segment was 
+being read, how long the tail segment was and how many URLs each segment still holds,
+and segments are only deleted once a newer checkpoint no longer needs them. robots.txt is not saved; hosts fetch it again.
+*/
+
+#define CHECKPOINT_MAGIC "CRAWLCK2"
+
+static struct {
+    pthread_t thread;
+    sem_t wake;
+    atomic_bool stopping;
+    volatile sig_atomic_t exit_requested;   //SIGTERM or SIGINT: one last checkpoint, then exit.
+    URLQueue *URLS;
+    data_list *output;
+    long written;
+} checkpointer;
+
+
+/*
+Stops workers from taking new URLs and waits until every crawl thread is idle, every 
+fetched page parsed and no cluster thread is queueing URLs.
+*/
+void pause_crawl(URLQueue *URLS){
+
+    atomic_store(&URLS->pausing, true);
+
+    struct timespec tick = { 0, 1000000L };
+
+    while(!atomic_load(&URLS->finished) &&
+          (atomic_load(&URLS->workers) == 0 || atomic_load(&URLS->idle_workers) < atomic_load(&URLS->workers) ||
+           atomic_load(&URLS->parsing) > 0 || atomic_load(&cluster.admitting) > 0)){
+        nanosleep(&tick, NULL);
+    }
+}
+
+
+void resume_crawl(URLQueue *URLS){
+
+    pthread_mutex_lock(&URLS->lock);
+    atomic_store(&URLS->pausing, false);
+    pthread_cond_broadcast(&URLS->wake);
+    pthread_mutex_unlock(&URLS->lock);
+}
+
+
+static void write_url_record(FILE *file, const char *url, int depth, enum item_kind kind){
+
+    size_t len = strlen(url);
+    spill_record record = { depth, (uint16_t) len, (uint8_t) kind, 0 };
+
+    fwrite(&record, sizeof(record), 1, file);
+    fwrite(url, 1, len, file);
+}
+
+
+static void write_end_record(FILE *file){
+
+    spill_record end = { -1, 0, 0, 0 };
+
+    fwrite(&end, sizeof(end), 1, file);
+}
+
+
+//robots.txt fetches are left out; they are requested again on resume.
+static void write_node_list(FILE *file, const URLQueueNode *node){
+
+    for(; node != NULL; node = node->next_URL){
+        if(node->kind != ITEM_ROBOTS){
+            write_url_record(file, url_string(node->html_url), node->depth, node->kind);
+        }
+    }
+}
+
+
+static void write_seen_set(FILE *file, seen_set *set){
+
+    int32_t backend = set->backend;
+    fwrite(&backend, sizeof(backend), 1, file);
+
+    if(set->backend == SEEN_BLOOM){
+
+        bloom_filter *bloom = &set->bloom;
+        uint64_t blocks = bloom->block_count;
+        int32_t k = bloom->k;
+        int64_t inserted = atomic_load(&bloom->inserted);
+
+        fwrite(&blocks, sizeof(blocks), 1, file);
+        fwrite(&k, sizeof(k), 1, file);
+        fwrite(&inserted, sizeof(inserted), 1, file);
+        fwrite((const void *) bloom->blocks, sizeof(uint64_t), blocks * 8, file);
+
+        return;
+    }
+
+    for(int i = 0; i < SEEN_SHARDS; i++){
+
+        seen_shard *shard = &set->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        uint64_t count = shard->count;
+        fwrite(&count, sizeof(count), 1, file);
+
+        for(size_t j = 0; j < shard->capacity; j++){
+            if(shard->slots[j] != 0){
+                fwrite(&shard->slots[j], sizeof(uint64_t), 1, file);
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+
+/*
+Writes a checkpoint of the crawl. The caller pauses the crawl first, see pause_crawl().
+
+@return bool: false if the file could not be written; the previous checkpoint is still in place then.
+*/
+bool write_checkpoint(URLQueue *URLS, data_list *output){
+
+    char path[PATH_MAX], temp[PATH_MAX];
+    frontier_spill *spill = &URLS->spill;
+
+    snprintf(path, sizeof(path), "%s/checkpoint", config.state_dir);
+    snprintf(temp, sizeof(temp), "%s/checkpoint.tmp", config.state_dir);
+
+    FILE *file = fopen(temp, "wb");
+
+    if(file == NULL){
+        log_event(errno, temp, "Failed to create checkpoint");
+        return false;
+    }
+
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    fwrite(CHECKPOINT_MAGIC, 1, 8, file);
+
+    int32_t level = URLS->level;
+    fwrite(&level, sizeof(level), 1, file);
+
+    //Spill position. The tail is flushed so the bytes recorded are on disk.
+    pthread_mutex_lock(&spill->refill_lock);
+    pthread_mutex_lock(&spill->lock);
+
+    //Recording bytes that are not in the file would make the resumed segment unreadable; the previous checkpoint stays.
+    if(spill->fd >= 0 && !flush_spill(spill)){
+        pthread_mutex_unlock(&spill->lock);
+        pthread_mutex_unlock(&spill->refill_lock);
+        fclose(file);
+        unlink(temp);
+        return false;
+    }
+
+    int32_t head = spill->head, tail = spill->tail, deleted = spill->deleted;
+    int64_t head_offset = spill->head_offset, tail_size = spill->tail_size, on_disk = atomic_load(&spill->count);
+
+    fwrite(&head, sizeof(head), 1, file);
+    fwrite(&head_offset, sizeof(head_offset), 1, file);
+    fwrite(&tail, sizeof(tail), 1, file);
+    fwrite(&tail_size, sizeof(tail_size), 1, file);
+    fwrite(&on_disk, sizeof(on_disk), 1, file);
+
+    for(int i = head; i <= tail; i++){
+        int64_t records = (i < spill->records_capacity) ? spill->records[i] : 0;
+        fwrite(&records, sizeof(records), 1, file);
+    }
+
+    pthread_mutex_unlock(&spill->lock);
+    pthread_mutex_unlock(&spill->refill_lock);
+
+    write_seen_set(file, &URLS->seen);
+
+    //The frontier: host queues, then the overflow list and the next level, then the ring.
+    for(int i = 0; i < HOST_SHARDS; i++){
+
+        host_shard *shard = &URLS->hosts.shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        for(size_t b = 0; shard->buckets != NULL && b <= shard->mask; b++){
+            for(host_entry *h = shard->buckets[b]; h != NULL; h = h->next){
+                pthread_mutex_lock(&h->lock);
+                write_node_list(file, h->robots_wait_head);
+                write_node_list(file, h->head);
+                pthread_mutex_unlock(&h->lock);
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    pthread_mutex_lock(&URLS->lock);
+    write_node_list(file, URLS->head);
+    write_node_list(file, URLS->next_head);
+    pthread_mutex_unlock(&URLS->lock);
+
+    size_t first = atomic_load(&URLS->dequeue_pos);
+    size_t end = atomic_load(&URLS->enqueue_pos);
+
+    for(size_t pos = first; pos != end; pos++){
+
+        URLQueueSlot *slot = &URLS->slots[pos & URLS->mask];
+
+        //A slot that is not published yet belongs to a URL already written from its host's queue.
+        if(atomic_load_explicit(&slot->sequence, memory_order_acquire) == pos + 1 && slot->kind != ITEM_ROBOTS){
+            write_url_record(file, url_string(slot->html_url), slot->depth, slot->kind);
+        }
+    }
+
+    write_end_record(file);
+
+    pthread_mutex_lock(&output->lock);
+
+    for(URL *found = output->head; found != NULL; found = found->next_URL){
+        write_url_record(file, found->url, 0, ITEM_PAGE);
+    }
+
+    pthread_mutex_unlock(&output->lock);
+
+    write_end_record(file);
+
+    bool ok = (fflush(file) == 0 && fsync(fileno(file)) == 0);
+    ok = (fclose(file) == 0) && ok;
+
+    if(!ok || rename(temp, path) != 0){
+        log_event(errno, path, "Failed to write checkpoint");
+        unlink(temp);
+        return false;
+    }
+
+    //Segments before the head are no longer needed by any checkpoint.
+    char segment[PATH_MAX];
+
+    for(; deleted < head; deleted++){
+        segment_path(segment, sizeof(segment), deleted);
+        unlink(segment);
+    }
+
+    pthread_mutex_lock(&spill->refill_lock);
+    spill->deleted = deleted;
+    pthread_mutex_unlock(&spill->refill_lock);
+
+    checkpointer.written++;
+
+    return true;
+}
+
+
+//Reads one URL record. Returns false at the end marker or on a short read.
+static bool read_url_record(FILE *file, char *url, spill_record *record){
+
+    if(fread(record, sizeof(*record), 1, file) != 1 || record->depth < 0 || record->length >= URL_MAX){
+        return false;
+    }
+
+    if(fread(url, 1, record->length, file) != record->length){
+        return false;
+    }
+
+    url[record->length] = '\0';
+
+    return true;
+}
+
+
+static bool read_seen_set(FILE *file, seen_set *set){
+
+    int32_t backend;
+
+    if(fread(&backend, sizeof(backend), 1, file) != 1 || backend != (int32_t) set->backend){
+        append_to_log_file("Checkpoint was written with another --seen backend");
+        return false;
+    }
+
+    if(set->backend == SEEN_BLOOM){
+
+        bloom_filter *bloom = &set->bloom;
+        uint64_t blocks;
+        int32_t k;
+        int64_t inserted;
+
+        if(fread(&blocks, sizeof(blocks), 1, file) != 1 || fread(&k, sizeof(k), 1, file) != 1 ||
+           fread(&inserted, sizeof(inserted), 1, file) != 1){
+            return false;
+        }
+
+        if(blocks != bloom->block_count || k != bloom->k){
+            append_to_log_file("Checkpoint was written with other --bloom-* settings");
+            return false;
+        }
+
+        atomic_store(&bloom->inserted, inserted);
+
+        return fread((void *) bloom->blocks, sizeof(uint64_t), blocks * 8, file) == blocks * 8;
+    }
+
+    for(int i = 0; i < SEEN_SHARDS; i++){
+
+        uint64_t count, fp;
+
+        if(fread(&count, sizeof(count), 1, file) != 1){
+            return false;
+        }
+
+        for(uint64_t j = 0; j < count; j++){
+
+            if(fread(&fp, sizeof(fp), 1, file) != 1){
+                return false;
+            }
+
+            seen_insert(set, fp);
+        }
+    }
+
+    return true;
+}
+
+
+/*
+Restores the crawl from the checkpoint in the state directory, before any crawl 
+thread starts. Finding no checkpoint is not an error; the crawl just starts fresh.
+
+@return bool: false if the checkpoint is unreadable or does not fit the options.
+*/
+bool load_checkpoint(URLQueue *URLS, data_list *output){
+
+    char path[PATH_MAX];
+    frontier_spill *spill = &URLS->spill;
+
+    snprintf(path, sizeof(path), "%s/checkpoint", config.state_dir);
+
+    FILE *file = fopen(path, "rb");
+
+    if(file == NULL){
+        printf("No checkpoint in %s, starting a new crawl.\n", config.state_dir);
+        return true;
+    }
+
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    char magic[8];
+    int32_t level, head, tail;
+    int64_t head_offset, tail_size, on_disk;
+    bool ok = fread(magic, 1, 8, file) == 8 && memcmp(magic, CHECKPOINT_MAGIC, 8) == 0 &&
+              fread(&level, sizeof(level), 1, file) == 1 &&
+              fread(&head, sizeof(head), 1, file) == 1 && fread(&head_offset, sizeof(head_offset), 1, file) == 1 &&
+              fread(&tail, sizeof(tail), 1, file) == 1 && fread(&tail_size, sizeof(tail_size), 1, file) == 1 &&
+              fread(&on_disk, sizeof(on_disk), 1, file) == 1 && head >= 0 && tail >= head &&
+              reserve_segment_records(spill, tail + 1);
+
+    for(int i = head; ok && i <= tail; i++){
+        int64_t records;
+        ok = fread(&records, sizeof(records), 1, file) == 1;
+        spill->records[i] = (long) records;
+    }
+
+    if(!ok){
+        append_to_log_file("Corrupt checkpoint");
+        fclose(file);
+        return false;
+    }
+
+    //Drop what was spilled after the checkpoint; the tail segment is closed and new URLs go to a fresh one.
+    char segment[PATH_MAX];
+    struct stat st;
+
+    for(int i = tail + 1; segment_path(segment, sizeof(segment), i), stat(segment, &st) == 0; i++){
+        unlink(segment);
+    }
+
+    segment_path(segment, sizeof(segment), tail);
+
+    if(tail_size > 0 && truncate(segment, (off_t) tail_size) != 0){
+        log_event(errno, segment, "Failed to truncate frontier segment");
+    }
+
+    spill->head = spill->deleted = head;
+    spill->head_offset = (size_t) head_offset;
+    spill->tail = (tail_size > 0) ? tail + 1 : tail;
+    atomic_store(&spill->count, on_disk);
+    atomic_fetch_add(&URLS->outstanding, on_disk);
+
+    URLS->level = level;
+
+    if(!read_seen_set(file, &URLS->seen)){
+        append_to_log_file("Corrupt checkpoint");
+        fclose(file);
+        return false;
+    }
+
+    //URLs in the checkpoint are already in the seen-set, so they are admitted directly.
+    char url[URL_MAX];
+    spill_record record;
+    long frontier = 0, found = 0;
+
+    while(read_url_record(file, url, &record)){
+
+        if(record.depth > URLS->max_depth){
+            continue;
+        }
+
+        URLQueueNode *node = (URLQueueNode *) malloc(sizeof(URLQueueNode));
+
+        if(node == NULL || (node->html_url = intern_url(url, record.length, url_fingerprint(url))) == URL_NONE){
+            append_to_log_file("Memory allocation failed");
+            free(node);
+            continue;
+        }
+
+        node->depth = record.depth;
+        node->kind = (enum item_kind) record.kind;
+        node->host = NULL;
+        node->next_URL = NULL;
+
+        admit_batch(URLS, node, node, 1, record.depth);
+        frontier++;
+    }
+
+    while(read_url_record(file, url, &record)){
+        append_data(&output, url);
+        found++;
+    }
+
+    fclose(file);
+
+    printf("Resumed from %s: %ld URLs queued, %ld on disk, %ld found so far.\n", path, frontier, (long) on_disk, found);
+
+    return true;
+}
+
+
+static void request_checkpoint_exit(int signal){
+
+    checkpointer.exit_requested = 1;
+    sem_post(&checkpointer.wake);
+}
+
+
+/*
+The checkpoint thread. Writes a checkpoint every --checkpoint-every seconds, and on
+SIGTERM or SIGINT writes one more and exits, so a restarted crawl loses nothing.
+*/
+void * run_checkpointer(void *arg){
+
+    while(1){
+
+        int rc;
+
+        if(config.checkpoint_every > 0){
+
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += config.checkpoint_every;
+
+            while((rc = sem_timedwait(&checkpointer.wake, &until)) != 0 && errno == EINTR);
+        }
+
+        else {
+            while((rc = sem_wait(&checkpointer.wake)) != 0 && errno == EINTR);
+        }
+
+        if(atomic_load(&checkpointer.stopping) && !checkpointer.exit_requested){
+            break;
+        }
+
+        pause_crawl(checkpointer.URLS);
+        bool ok = write_checkpoint(checkpointer.URLS, checkpointer.output);
+
+        if(checkpointer.exit_requested){
+            printf(ok ? "Checkpoint written to %s, exiting.\n" : "Checkpoint to %s failed, exiting.\n", config.state_dir);
+            exit(ok ? 0 : 1);
+        }
+
+        resume_crawl(checkpointer.URLS);
+    }
+
+    return NULL;
+}
+
+
+bool start_checkpointer(URLQueue *URLS, data_list *output){
+
+    checkpointer.URLS = URLS;
+    checkpointer.output = output;
+    atomic_init(&checkpointer.stopping, false);
+    sem_init(&checkpointer.wake, 0, 0);
+
+    if(pthread_create(&checkpointer.thread, NULL, run_checkpointer, NULL) != 0){
+        append_to_log_file("Failed to start checkpoint thread");
+        return false;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_checkpoint_exit;
+    sigemptyset(&action.sa_mask);
+
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    return true;
+}
+
+
+//Stops the checkpoint thread and writes the final checkpoint of a finished crawl.
+void stop_checkpointer(URLQueue *URLS, data_list *output){
+
+    atomic_store(&checkpointer.stopping, true);
+    sem_post(&checkpointer.wake);
+    pthread_join(checkpointer.thread, NULL);
+
+    write_checkpoint(URLS, output);
+
+    printf("Frontier: %ld URLs spilled to disk, %ld checkpoints written to %s\n",
+           atomic_load(&URLS->spill.total), checkpointer.written, config.state_dir);
+}
+
+
+/*
+// Placeholder for the function to fetch and process a URL.
+
+
+
+*/
+
+
+
+
+
+/*
+Please read https://curl.se/libcurl/c/CURLOPT_WRITEFUNCTION.html#:~:text=This%20callback%20function%20gets%20called,nmemb%3B%20size%20is%20always%201.
+for a better understanding of the write_callback function and it's arguments. 
+
+In a brief description, the write_callback() function is responsible for the transfer of data. In this case,
+between the webpage and the caller who is curl. The data being handled in this case is HTML, which comes 
+in the form of strings. We have to implement this method ourselves. 
+
+@param *ptr: ptr to curl handler. 
+@param size_t size: size of data object being transferred. (e.g int = 4 bytes, char = 1 byte)
+@param size_t nmemb: data object total count. In this case, think of chars or strings. 
+@param void *userdata: Data container to be referenced. 
+*/
+
+/*
+Checks if url is a sitemap xml: its path, ignoring any query or fragment, ends in
+.xml or .xml.gz. 
+*/
+bool check_ifXML(const char *url){
+
+    const char *path = strstr(url, "://");
+    path = (path == NULL) ? url : path + 3;
+
+    size_t len = strcspn(path, "?#");
+
+    if(len >= 4 && strncasecmp(path + len - 4, ".xml", 4) == 0){
+        return true;
+    }
+
+    if(len >= 7 && strncasecmp(path + len - 7, ".xml.gz", 7) == 0){
+        return true;
+    }
+
+    //Not a sitemap url, must be a regular url. 
+    return false;
+}
+
+
+/*
+-----------------------------------------
+|      Multi-pattern target matcher     |
+-----------------------------------------
+All targets are compiled once at start-up into an Aho-Corasick automaton, turned into
+a full DFA so scanning costs one table lookup per byte however many patterns there
+are. Bytes that occur in no pattern share one input class, which keeps the table
+small. The automaton is never written after compile_matcher(), so every worker reads
+it without locking.
+
+Scanning is streaming: a match_stream keeps the DFA state and offset between calls, so
+text may arrive in any number of pieces. match_stream_break() marks the end of a text
+node; matches never span a break. Offsets are byte positions in the page's text 
+(all text runs of the page back to back), the same in every parser mode.
+*/
+
+static bool is_word_byte(unsigned char c){
+
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+
+static unsigned char fold_byte(const ac_automaton *ac, unsigned char c){
+
+    return (ac->ignore_case && c >= 'A' && c <= 'Z') ? (unsigned char) (c | 0x20) : c;
+}
+
+
+/*
+Builds the automaton: a trie of the patterns, failure links by breadth-first search,
+and every missing transition filled in from the failure state, which turns the trie
+into a DFA. Each state's output list includes the outputs of its failure state.
+
+@return ac_automaton*: NULL if there are no non-empty patterns or memory ran out.
+*/
+ac_automaton* compile_matcher(char **patterns, int pattern_count, bool ignore_case, bool whole_word){
+
+    ac_automaton *ac = (ac_automaton *) calloc(1, sizeof(ac_automaton));
+    size_t total = 1;
+
+    if(ac == NULL){
+        return NULL;
+    }
+
+    ac->ignore_case = ignore_case;
+    ac->whole_word = whole_word;
+    ac->patterns = patterns;
+    ac->pattern_count = pattern_count;
+    ac->lengths = (size_t *) calloc(pattern_count > 0 ? pattern_count : 1, sizeof(size_t));
+
+    if(ac->lengths == NULL){
+        free(ac);
+        return NULL;
+    }
+
+    //Columns: class 0 for every byte no pattern uses, then one per distinct byte.
+    ac->class_count = 1;
+
+    for(int i = 0; i < pattern_count; i++){
+
+        ac->lengths[i] = strlen(patterns[i]);
+        total += ac->lengths[i];
+
+        if(ac->lengths[i] > ac->max_len){
+            ac->max_len = ac->lengths[i];
+        }
+
+        for(size_t j = 0; j < ac->lengths[i]; j++){
+
+            unsigned char c = fold_byte(ac, (unsigned char) patterns[i][j]);
+
+            if(ac->byte_class[c] == 0 && ac->class_count < 256){
+                ac->byte_class[c] = (uint8_t) ac->class_count++;
+            }
+        }
+    }
+
+    if(ac->max_len == 0){
+        free(ac->lengths);
+        free(ac);
+        return NULL;
+    }
+
+    if(ignore_case){
+        for(int c = 'A'; c <= 'Z'; c++){
+            ac->byte_class[c] = ac->byte_class[c | 0x20];
+        }
+    }
+
+    int C = ac->class_count;
+    int32_t *fail = (int32_t *) calloc(total, sizeof(int32_t));
+    int32_t *queue = (int32_t *) calloc(total, sizeof(int32_t));
+    int32_t *own_count = (int32_t *) calloc(total, sizeof(int32_t));
+    int32_t **own = (int32_t **) calloc(total, sizeof(int32_t *));
+    ac->next = (int32_t *) malloc(total * C * sizeof(int32_t));
+
+    if(!fail || !queue || !own_count || !own || !ac->next){
+        free(fail); free(queue); free(own_count); free(own); free(ac->next); free(ac->lengths); free(ac);
+        return NULL;
+    }
+
+    //-1 marks "no trie edge yet".
+    for(size_t i = 0; i < total * C; i++){
+        ac->next[i] = -1;
+    }
+
+    ac->state_count = 1;
+
+    for(int i = 0; i < pattern_count; i++){
+
+        int32_t state = 0;
+
+        for(size_t j = 0; j < ac->lengths[i]; j++){
+
+            int c = ac->byte_class[fold_byte(ac, (unsigned char) patterns[i][j])];
+
+            if(ac->next[state * C + c] < 0){
+                ac->next[state * C + c] = ac->state_count++;
+            }
+
+            state = ac->next[state * C + c];
+        }
+
+        if(ac->lengths[i] > 0){
+
+            int32_t *grown = (int32_t *) realloc(own[state], (own_count[state] + 1) * sizeof(int32_t));
+
+            if(grown == NULL){
+                append_to_log_file("Memory allocation failed");
+                for(size_t k = 0; k < total; k++){
+                    free(own[k]);
+                }
+                free(fail); free(queue); free(own_count); free(own); free(ac->next); free(ac->lengths); free(ac);
+                return NULL;
+            }
+
+            own[state] = grown;
+            own[state][own_count[state]++] = i;
+        }
+    }
+
+    //Breadth-first: a state's failure state is always finished before the state itself.
+    int head = 0, tail = 0;
+
+    for(int c = 0; c < C; c++){
+
+        int32_t child = ac->next[c];
+
+        if(child < 0){
+            ac->next[c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+
+    while(head < tail){
+
+        int32_t state = queue[head++];
+
+        for(int c = 0; c < C; c++){
+
+            int32_t child = ac->next[state * C + c];
+
+            if(child < 0){
+                ac->next[state * C + c] = ac->next[fail[state] * C + c];
+            } else {
+                fail[child] = ac->next[fail[state] * C + c];
+                queue[tail++] = child;
+            }
+        }
+    }
+
+    //Flatten the output lists, each state inheriting its failure state's list.
+    ac->out_start = (int32_t *) calloc(ac->state_count, sizeof(int32_t));
+    ac->out_count = (int32_t *) calloc(ac->state_count, sizeof(int32_t));
+
+    bool flattening = (ac->out_start != NULL && ac->out_count != NULL);
+    size_t out_total = 0;
+
+    for(int i = 0; flattening && i < tail; i++){
+        int32_t state = queue[i];
+        ac->out_count[state] = own_count[state] + ac->out_count[fail[state]];
+        out_total += ac->out_count[state];
+    }
+
+    ac->outputs = flattening ? (int32_t *) malloc((out_total + 1) * sizeof(int32_t)) : NULL;
+    size_t used = 0;
+
+    for(int i = 0; ac->outputs && i < tail; i++){
+
+        int32_t state = queue[i];
+        int32_t inherited = fail[state];
+
+        ac->out_start[state] = (int32_t) used;
+
+        for(int j = 0; j < own_count[state]; j++){
+            ac->outputs[used++] = own[state][j];
+        }
+
+        for(int j = 0; j < ac->out_count[inherited]; j++){
+            ac->outputs[used++] = ac->outputs[ac->out_start[inherited] + j];
+        }
+    }
+
+    for(size_t i = 0; i < total; i++){
+        free(own[i]);
+    }
+
+    free(own);
+    free(own_count);
+    free(queue);
+    free(fail);
+
+    if(ac->outputs == NULL){
+        append_to_log_file("Memory allocation failed");
+        free(ac->out_start); free(ac->out_count); free(ac->next); free(ac->lengths); free(ac);
+        return NULL;
+    }
+
+    return ac;
+}
+
+
+static void add_hit(match_list *list, int pattern, size_t offset){
+
+    if(list->count >= MAX_HITS_PER_PAGE){
+        return;
+    }
+
+    if(list->count == list->capacity){
+
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        match_hit *hits = (match_hit *) realloc(list->hits, capacity * sizeof(match_hit));
+
+        if(hits == NULL){
+            return;
+        }
+
+        list->hits = hits;
+        list->capacity = capacity;
+    }
+
+    list->hits[list->count].pattern = pattern;
+    list->hits[list->count].offset = offset;
+    list->count++;
+}
+
+
+bool init_match_stream(match_stream *ms, const ac_automaton *ac, match_list *hits){
+
+    memset(ms, 0, sizeof(*ms));
+    ms->ac = ac;
+    ms->hits = hits;
+
+    if(ac->whole_word){
+        ms->word_history = (uint8_t *) calloc(ac->max_len + 1, 1);
+        return ms->word_history != NULL;
+    }
+
+    return true;
+}
+
+
+//Whole-word hits waiting on the byte after them: accept them if that byte ends the word.
+static void resolve_pending(match_stream *ms, bool boundary_follows){
+
+    if(boundary_follows){
+        for(size_t i = 0; i < ms->pending_count; i++){
+            add_hit(ms->hits, ms->pending[i].pattern, ms->pending[i].offset);
+        }
+    }
+
+    ms->pending_count = 0;
+}
+
+
+/*
+Feeds one piece of text through the automaton, adding a hit for every pattern
+occurrence. Overlapping and nested occurrences are all reported.
+*/
+void match_stream_feed(match_stream *ms, const char *text, size_t len){
+
+    const ac_automaton *ac = ms->ac;
+    const int C = ac->class_count;
+    const int32_t *next = ac->next;
+    const uint8_t *byte_class = ac->byte_class;
+    int32_t state = ms->state;
+    size_t history = ac->max_len + 1;
+
+    for(size_t i = 0; i < len; i++){
+
+        unsigned char c = (unsigned char) text[i];
+        size_t pos = ms->offset + i;
+
+        if(ac->whole_word){
+
+            if(ms->pending_count > 0){
+                resolve_pending(ms, !is_word_byte(c));
+            }
+
+            ms->word_history[pos % history] = is_word_byte(c);
+        }
+
+        state = next[state * C + byte_class[c]];
+
+        if(ac->out_count[state] == 0){
+            continue;
+        }
+
+        for(int j = 0; j < ac->out_count[state]; j++){
+
+            int pattern = ac->outputs[ac->out_start[state] + j];
+            size_t start = pos + 1 - ac->lengths[pattern];
+
+            if(!ac->whole_word){
+                add_hit(ms->hits, pattern, start);
+                continue;
+            }
+
+            //Leading edge: start of the text node, or a non-word byte before the match.
+            if(start > ms->run_start && ms->word_history[(start - 1) % history]){
+                continue;
+            }
+
+            if(ms->pending_count == ms->pending_capacity){
+
+                size_t capacity = ms->pending_capacity ? ms->pending_capacity * 2 : 8;
+                match_hit *pending = (match_hit *) realloc(ms->pending, capacity * sizeof(match_hit));
+
+                if(pending == NULL){
+                    continue;
+                }
+
+                ms->pending = pending;
+                ms->pending_capacity = capacity;
+            }
+
+            ms->pending[ms->pending_count].pattern = pattern;
+            ms->pending[ms->pending_count].offset = start;
+            ms->pending_count++;
+        }
+    }
+
+    ms->state = state;
+    ms->offset += len;
+}
+
+
+//Ends the current text node: pending whole-word hits are accepted and the DFA restarts.
+void match_stream_break(match_stream *ms){
+
+    resolve_pending(ms, true);
+    ms->state = 0;
+    ms->run_start = ms->offset;
+}
+
+
+void free_match_stream(match_stream *ms){
+
+    free(ms->word_history);
+    free(ms->pending);
+    ms->word_history = NULL;
+    ms->pending = NULL;
+}
+
+
+void free_match_list(match_list *list){
+
+    free(list->hits);
+    list->hits = NULL;
+    list->count = list->capacity = 0;
+}
+
+
+
+/*
+Prints a page on which targets were found, with every hit, and adds it to the output.
+Does nothing if the page had no hits.
+*/
+void record_match(struct data_list *output, const ac_automaton *ac, const char *url, match_list *hits){
+
+    //The validator cache keeps the matches too, so an unchanged page can report them without being parsed.
+    if(capturing_page != NULL && hits->count > 0){
+
+        match_list *kept = &capturing_page->hits;
+        match_hit *grown = (match_hit *) realloc(kept->hits, (kept->count + hits->count) * sizeof(match_hit));
+
+        if(grown != NULL){
+            memcpy(grown + kept->count, hits->hits, hits->count * sizeof(match_hit));
+            kept->hits = grown;
+            kept->count += hits->count;
+            kept->capacity = kept->count;
+        }
+    }
+
+    if(hits->count == 0){
+        return;
+    }
+
+    printf("found it! At ");
+    printf("URL: %s (%zu hits)\n", url, hits->count);
+
+    for(size_t i = 0; i < hits->count; i++){
+        printf("    \"%s\" at offset %zu\n", ac->patterns[hits->hits[i].pattern], hits->hits[i].offset);
+    }
+
+    append_data(&output, url);
+}
+
+
+
+/*
+SAX callback for every start tag. Queues the href of each anchor as soon as the 
+parser reaches it, while the rest of the page is still downloading. A <base href>
+changes what the anchors after it are resolved against.
+*/
+void stream_start_element(void *ctx, const xmlChar *name, const xmlChar **atts){
+
+    stream_parser *parser = (stream_parser *) ctx;
+
+    //A target cannot span two text nodes.
+    match_stream_break(&parser->ms);
+
+    if(atts == NULL){
+        return;
+    }
+
+    bool anchor = (xmlStrcasecmp(name, (const xmlChar *) "a") == 0);
+
+    if(!anchor && xmlStrcasecmp(name, (const xmlChar *) "base") != 0){
+        return;
+    }
+
+    for(int i = 0; atts[i] != NULL; i += 2){
+
+        if(atts[i + 1] == NULL || xmlStrcasecmp(atts[i], (const xmlChar *) "href") != 0){
+            continue;
+        }
+
+        const char *href = (const char *) atts[i + 1];
+
+        if(anchor && parser->defer_links){
+
+            char url[URL_MAX];
+            size_t n = resolve_url(parser->base, href, strlen(href), url, sizeof(url));
+
+            if(n > 0){
+                append_bytes(&parser->deferred, url, n + 1);
+            }
+        }
+
+        else if(anchor){
+            enqueue_link(parser->args->url_q, parser->base, href, strlen(href), parser->depth + 1);
+        }
+
+        else {
+
+            char base[URL_MAX];
+
+            if(resolve_url(parser->url, href, strlen(href), base, sizeof(base)) > 0){
+                memcpy(parser->base, base, sizeof(base));
+            }
+        }
+
+        return;
+    }
+}
+
+
+void stream_end_element(void *ctx, const xmlChar *name){
+
+    match_stream_break(&((stream_parser *) ctx)->ms);
+}
+
+
+/*
+SAX callback for text. libxml2 may hand over one text node in several pieces; the
+match stream carries its state from one piece to the next.
+*/
+void stream_characters(void *ctx, const xmlChar *ch, int len){
+
+    stream_parser *parser = (stream_parser *) ctx;
+
+    if(len > 0){
+        match_stream_feed(&parser->ms, (const char *) ch, (size_t) len);
+    }
+}
+
+
+//SAX handler shared by every stream parser; filled in once.
+static xmlSAXHandler stream_sax;
+static pthread_once_t stream_sax_once = PTHREAD_ONCE_INIT;
+
+
+void init_stream_sax(void){
+
+    memset(&stream_sax, 0, sizeof(stream_sax));
+    stream_sax.startElement = stream_start_element;
+    stream_sax.endElement = stream_end_element;
+    stream_sax.characters = stream_characters;
+}
+
+
+/*
+Creates a push parser for one page. Only the handlers we need are set, so libxml2
+never builds a tree and errors in the markup are ignored. 
+
+@return stream_parser*: NULL on failure; the caller then falls back to parsing the buffered body.
+*/
+stream_parser* create_stream_parser(struct crawl_args *args, const char *url, int depth){
+
+    pthread_once(&stream_sax_once, init_stream_sax);
+
+    stream_parser *parser = (stream_parser *) calloc(1, sizeof(stream_parser));
+
+    if(parser == NULL){
+        return NULL;
+    }
+
+    parser->args = args;
+    parser->url = url;
+    snprintf(parser->base, sizeof(parser->base), "%s", url);
+    parser->depth = depth;
+    parser->defer_links = (config.near_duplicate_bits >= 0);
+
+    if(!init_match_stream(&parser->ms, args->matcher, &parser->hits)){
+        free(parser);
+        return NULL;
+    }
+
+    parser->ctxt = htmlCreatePushParserCtxt(&stream_sax, parser, NULL, 0, url, XML_CHAR_ENCODING_NONE);
+
+    if(parser->ctxt == NULL){
+        append_to_log_file("Failed to create HTML push parser");
+        free_match_stream(&parser->ms);
+        free(parser);
+        return NULL;
+    }
+
+    htmlCtxtUseOptions(parser->ctxt, HTML_PARSE_NOWARNING | HTML_PARSE_NOERROR | HTML_PARSE_NONET);
+
+    return parser;
+}
+
+
+//Queues the links a stream parser held back while the page might still turn out to be a near duplicate.
+void queue_deferred_links(URLQueue *URLS, stream_parser *parser){
+
+    const char *p = parser->deferred.memory;
+    const char *end = p + parser->deferred.size;
+
+    while(p < end){
+
+        size_t len = strlen(p);
+
+        enqueue_link(URLS, NULL, p, len, parser->depth + 1);
+        p += len + 1;
+    }
+}
+
+
+void free_stream_parser(stream_parser *parser){
+
+    htmlFreeParserCtxt(parser->ctxt);
+    free_match_stream(&parser->ms);
+    free_match_list(&parser->hits);
+    free(parser->deferred.memory);
+    free(parser);
+}
+
+
+/*
+-----------------------------------------
+|          Streaming sitemaps           |
+-----------------------------------------
+Sitemaps are never buffered. write_callback() hands each chunk to sitemap_feed(), 
+which inflates it if the file is gzip compressed (detected from its first byte, so 
+.xml.gz works whatever the server calls it) and pushes it through a SAX parser. The 
+text of each <loc> is collected in a fixed buffer and the URLs are queued in batches 
+of up to SITEMAP_BATCH, so memory stays the same whether the sitemap has ten entries
+or fifty thousand. A <loc> inside <url> is a page one level deeper than the sitemap;
+a <loc> inside <sitemap> (a sitemap index) is another sitemap at the same level, and
+goes back on the frontier so the children are fetched in parallel.
+*/
+
+#define SITEMAP_LOC_MAX 2048
+#define SITEMAP_BATCH 128
+#define SITEMAP_BATCH_BYTES (64 * 1024)
+
+typedef struct sitemap_parser{
+    xmlParserCtxtPtr ctxt;
+    URLQueue *url_q;
+    const char *url;                  //Relative <loc> values are resolved against it.
+    int depth;                        //Depth of the sitemap itself.
+
+    bool started;                     //First byte seen, so we know whether it is gzip.
+    bool gzipped;
+    bool inflate_done;
+    z_stream zs;
+
+    enum item_kind entry;             //ITEM_PAGE inside <url>, ITEM_SITEMAP inside <sitemap>.
+    bool in_loc;
+    bool loc_too_long;
+    size_t loc_len;
+    char loc[SITEMAP_LOC_MAX];
+
+    enum item_kind batch_kind;
+    int batch_count;
+    size_t batch_used;
+    const char *batch[SITEMAP_BATCH];
+    char batch_bytes[SITEMAP_BATCH_BYTES];
+
+    long locs;                        //Entries found so far.
+} sitemap_parser;
+
+
+//Queues the collected entries.
+void flush_sitemap_batch(sitemap_parser *sm){
+
+    if(sm->batch_count > 0){
+        int depth = (sm->batch_kind == ITEM_SITEMAP) ? sm->depth : sm->depth + 1;
+        enqueue_batch(sm->url_q, sm->batch, sm->batch_count, depth, sm->batch_kind);
+    }
+
+    sm->batch_count = 0;
+    sm->batch_used = 0;
+}
+
+
+static void sitemap_start_element(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI,
+                                  int nb_namespaces, const xmlChar **namespaces, int nb_attributes, int nb_defaulted,
+                                  const xmlChar **attributes){
+
+    sitemap_parser *sm = (sitemap_parser *) ctx;
+
+    if(xmlStrcmp(localname, (const xmlChar *) "url") == 0){
+        sm->entry = ITEM_PAGE;
+    }
+
+    else if(xmlStrcmp(localname, (const xmlChar *) "sitemap") == 0){
+        sm->entry = ITEM_SITEMAP;
+    }
+
+    else if(xmlStrcmp(localname, (const xmlChar *) "loc") == 0){
+        sm->in_loc = true;
+        sm->loc_too_long = false;
+        sm->loc_len = 0;
+    }
+}
+
+
+static void sitemap_end_element(void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI){
+
+    sitemap_parser *sm = (sitemap_parser *) ctx;
+
+    if(!sm->in_loc || xmlStrcmp(localname, (const xmlChar *) "loc") != 0){
+        return;
+    }
+
+    sm->in_loc = false;
+
+    //Trim the white space sitemaps often put around the URL.
+    char *loc = sm->loc;
+    size_t len = sm->loc_len;
+
+    while(len > 0 && isspace((unsigned char) loc[len - 1])) len--;
+    while(len > 0 && isspace((unsigned char) *loc)) { loc++; len--; }
+
+    if(len == 0 || sm->loc_too_long){
+        return;
+    }
+
+    if(sm->batch_count == SITEMAP_BATCH || sm->batch_used + URL_MAX > SITEMAP_BATCH_BYTES ||
+       (sm->batch_count > 0 && sm->batch_kind != sm->entry)){
+        flush_sitemap_batch(sm);
+    }
+
+    //Normalized straight into the batch.
+    char *copy = sm->batch_bytes + sm->batch_used;
+
+    len = resolve_url(sm->url, loc, len, copy, URL_MAX);
+
+    if(len == 0){
+        return;
+    }
+
+    sm->batch_used += len + 1;
+    sm->batch_kind = sm->entry;
+    sm->batch[sm->batch_count++] = copy;
+    sm->locs++;
+}
+
+
+static void sitemap_characters(void *ctx, const xmlChar *ch, int len){
+
+    sitemap_parser *sm = (sitemap_parser *) ctx;
+
+    if(!sm->in_loc){
+        return;
+    }
+
+    if(sm->loc_len + len >= SITEMAP_LOC_MAX){
+        sm->loc_too_long = true;
+        return;
+    }
+
+    memcpy(sm->loc + sm->loc_len, ch, len);
+    sm->loc_len += len;
+}
+
+
+static xmlSAXHandler sitemap_sax;
+static pthread_once_t sitemap_sax_once = PTHREAD_ONCE_INIT;
+
+
+void init_sitemap_sax(void){
+
+    memset(&sitemap_sax, 0, sizeof(sitemap_sax));
+
+    //SAX2, so element names arrive without their namespace prefix.
+    sitemap_sax.initialized = XML_SAX2_MAGIC;
+    sitemap_sax.startElementNs = sitemap_start_element;
+    sitemap_sax.endElementNs = sitemap_end_element;
+    sitemap_sax.characters = sitemap_characters;
+    sitemap_sax.cdataBlock = sitemap_characters;
+}
+
+
+sitemap_parser* create_sitemap_parser(URLQueue *url_q, const char *url, int depth){
+
+    pthread_once(&sitemap_sax_once, init_sitemap_sax);
+
+    sitemap_parser *sm = (sitemap_parser *) calloc(1, sizeof(sitemap_parser));
+
+    if(sm == NULL){
+        append_to_log_file("Failed to allocate memory.");
+        return NULL;
+    }
+
+    sm->url_q = url_q;
+    sm->url = url;
+    sm->depth = depth;
+    sm->entry = ITEM_PAGE;
+    sm->ctxt = xmlCreatePushParserCtxt(&sitemap_sax, sm, NULL, 0, url);
+
+    if(sm->ctxt == NULL){
+        append_to_log_file("Failed to create sitemap parser");
+        free(sm);
+        return NULL;
+    }
+
+    //No network access and no entity substitution: a sitemap cannot make us read anything else.
+    xmlCtxtUseOptions(sm->ctxt, XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+
+    return sm;
+}
+
+
+/*
+Takes the next chunk of a sitemap as it arrives.
+
+@return bool: false if the data is corrupt; the transfer is then aborted.
+*/
+bool sitemap_feed(sitemap_parser *sm, const char *data, size_t len){
+
+    if(len == 0 || sm->inflate_done){
+        return true;
+    }
+
+    if(!sm->started){
+
+        sm->started = true;
+
+        //No XML document starts with 0x1f, so this is enough to spot the gzip magic.
+        if((unsigned char) data[0] == 0x1f){
+
+            if(inflateInit2(&sm->zs, 16 + MAX_WBITS) != Z_OK){
+                append_to_log_file("Failed to initialise gzip decoder");
+                return false;
+            }
+
+            sm->gzipped = true;
+        }
+    }
+
+    if(!sm->gzipped){
+        xmlParseChunk(sm->ctxt, data, (int) len, 0);
+        return true;
+    }
+
+    char out[16384];
+
+    sm->zs.next_in = (Bytef *) data;
+    sm->zs.avail_in = (uInt) len;
+
+    do {
+        sm->zs.next_out = (Bytef *) out;
+        sm->zs.avail_out = sizeof(out);
+
+        int rc = inflate(&sm->zs, Z_NO_FLUSH);
+
+        if(rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR){
+            log_event(rc, NULL, "Corrupt gzip sitemap");
+            return false;
+        }
+
+        size_t produced = sizeof(out) - sm->zs.avail_out;
+
+        if(produced > 0){
+            xmlParseChunk(sm->ctxt, out, (int) produced, 0);
+        }
+
+        if(rc == Z_STREAM_END){
+            sm->inflate_done = true;
+            break;
+        }
+
+        if(rc == Z_BUF_ERROR && produced == 0){
+            break;
+        }
+
+    } while(sm->zs.avail_in > 0 || sm->zs.avail_out == 0);
+
+    return true;
+}
+
+
+//Ends the document and queues the last batch.
+void finish_sitemap(sitemap_parser *sm){
+
+    xmlParseChunk(sm->ctxt, NULL, 0, 1);
+    flush_sitemap_batch(sm);
+}
+
+
+void free_sitemap_parser(sitemap_parser *sm){
+
+    if(sm->gzipped){
+        inflateEnd(&sm->zs);
+    }
+
+    xmlFreeParserCtxt(sm->ctxt);
+    free(sm);
+}
+
+
+/*
+-----------------------------------------
+|       Near-duplicate detection        |
+-----------------------------------------
+With --near-duplicates=K every page gets a 64-bit SimHash while it downloads: 
+write_callback() feeds each chunk to simhash_feed(), which skips markup, splits the 
+text into lowercase words and lets every run of three words vote on each of the 64 
+bits. Pages with similar text end up with fingerprints that differ in few bits. A 
+page within K bits of one seen earlier in the crawl is a duplicate: its targets are 
+not matched and its links are not queued, which prunes the printer views, tracking 
+parameter variants and mirrors below it as well.
+
+Earlier fingerprints live in an LSH index. The 64 bits are cut into K + 1 bands; two
+fingerprints at most K bits apart agree completely on at least one band, so only the 
+fingerprints in the same bucket of some band need comparing. Buckets are guarded by
+striped locks, so pages whose buckets do not share a stripe are checked in parallel.
+Pages with fewer than NEAR_DUP_MIN_SHINGLES shingles are too short to fingerprint 
+reliably and are always kept.
+*/
+
+#define NEAR_DUP_MAX_BITS 7
+#define NEAR_DUP_BUCKETS 65536                //Per band.
+#define NEAR_DUP_MIN_SHINGLES 32
+
+typedef struct simhash_state{
+    int32_t votes[64];
+    uint64_t words[2];           //The two words before the current one.
+    uint64_t word;               //FNV-1a of the current word so far.
+    long shingles;
+    bool in_tag;
+    bool in_word;
+} simhash_state;
+
+typedef struct near_dup_bucket{
+    uint64_t *fingerprints;
+    uint32_t count, capacity;
+} near_dup_bucket;
+
+
+static struct {
+    int bands;
+    int band_bits;
+    near_dup_bucket *buckets;                 //bands * NEAR_DUP_BUCKETS.
+    pthread_mutex_t locks[SEEN_SHARDS];
+    atomic_long pages;                        //Fingerprinted.
+    atomic_long duplicates;
+} near_dups;
+
+
+bool init_near_dups(void){
+
+    near_dups.bands = config.near_duplicate_bits + 1;
+    near_dups.band_bits = 64 / near_dups.bands;
+    near_dups.buckets = (near_dup_bucket *) calloc((size_t) near_dups.bands * NEAR_DUP_BUCKETS, sizeof(near_dup_bucket));
+
+    if(near_dups.buckets == NULL){
+        append_to_log_file("Memory allocation failed");
+        return false;
+    }
+
+    for(int i = 0; i < SEEN_SHARDS; i++){
+        pthread_mutex_init(&near_dups.locks[i], NULL);
+    }
+
+    return true;
+}
+
+
+//A finished word forms a shingle with the two before it, and the shingle votes on every bit.
+static void simhash_word(simhash_state *state){
+
+    if(state->words[0] != 0){
+
+        uint64_t h = state->words[0] * 0x9E3779B97F4A7C15ULL;
+        h = (h ^ state->words[1]) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ state->word) * 0x94D049BB133111EBULL;
+        h ^= h >> 31;
+
+        for(int bit = 0; bit < 64; bit++){
+            state->votes[bit] += ((h >> bit) & 1) ? 1 : -1;
+        }
+
+        state->shingles++;
+    }
+
+    state->words[0] = state->words[1];
+    state->words[1] = state->word;
+}
+
+
+//Adds a chunk of the page to its fingerprint. Words and tags may be split across chunks.
+void simhash_feed(simhash_state *state, const char *data, size_t len){
+
+    for(size_t i = 0; i < len; i++){
+
+        unsigned char c = (unsigned char) data[i];
+
+        if(state->in_tag){
+            state->in_tag = (c != '>');
+            continue;
+        }
+
+        if(isalnum(c) || c >= 0x80){
+
+            if(!state->in_word){
+                state->word = 0xCBF29CE484222325ULL;
+                state->in_word = true;
+            }
+
+            state->word = (state->word ^ (unsigned char) tolower(c)) * 0x100000001B3ULL;
+            continue;
+        }
+
+        if(state->in_word){
+            simhash_word(state);
+            state->in_word = false;
+        }
+
+        if(c == '<'){
+            state->in_tag = true;
+        }
+    }
+}
+
+
+//The fingerprint: each bit is set if more shingles voted for it than against.
+uint64_t simhash_finish(simhash_state *state){
+
+    uint64_t fingerprint = 0;
+
+    if(state->in_word){
+        simhash_word(state);
+        state->in_word = false;
+    }
+
+    for(int bit = 0; bit < 64; bit++){
+        if(state->votes[bit] > 0){
+            fingerprint |= 1ULL << bit;
+        }
+    }
+
+    return fingerprint;
+}
+
+
+//The bucket of fingerprint in band.
+static size_t near_dup_bucket_index(uint64_t fingerprint, int band){
+
+    int bits = near_dups.band_bits;
+    uint64_t value = (fingerprint >> (band * bits)) & (bits == 64 ? ~0ULL : (1ULL << bits) - 1);
+
+    //Wide bands are hashed down to the bucket count.
+    if(bits > 16){
+        value = (value * 0x9E3779B97F4A7C15ULL) >> 48;
+    }
+
+    return (size_t) band * NEAR_DUP_BUCKETS + value;
+}
+
+
+/*
+Finishes a page's fingerprint and looks it up. A page that is not a duplicate is 
+added to the index, so later copies of it are caught. The stripes of all its buckets
+are held together, taken in ascending order, so two copies finishing at once cannot 
+both miss each other.
+
+@return bool: true if an earlier page was within --near-duplicates bits.
+*/
+bool is_near_duplicate(simhash_state *state){
+
+    uint64_t fingerprint = simhash_finish(state);
+    size_t index[NEAR_DUP_MAX_BITS + 1];
+    bool locked[SEEN_SHARDS] = {false};
+    bool found = false;
+
+    if(state->shingles < NEAR_DUP_MIN_SHINGLES){
+        return false;
+    }
+
+    atomic_fetch_add(&near_dups.pages, 1);
+
+    for(int band = 0; band < near_dups.bands; band++){
+        index[band] = near_dup_bucket_index(fingerprint, band);
+        locked[index[band] % SEEN_SHARDS] = true;
+    }
+
+    for(int i = 0; i < SEEN_SHARDS; i++){
+        if(locked[i]) pthread_mutex_lock(&near_dups.locks[i]);
+    }
+
+    for(int band = 0; band < near_dups.bands && !found; band++){
+
+        near_dup_bucket *bucket = &near_dups.buckets[index[band]];
+
+        for(uint32_t i = 0; i < bucket->count && !found; i++){
+            found = __builtin_popcountll(bucket->fingerprints[i] ^ fingerprint) <= config.near_duplicate_bits;
+        }
+    }
+
+    for(int band = 0; band < near_dups.bands && !found; band++){
+
+        near_dup_bucket *bucket = &near_dups.buckets[index[band]];
+
+        if(bucket->count == bucket->capacity){
+
+            uint32_t capacity = bucket->capacity ? bucket->capacity * 2 : 4;
+            uint64_t *grown = (uint64_t *) realloc(bucket->fingerprints, capacity * sizeof(uint64_t));
+
+            if(grown != NULL){
+                bucket->fingerprints = grown;
+                bucket->capacity = capacity;
+            }
+        }
+
+        if(bucket->count < bucket->capacity){
+            bucket->fingerprints[bucket->count++] = fingerprint;
+        }
+    }
+
+    for(int i = SEEN_SHARDS - 1; i >= 0; i--){
+        if(locked[i]) pthread_mutex_unlock(&near_dups.locks[i]);
+    }
+
+    if(found){
+        atomic_fetch_add(&near_dups.duplicates, 1);
+    }
+
+    return found;
+}
+
+
+void report_near_dups(void){
+
+    printf("Near duplicates: %ld of %ld fingerprinted pages skipped (within %d bits)\n",
+           atomic_load(&near_dups.duplicates), atomic_load(&near_dups.pages), config.near_duplicate_bits);
+}
+
+
+
+/*
+-----------------------------------------
+|          Response buffer pool         |
+-----------------------------------------
+Every thread that fetches keeps a small stack of body buffers it has used before, so
+a page normally reuses the memory of an earlier page instead of starting from a
+one-byte malloc and reallocating for every chunk curl delivers. A new response takes
+the smallest pooled buffer that fits the expected size; the expected size is the 
+Content-Length header when the server sends one (see header_callback()), and the 
+buffer grows geometrically from there if the body turns out larger. free_response() 
+gives the buffer back. Buffers above POOL_KEEP_MAX are freed instead of pooled so a 
+single huge page does not pin memory for the rest of the crawl.
+*/
+
+#define POOL_BUFFERS 64                    //Idle buffers kept per thread.
+#define POOL_MIN_CAPACITY (32 * 1024)
+#define POOL_KEEP_MAX (4 * 1024 * 1024)
+#define CONTENT_LENGTH_HINT_MAX (64L * 1024 * 1024)   //Larger claims are not trusted for preallocation.
+
+typedef struct buffer_pool{
+    int count;
+    char  *memory[POOL_BUFFERS];
+    size_t capacity[POOL_BUFFERS];
+} buffer_pool;
+
+static __thread buffer_pool thread_pool;
+
+
+//Makes sure body can hold needed bytes plus the terminating NUL, growing it by at least half each time.
+bool reserve_body(struct mem *body, size_t needed){
+
+    if(needed + 1 <= body->capacity){
+        return true;
+    }
+
+    size_t capacity = body->capacity + body->capacity / 2;
+
+    if(capacity < needed + 1){
+        capacity = needed + 1;
+    }
+
+    char *memory = (char *) realloc(body->memory, capacity);
+
+    if(memory == NULL){
+        append_to_log_file("Failed to allocate memory.");
+        return false;
+    }
+
+    body->memory = memory;
+    body->capacity = capacity;
+
+    return true;
+}
+
+
+/*
+Gives body an empty buffer with room for at least hint bytes, from this thread's pool
+when it has one.
+
+@return bool: false if memory ran out.
+*/
+bool acquire_body(struct mem *body, size_t hint){
+
+    buffer_pool *pool = &thread_pool;
+    int best = -1, largest = -1;
+
+    //Smallest pooled buffer that fits; failing that, the largest, which is grown.
+    for(int i = 0; i < pool->count; i++){
+
+        if(pool->capacity[i] > hint && (best < 0 || pool->capacity[i] < pool->capacity[best])){
+            best = i;
+        }
+
+        if(largest < 0 || pool->capacity[i] > pool->capacity[largest]){
+            largest = i;
+        }
+    }
+
+    if(best < 0){
+        best = largest;
+    }
+
+    if(best >= 0){
+        body->memory = pool->memory[best];
+        body->capacity = pool->capacity[best];
+        pool->count--;
+        pool->memory[best] = pool->memory[pool->count];
+        pool->capacity[best] = pool->capacity[pool->count];
+    }
+
+    else {
+        body->memory = NULL;
+        body->capacity = 0;
+    }
+
+    body->size = 0;
+
+    if(!reserve_body(body, hint < POOL_MIN_CAPACITY ? POOL_MIN_CAPACITY : hint)){
+        free(body->memory);
+        body->memory = NULL;
+        body->capacity = 0;
+        return false;
+    }
+
+    body->memory[0] = '\0';
+
+    return true;
+}
+
+
+//Returns body's buffer to this thread's pool, or frees it if the pool is full or the buffer is huge.
+void release_body(struct mem *body){
+
+    buffer_pool *pool = &thread_pool;
+
+    if(body->memory != NULL && pool->count < POOL_BUFFERS && body->capacity <= POOL_KEEP_MAX){
+        pool->memory[pool->count] = body->memory;
+        pool->capacity[pool->count] = body->capacity;
+        pool->count++;
+    }
+
+    else {
+        free(body->memory);
+    }
+
+    body->memory = NULL;
+    body->size = 0;
+    body->capacity = 0;
+}
+
+
+//Frees the calling thread's pooled buffers. Called by each fetching thread as it exits.
+void drain_buffer_pool(void){
+
+    buffer_pool *pool = &thread_pool;
+
+    while(pool->count > 0){
+        pool->count--;
+        free(pool->memory[pool->count]);
+    }
+}
+
+
+
+/*
+-----------------------------------------
+|          WARC content store           |
+-----------------------------------------
+With --warc=DIR every fetched page and robots.txt is kept as a WARC/1.1 response record
+(the HTTP status line and headers followed by the body) in DIR/crawl-NNNNN.warc.gz.
+Each record is a gzip member of its own, so a reader can seek straight to one record
+and inflate it alone; DIR/index.txt has one "URL file offset length" line per record.
+Files from earlier runs are kept, and the numbering continues after them.
+
+The workers never compress or write. archive_response() takes the response's buffers 
+over without copying them and links them onto the writer's queue; the writer thread
+compresses whole batches into a large buffer, writes it with big sequential write()s,
+and starts a new file once the current one reaches --warc-segment MB. If the writer
+falls more than WARC_QUEUE_MAX bytes behind, records are dropped and counted instead of
+making a worker wait. Sitemaps are parsed as they stream in and never buffered, so 
+they are not archived.
+*/
+
+#define WARC_QUEUE_MAX (256L * 1024 * 1024)   //Bytes of records waiting for the writer.
+#define WARC_OUT_BUFFER (4 * 1024 * 1024)     //Compressed bytes collected per write().
+
+typedef struct warc_record{
+    const char *url;         //Interned, so it outlives the record.
+    struct mem headers;      //Status line and headers of the final response, empty if none were captured.
+    struct mem body;
+    long status;
+    time_t fetched;
+    struct warc_record *next;
+} warc_record;
+
+
+static struct {
+    pthread_t writer;
+    pthread_mutex_t lock;            //Guards the queue and stopping.
+    pthread_cond_t wake;
+    warc_record *head, *tail;
+    size_t queued_bytes;
+    bool stopping;
+    atomic_bool running;
+
+    //Used by the writer thread only.
+    int fd;
+    int segment;
+    size_t offset;                   //Where the next record starts in the current file.
+    FILE *index;
+    z_stream zs;
+    char *out;                       //Compressed bytes not written yet.
+    size_t out_used;
+    uint64_t id_state;               //xorshift state for record ids.
+
+    atomic_long records;
+    atomic_long dropped;
+    atomic_llong raw_bytes;
+    atomic_llong stored_bytes;
+    int files;
+} warc = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .fd = -1 };
+
+
+//Writes out the compressed bytes collected so far.
+static bool flush_warc(void){
+
+    size_t done = 0;
+
+    while(done < warc.out_used){
+
+        ssize_t n = write(warc.fd, warc.out + done, warc.out_used - done);
+
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+
+        if(n <= 0){
+            log_event(errno, NULL, "Failed to write WARC file");
+            warc.out_used = 0;
+            return false;
+        }
+
+        done += n;
+    }
+
+    warc.out_used = 0;
+
+    return true;
+}
+
+
+//Compresses len bytes into the output buffer, writing the buffer out whenever it fills.
+static void deflate_warc(const char *data, size_t len, int flush){
+
+    warc.zs.next_in = (Bytef *) data;
+    warc.zs.avail_in = (uInt) len;
+
+    while(1){
+
+        if(warc.out_used == WARC_OUT_BUFFER){
+            flush_warc();
+        }
+
+        warc.zs.next_out = (Bytef *) warc.out + warc.out_used;
+        warc.zs.avail_out = (uInt) (WARC_OUT_BUFFER - warc.out_used);
+
+        int rc = deflate(&warc.zs, flush);
+
+        warc.out_used = WARC_OUT_BUFFER - warc.zs.avail_out;
+
+        //Done once the input is used up and, when finishing, the gzip trailer is out.
+        if(rc == Z_STREAM_END || rc == Z_STREAM_ERROR || (flush != Z_FINISH && warc.zs.avail_in == 0 && warc.zs.avail_out > 0)){
+            break;
+        }
+    }
+}
+
+
+//A random (version 4) UUID; it only has to be unique, not unpredictable.
+static void warc_record_id(char *id, size_t size){
+
+    uint64_t words[2];
+
+    for(int i = 0; i < 2; i++){
+        warc.id_state ^= warc.id_state >> 12;
+        warc.id_state ^= warc.id_state << 25;
+        warc.id_state ^= warc.id_state >> 27;
+        words[i] = warc.id_state * 0x2545F4914F6CDD1DULL;
+    }
+
+    snprintf(id, size, "urn:uuid:%08x-%04x-4%03x-%04x-%012llx",
+             (unsigned) (words[0] >> 32), (unsigned) ((words[0] >> 16) & 0xFFFF), (unsigned) (words[0] & 0xFFF),
+             (unsigned) (0x8000 | ((words[1] >> 48) & 0x3FFF)), (unsigned long long) (words[1] & 0xFFFFFFFFFFFFULL));
+}
+
+
+/*
+Compresses one WARC record, as its own gzip member, onto the end of the current file.
+
+@param const char *type: WARC-Type of the record.
+@param const char *url: WARC-Target-URI, or NULL for none.
+@param const char *parts[]: the record block in count pieces, written back to back.
+@return size_t: compressed length of the record.
+*/
+static size_t write_warc_record(const char *type, const char *url, time_t when, const char *content_type,
+                                const char **parts, const size_t *sizes, int count){
+
+    char id[64], date[32], head[URL_MAX + 512];
+    size_t block = 0;
+    struct tm tm;
+
+    for(int i = 0; i < count; i++){
+        block += sizes[i];
+    }
+
+    warc_record_id(id, sizeof(id));
+    gmtime_r(&when, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    int len = snprintf(head, sizeof(head), "WARC/1.1\r\nWARC-Type: %s\r\nWARC-Record-ID: <%s>\r\nWARC-Date: %s\r\n"
+                       "%s%s%sContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                       type, id, date, url ? "WARC-Target-URI: " : "", url ? url : "", url ? "\r\n" : "",
+                       content_type, block);
+
+    deflateReset(&warc.zs);
+    deflate_warc(head, (size_t) len, Z_NO_FLUSH);
+
+    for(int i = 0; i < count; i++){
+        deflate_warc(parts[i], sizes[i], Z_NO_FLUSH);
+    }
+
+    deflate_warc("\r\n\r\n", 4, Z_FINISH);
+
+    atomic_fetch_add(&warc.raw_bytes, (long long) (len + block + 4));
+    atomic_fetch_add(&warc.stored_bytes, (long long) warc.zs.total_out);
+
+    return warc.zs.total_out;
+}
+
+
+//Closes the current WARC file, if any, and opens the next one with its warcinfo record.
+static bool open_warc_segment(void){
+
+    char path[PATH_MAX];
+
+    if(warc.fd >= 0){
+        flush_warc();
+        close(warc.fd);
+        warc.segment++;
+    }
+
+    snprintf(path, sizeof(path), "%s/crawl-%05d.warc.gz", config.warc_dir, warc.segment);
+
+    warc.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if(warc.fd < 0){
+        log_event(errno, path, "Failed to open WARC file");
+        return false;
+    }
+
+    warc.offset = 0;
+    warc.files++;
+
+    char info[256];
+    int len = snprintf(info, sizeof(info), "software: %s\r\nformat: WARC File Format 1.1\r\n", USER_AGENT);
+    const char *parts[] = { info };
+    size_t sizes[] = { (size_t) len };
+
+    warc.offset += write_warc_record("warcinfo", NULL, time(NULL), "application/warc-fields", parts, sizes, 1);
+
+    return true;
+}
+
+
+//Writes one fetched response and its index line, moving to a new file when this one is full.
+static void store_warc_record(warc_record *record){
+
+    if(warc.fd >= 0 && warc.offset >= (size_t) config.warc_segment_mb * 1024 * 1024 && !open_warc_segment()){
+        return;
+    }
+
+    if(warc.fd < 0){
+        return;
+    }
+
+    //Without the real header block, at least say what the status was.
+    char status_line[64];
+    const char *parts[2];
+    size_t sizes[2];
+
+    if(record->headers.size > 0){
+        parts[0] = record->headers.memory;
+        sizes[0] = record->headers.size;
+    }
+
+    else {
+        sizes[0] = snprintf(status_line, sizeof(status_line), "HTTP/1.1 %ld\r\n\r\n", record->status);
+        parts[0] = status_line;
+    }
+
+    parts[1] = record->body.memory;
+    sizes[1] = record->body.size;
+
+    size_t offset = warc.offset;
+    size_t length = write_warc_record("response", record->url, record->fetched, "application/http;msgtype=response", parts, sizes, 2);
+
+    warc.offset += length;
+    atomic_fetch_add(&warc.records, 1);
+
+    if(warc.index != NULL){
+        fprintf(warc.index, "%s crawl-%05d.warc.gz %zu %zu\n", record->url, warc.segment, offset, length);
+    }
+}
+
+
+void free_warc_record(warc_record *record){
+
+    free(record->headers.memory);
+    free(record->body.memory);
+    free(record);
+}
+
+
+//Background writer: takes the whole queue at once and stores it outside the lock.
+void * run_warc_writer(void *arg){
+
+    while(1){
+
+        pthread_mutex_lock(&warc.lock);
+
+        while(warc.head == NULL && !warc.stopping){
+            pthread_cond_wait(&warc.wake, &warc.lock);
+        }
+
+        warc_record *batch = warc.head;
+        bool stopping = warc.stopping;
+
+        warc.head = warc.tail = NULL;
+        warc.queued_bytes = 0;
+
+        pthread_mutex_unlock(&warc.lock);
+
+        while(batch != NULL){
+            warc_record *next = batch->next;
+            store_warc_record(batch);
+            free_warc_record(batch);
+            batch = next;
+        }
+
+        if(warc.fd >= 0){
+            flush_warc();
+        }
+
+        if(stopping){
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+Creates the WARC directory and its first file and starts the writer thread.
+
+@return bool: false if the directory, file or index could not be opened.
+*/
+bool start_warc_writer(void){
+
+    char path[PATH_MAX];
+
+    if(mkdir(config.warc_dir, 0755) != 0 && errno != EEXIST){
+        log_event(errno, config.warc_dir, "Failed to create WARC directory");
+        return false;
+    }
+
+    //Gzip members, as every WARC reader expects from a .warc.gz.
+    if(deflateInit2(&warc.zs, 6, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+        append_to_log_file("Failed to initialize WARC compression.");
+        return false;
+    }
+
+    warc.out = (char *) malloc(WARC_OUT_BUFFER);
+    warc.id_state = ((uint64_t) time(NULL) << 20) ^ (uint64_t) getpid() ^ 0x9E3779B97F4A7C15ULL;
+
+    //Never overwrite an earlier run's files; a resumed crawl just carries on numbering them.
+    struct stat st;
+
+    while(1){
+
+        snprintf(path, sizeof(path), "%s/crawl-%05d.warc.gz", config.warc_dir, warc.segment);
+
+        if(stat(path, &st) != 0){
+            break;
+        }
+
+        warc.segment++;
+    }
+
+    snprintf(path, sizeof(path), "%s/index.txt", config.warc_dir);
+    warc.index = fopen(path, "a");
+
+    if(warc.out == NULL || warc.index == NULL){
+        log_event(errno, path, "Failed to open WARC index");
+        return false;
+    }
+
+    if(!open_warc_segment()){
+        return false;
+    }
+
+    if(pthread_create(&warc.writer, NULL, run_warc_writer, NULL) != 0){
+        append_to_log_file("Failed to start WARC writer.");
+        return false;
+    }
+
+    atomic_store(&warc.running, true);
+
+    return true;
+}
+
+
+/*
+Hands a finished response to the WARC writer. The body and header buffers move into 
+the record, leaving resp with empty ones for release_body() to skip.
+
+@param const frontier_item *item: what was fetched.
+@param response *resp: the response, after it has been processed.
+*/
+void archive_response(const frontier_item *item, response *resp){
+
+    if(!atomic_load_explicit(&warc.running, memory_order_relaxed) || resp->body.memory == NULL){
+        return;
+    }
+
+    size_t bytes = resp->body.size + resp->headers.size;
+    warc_record *record = (warc_record *) malloc(sizeof(warc_record));
+
+    if(record == NULL){
+        atomic_fetch_add(&warc.dropped, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&warc.lock);
+
+    if(warc.queued_bytes + bytes > WARC_QUEUE_MAX || warc.stopping){
+        pthread_mutex_unlock(&warc.lock);
+        free(record);
+        atomic_fetch_add(&warc.dropped, 1);
+        return;
+    }
+
+    record->url = item->url;
+    record->headers = resp->headers;
+    record->body = resp->body;
+    record->status = resp->status;
+    record->fetched = time(NULL);
+    record->next = NULL;
+
+    if(warc.tail != NULL){
+        warc.tail->next = record;
+    }
+
+    else {
+        warc.head = record;
+    }
+
+    warc.tail = record;
+    warc.queued_bytes += bytes;
+
+    pthread_cond_signal(&warc.wake);
+    pthread_mutex_unlock(&warc.lock);
+
+    resp->headers = (struct mem) {0};
+    resp->body = (struct mem) {0};
+}
+
+
+//Stores whatever is still queued, closes the files and prints what was archived. Safe to call twice.
+void stop_warc_writer(void){
+
+    if(!atomic_exchange(&warc.running, false)){
+        return;
+    }
+
+    pthread_mutex_lock(&warc.lock);
+    warc.stopping = true;
+    pthread_cond_signal(&warc.wake);
+    pthread_mutex_unlock(&warc.lock);
+
+    pthread_join(warc.writer, NULL);
+
+    if(warc.fd >= 0){
+        flush_warc();
+        close(warc.fd);
+        warc.fd = -1;
+    }
+
+    fclose(warc.index);
+    deflateEnd(&warc.zs);
+    free(warc.out);
+
+    long long raw = atomic_load(&warc.raw_bytes), stored = atomic_load(&warc.stored_bytes);
+
+    printf("WARC: %ld records, %.1f MB -> %.1f MB in %d file%s, %ld dropped\n",
+           atomic_load(&warc.records), raw / 1048576.0, stored / 1048576.0, warc.files, warc.files == 1 ? "" : "s",
+           atomic_load(&warc.dropped));
+}
+
+
+/*
+-----------------------------------------
+|           Validator cache             |
+-----------------------------------------
+With --validator-cache=FILE a recrawl asks servers for changes only. For every HTML 
+page that came back 200 the cache remembers, by URL fingerprint, the ETag and 
+Last-Modified headers, a hash of the body, the resolved links and the target matches.
+The next run sends those validators as If-None-Match / If-Modified-Since; a 304 then 
+costs no body and no parse, since the stored links are queued and the stored matches
+reported instead. When a server ignores validators but sends the same bytes again, the
+body hash still lets the fast and DOM parsers skip the page.
+
+FILE is read once with mmap and entries from it point into the mapping, so the old 
+cache costs page cache rather than heap. Entries replaced during the crawl are 
+malloc'd. The whole table is written to FILE.tmp and renamed over FILE when the crawl
+ends. Matches depend on the targets, so a cache made for a different target set is
+ignored.
+
+An entry is a validator_header followed by the ETag, the Last-Modified value, the 
+hits (pattern, offset pairs) and the NUL terminated links.
+*/
+
+#define VALIDATOR_MAGIC "CRAWLVC1"
+
+typedef struct validator_header{
+    uint64_t content_hash;
+    uint32_t hit_count;
+    uint32_t links_size;
+    uint16_t etag_length;
+    uint16_t modified_length;
+} validator_header;
+
+#define VALIDATOR_HIT_SIZE (sizeof(uint32_t) + sizeof(uint64_t))
+
+typedef struct validator_slot{
+    uint64_t fp;             //0 when empty.
+    char *entry;
+    uint32_t size;
+    bool owned;              //malloc'd here rather than part of the mapped file.
+} validator_slot;
+
+typedef struct validator_shard{
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    validator_slot *slots;
+    size_t capacity;         //Power of two.
+    size_t count;
+} validator_shard;
+
+
+static struct {
+    validator_shard shards[SEEN_SHARDS];
+    uint64_t signature;                  //Of the targets and matching options.
+    char *mapped;                        //FILE as it was when the crawl started.
+    size_t mapped_size;
+    atomic_bool enabled;
+
+    atomic_long not_modified;            //304s answered from the cache.
+    atomic_long unchanged;               //Same body again, parse skipped.
+    atomic_long stored;
+} validators;
+
+
+//Identifies the target set, so matches stored for other targets are never reported.
+uint64_t matcher_signature(void){
+
+    uint64_t h = hash_bytes(config.ignore_case ? "i" : "c", 1) ^ (config.whole_word ? 0x5555 : 0);
+
+    for(int i = 0; i < config.target_count; i++){
+        h = h * 0x9E3779B97F4A7C15ULL ^ hash_bytes(config.targets[i], strlen(config.targets[i]));
+    }
+
+    return h;
+}
+
+
+//The fingerprint's slot in its shard, empty if it is not there. Caller holds the shard lock.
+validator_slot * find_validator(validator_shard *shard, uint64_t fp){
+
+    size_t mask = shard->capacity - 1;
+    size_t pos = fp & mask;
+
+    while(shard->slots[pos].fp != 0 && shard->slots[pos].fp != fp){
+        pos = (pos + 1) & mask;
+    }
+
+    return &shard->slots[pos];
+}
+
+
+/*
+Stores entry as fp's cache entry, replacing and freeing an earlier malloc'd one.
+
+@param bool owned: entry was malloc'd and now belongs to the cache.
+*/
+void put_validator(uint64_t fp, char *entry, uint32_t size, bool owned){
+
+    validator_shard *shard = &validators.shards[fp >> 58];
+
+    pthread_mutex_lock(&shard->lock);
+
+    //Same growth rule as the seen-set shards.
+    if((shard->count + 1) * 10 > shard->capacity * 7){
+
+        size_t capacity = shard->capacity ? shard->capacity * 2 : 1024;
+        validator_slot *slots = (validator_slot *) calloc(capacity, sizeof(validator_slot));
+
+        if(slots != NULL){
+
+            validator_shard grown = { .slots = slots, .capacity = capacity };
+
+            for(size_t i = 0; i < shard->capacity; i++){
+                if(shard->slots[i].fp != 0){
+                    *find_validator(&grown, shard->slots[i].fp) = shard->slots[i];
+                }
+            }
+
+            free(shard->slots);
+            shard->slots = slots;
+            shard->capacity = capacity;
+        }
+    }
+
+    if(shard->capacity == 0 || (shard->count + 1) * 10 > shard->capacity * 9){
+        pthread_mutex_unlock(&shard->lock);
+        append_to_log_file("Memory allocation failed");
+        if(owned) free(entry);
+        return;
+    }
+
+    validator_slot *slot = find_validator(shard, fp);
+
+    if(slot->fp == 0){
+        shard->count++;
+    }
+
+    else if(slot->owned){
+        free(slot->entry);
+    }
+
+    *slot = (validator_slot) { fp, entry, size, owned };
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+/*
+Copies fp's cache entry out of the table, so it can be read without holding the lock.
+
+@return char*: the entry, to be freed by the caller, or NULL if there is none.
+*/
+char * copy_validator(uint64_t fp, uint32_t *size){
+
+    validator_shard *shard = &validators.shards[fp >> 58];
+    char *copy = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+
+    if(shard->capacity > 0){
+
+        validator_slot *slot = find_validator(shard, fp);
+
+        if(slot->fp == fp && (copy = (char *) malloc(slot->size)) != NULL){
+            memcpy(copy, slot->entry, slot->size);
+            *size = slot->size;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return copy;
+}
+
+
+/*
+Checks that an entry's parts add up to its size and that its links, which are read back
+with strlen(), end in a NUL. Entries come from disk, so neither is a given.
+*/
+bool validator_entry_ok(const char *entry, uint32_t size, validator_header *header){
+
+    if(size < sizeof(validator_header)){
+        return false;
+    }
+
+    memcpy(header, entry, sizeof(validator_header));
+
+    return (uint64_t) sizeof(validator_header) + header->etag_length + header->modified_length +
+           (uint64_t) header->hit_count * VALIDATOR_HIT_SIZE + header->links_size == size &&
+           (header->links_size == 0 || entry[size - 1] == '\0');
+}
+
+
+/*
+Maps FILE and indexes its entries. A missing file just means an empty cache.
+
+@return bool: false if the file exists but cannot be read.
+*/
+bool load_validator_cache(const char *path){
+
+    for(int i = 0; i < SEEN_SHARDS; i++){
+        pthread_mutex_init(&validators.shards[i].lock, NULL);
+    }
+
+    validators.signature = matcher_signature();
+    atomic_store(&validators.enabled, true);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if(fd < 0){
+        return errno == ENOENT;
+    }
+
+    if(fstat(fd, &st) != 0){
+        log_event(errno, path, "Failed to read validator cache");
+        close(fd);
+        return false;
+    }
+
+    //Too short for even the header: an empty cache, as a crash before the first save can leave it.
+    if(st.st_size < 16){
+        close(fd);
+        return true;
+    }
+
+    char *mapped = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(mapped == MAP_FAILED){
+        log_event(errno, path, "Failed to map validator cache");
+        return false;
+    }
+
+    uint64_t signature;
+    memcpy(&signature, mapped + 8, sizeof(signature));
+
+    if(memcmp(mapped, VALIDATOR_MAGIC, 8) != 0 || signature != validators.signature){
+        printf("Validator cache %s was made for other targets; every page is fetched in full.\n", path);
+        munmap(mapped, st.st_size);
+        return true;
+    }
+
+    validators.mapped = mapped;
+    validators.mapped_size = st.st_size;
+
+    size_t pos = 16;
+    long loaded = 0;
+
+    while(pos + 12 <= (size_t) st.st_size){
+
+        uint64_t fp;
+        uint32_t size;
+        validator_header header;
+
+        memcpy(&fp, mapped + pos, 8);
+        memcpy(&size, mapped + pos + 8, 4);
+        pos += 12;
+
+        if(fp == 0 || size > st.st_size - pos || !validator_entry_ok(mapped + pos, size, &header)){
+            log_event(0, path, "Validator cache is truncated or corrupt; ignoring the rest");
+            break;
+        }
+
+        put_validator(fp, mapped + pos, size, false);
+        pos += size;
+        loaded++;
+    }
+
+    printf("Validator cache: %ld pages from %s\n", loaded, path);
+
+    return true;
+}
+
+
+/*
+Turns on conditional fetching for a page: sets up resp->validators and, if an earlier
+run stored the page, the If-None-Match / If-Modified-Since headers setup_handle() sends.
+*/
+void prepare_validators(response *resp, const frontier_item *item){
+
+    resp->validators = (page_validators *) calloc(1, sizeof(page_validators));
+
+    if(resp->validators == NULL){
+        return;
+    }
+
+    uint32_t size;
+    char *entry = copy_validator(url_fingerprint(item->url), &size);
+    validator_header header;
+
+    if(entry == NULL){
+        return;
+    }
+
+    if(validator_entry_ok(entry, size, &header)){
+
+        char line[320];
+        const char *etag = entry + sizeof(validator_header);
+        const char *modified = etag + header.etag_length;
+
+        if(header.etag_length > 0){
+            snprintf(line, sizeof(line), "If-None-Match: %.*s", (int) header.etag_length, etag);
+            resp->validators->conditions = curl_slist_append(resp->validators->conditions, line);
+        }
+
+        if(header.modified_length > 0){
+            snprintf(line, sizeof(line), "If-Modified-Since: %.*s", (int) header.modified_length, modified);
+            resp->validators->conditions = curl_slist_append(resp->validators->conditions, line);
+        }
+    }
+
+    free(entry);
+}
+
+
+void free_validators(page_validators *page){
+
+    if(page == NULL){
+        return;
+    }
+
+    curl_slist_free_all(page->conditions);
+    free(page->links.memory);
+    free(page->hits.hits);
+    free(page);
+}
+
+
+//Keeps what this fetch of the page found, replacing what an earlier fetch stored.
+void store_validators(const frontier_item *item, page_validators *page, uint64_t content_hash){
+
+    validator_header header = {
+        .content_hash = content_hash,
+        .hit_count = (uint32_t) page->hits.count,
+        .links_size = (uint32_t) page->links.size,
+        .etag_length = (uint16_t) strlen(page->etag),
+        .modified_length = (uint16_t) strlen(page->last_modified),
+    };
+
+    size_t size = sizeof(header) + header.etag_length + header.modified_length + header.hit_count * VALIDATOR_HIT_SIZE + header.links_size;
+    char *entry = (char *) malloc(size);
+
+    if(entry == NULL || size > UINT32_MAX){
+        append_to_log_file("Memory allocation failed");
+        free(entry);
+        return;
+    }
+
+    char *p = entry;
+
+    memcpy(p, &header, sizeof(header));                     p += sizeof(header);
+    memcpy(p, page->etag, header.etag_length);              p += header.etag_length;
+    memcpy(p, page->last_modified, header.modified_length); p += header.modified_length;
+
+    for(size_t i = 0; i < page->hits.count; i++){
+
+        uint32_t pattern = (uint32_t) page->hits.hits[i].pattern;
+        uint64_t offset = page->hits.hits[i].offset;
+
+        memcpy(p, &pattern, 4);
+        memcpy(p + 4, &offset, 8);
+        p += VALIDATOR_HIT_SIZE;
+    }
+
+    if(header.links_size > 0){
+        memcpy(p, page->links.memory, header.links_size);
+    }
+
+    put_validator(url_fingerprint(item->url), entry, (uint32_t) size, true);
+    atomic_fetch_add(&validators.stored, 1);
+}
+
+
+/*
+Does for an unchanged page what parsing it would have done: reports the stored matches
+and queues the stored links one level deeper. While a page is being captured, both are
+also collected again, as parsing would have.
+
+@param uint64_t content_hash: only replay if the stored body hash is this; 0 for any.
+@return bool: false if there is no usable entry for the page.
+*/
+bool replay_validators(crawl_args *args, const frontier_item *item, uint64_t content_hash){
+
+    uint32_t size;
+    char *entry = copy_validator(url_fingerprint(item->url), &size);
+    validator_header header;
+
+    if(entry == NULL){
+        return false;
+    }
+
+    if(!validator_entry_ok(entry, size, &header) || (content_hash != 0 && header.content_hash != content_hash)){
+        free(entry);
+        return false;
+    }
+
+    const char *p = entry + sizeof(header) + header.etag_length + header.modified_length;
+    match_list hits = {0};
+
+    if(header.hit_count > 0 && (hits.hits = (match_hit *) malloc(header.hit_count * sizeof(match_hit))) != NULL){
+
+        for(uint32_t i = 0; i < header.hit_count; i++, p += VALIDATOR_HIT_SIZE){
+
+            uint32_t pattern;
+            uint64_t offset;
+
+            memcpy(&pattern, p, 4);
+            memcpy(&offset, p + 4, 8);
+
+            //Pattern indexes are only valid for the target set the signature was checked against.
+            if(pattern < (uint32_t) args->matcher->pattern_count){
+                hits.hits[hits.count].pattern = (int) pattern;
+                hits.hits[hits.count].offset = offset;
+                hits.count++;
+            }
+        }
+
+        record_match(args->output, args->matcher, item->url, &hits);
+        free(hits.hits);
+    }
+
+    else {
+        p += (size_t) header.hit_count * VALIDATOR_HIT_SIZE;
+    }
+
+    //Kept again when the page is stored with its new validators.
+    if(capturing_page != NULL){
+        append_bytes(&capturing_page->links, p, header.links_size);
+    }
+
+    //Queued in batches, like the links of a parsed page.
+    const char *batch[64];
+    int count = 0;
+    const char *end = p + header.links_size;
+
+    while(p < end){
+
+        batch[count++] = p;
+        p += strlen(p) + 1;
+
+        if(count == 64 || p >= end){
+            enqueue_batch(args->url_q, batch, count, item->depth + 1, ITEM_PAGE);
+            count = 0;
+        }
+    }
+
+    free(entry);
+
+    return true;
+}
+
+
+//Writes the cache to FILE.tmp and renames it over FILE. Safe to call twice; only the first call writes.
+void save_validator_cache(void){
+
+    if(!atomic_exchange(&validators.enabled, false)){
+        return;
+    }
+
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s.tmp", config.validator_cache);
+
+    FILE *file = fopen(temp, "w");
+
+    if(file == NULL){
+        log_event(errno, temp, "Failed to write validator cache");
+        return;
+    }
+
+    long written = 0;
+
+    fwrite(VALIDATOR_MAGIC, 1, 8, file);
+    fwrite(&validators.signature, sizeof(uint64_t), 1, file);
+
+    for(int i = 0; i < SEEN_SHARDS; i++){
+
+        validator_shard *shard = &validators.shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        for(size_t j = 0; j < shard->capacity; j++){
+
+            validator_slot *slot = &shard->slots[j];
+
+            if(slot->fp != 0){
+                fwrite(&slot->fp, sizeof(uint64_t), 1, file);
+                fwrite(&slot->size, sizeof(uint32_t), 1, file);
+                fwrite(slot->entry, 1, slot->size, file);
+                written++;
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+
+    if(fclose(file) != 0 || !ok || rename(temp, config.validator_cache) != 0){
+        log_event(errno, config.validator_cache, "Failed to write validator cache");
+        return;
+    }
+
+    printf("Validator cache: %ld not modified, %ld unchanged, %ld stored; %ld pages in %s\n",
+           atomic_load(&validators.not_modified), atomic_load(&validators.unchanged),
+           atomic_load(&validators.stored), written, config.validator_cache);
+}
+
+
+
+/*
+Whether a body of this Content-Type is worth downloading: HTML, XHTML and any XML, 
+which covers sitemaps, RSS and Atom. Sitemaps may also come as gzip or as a bare 
+octet-stream, since servers label .xml.gz files all sorts of ways.
+
+@param const char *value: the header value, not NUL terminated, possibly with parameters and CRLF.
+@param bool sitemap: the response is going to the sitemap parser.
+*/
+bool accepted_content_type(const char *value, size_t len, bool sitemap){
+
+    char type[128];
+    size_t n = 0;
+
+    while(len > 0 && (*value == ' ' || *value == '\t')){
+        value++;
+        len--;
+    }
+
+    //Media type only, lowercased, without "; charset=..." and the line ending.
+    while(n < len && n < sizeof(type) - 1 && value[n] != ';' && value[n] != ' ' && value[n] != '\r' && value[n] != '\n'){
+        type[n] = (char) tolower((unsigned char) value[n]);
+        n++;
+    }
+
+    type[n] = '\0';
+
+    //No type at all: let the parser decide.
+    if(n == 0){
+        return true;
+    }
+
+    if(strcmp(type, "text/html") == 0 || strcmp(type, "application/xhtml+xml") == 0 ||
+       strcmp(type, "text/xml") == 0 || strcmp(type, "application/xml") == 0 ||
+       (n > 4 && strcmp(type + n - 4, "+xml") == 0)){
+        return true;
+    }
+
+    return sitemap && (strcmp(type, "application/gzip") == 0 || strcmp(type, "application/x-gzip") == 0 ||
+                       strcmp(type, "application/octet-stream") == 0);
+}
+
+
+//Copies a header's value without the surrounding blanks and CRLF; values that do not fit are dropped.
+void copy_header_value(char *out, size_t size, const char *value, size_t len){
+
+    while(len > 0 && (*value == ' ' || *value == '\t')){
+        value++;
+        len--;
+    }
+
+    while(len > 0 && (value[len - 1] == '\r' || value[len - 1] == '\n' || value[len - 1] == ' ')){
+        len--;
+    }
+
+    if(len >= size){
+        len = 0;
+    }
+
+    memcpy(out, value, len);
+    out[len] = '\0';
+}
+
+
+/*
+Called by curl for every response header line. Content-Length tells us how big the 
+body will be, so the buffer is sized once instead of growing chunk by chunk. Only an
+empty body is resized; after a redirect the final response's length wins. A body that
+is not HTML or XML, or that says it is over --max-page-size, is refused here, before 
+a byte of it is downloaded. With the WARC store on, the lines are also collected, 
+starting over at each status line so only the final response's headers are kept.
+*/
+size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata){
+
+    size_t len = size * nitems;
+    response *resp = (response *) userdata;
+
+    //The status of the response these headers belong to; curl's own is only known at the end.
+    if(len > 9 && strncmp(buffer, "HTTP/", 5) == 0){
+
+        const char *code = memchr(buffer, ' ', len);
+
+        resp->status = code ? strtol(code + 1, NULL, 10) : 0;
+    }
+
+    //Returning anything but len makes curl abort the transfer before the body.
+    if(len > 13 && strncasecmp(buffer, "Content-Type:", 13) == 0 && !resp->robots &&
+       (resp->status < 300 || resp->status >= 400) && !accepted_content_type(buffer + 13, len - 13, resp->sitemap != NULL)){
+        resp->rejected = "Content-Type is not HTML or XML, transfer aborted";
+        return 0;
+    }
+
+    if(len > 15 && strncasecmp(buffer, "Content-Length:", 15) == 0 && config.max_page_size > 0 && resp->sitemap == NULL &&
+       strtoll(buffer + 15, NULL, 10) > config.max_page_size){
+        resp->rejected = "Content-Length over --max-page-size, transfer aborted";
+        return 0;
+    }
+
+    /*
+    curl hands us the body decoded, so the headers describing the transfer encoding
+    would not match what the WARC record holds; the record's own length replaces them.
+    */
+    if(config.warc_dir != NULL && resp->sitemap == NULL){
+
+        if(len > 5 && strncmp(buffer, "HTTP/", 5) == 0){
+            resp->headers.size = 0;
+        }
+
+        bool transfer_header = (len > 17 && strncasecmp(buffer, "Content-Encoding:", 17) == 0) ||
+                               (len > 18 && strncasecmp(buffer, "Transfer-Encoding:", 18) == 0) ||
+                               (len > 15 && strncasecmp(buffer, "Content-Length:", 15) == 0);
+
+        if(!transfer_header && !append_bytes(&resp->headers, buffer, len)){
+            return 0;
+        }
+    }
+
+    if(resp->validators != NULL){
+
+        page_validators *page = resp->validators;
+
+        if(len > 5 && strncmp(buffer, "HTTP/", 5) == 0){
+            page->etag[0] = page->last_modified[0] = '\0';
+        }
+
+        else if(len > 5 && strncasecmp(buffer, "ETag:", 5) == 0){
+            copy_header_value(page->etag, sizeof(page->etag), buffer + 5, len - 5);
+        }
+
+        else if(len > 14 && strncasecmp(buffer, "Last-Modified:", 14) == 0){
+            copy_header_value(page->last_modified, sizeof(page->last_modified), buffer + 14, len - 14);
+        }
+    }
+
+    if(len > 15 && strncasecmp(buffer, "Content-Length:", 15) == 0 && resp->body.size == 0 && resp->sitemap == NULL){
+
+        char value[32];
+        size_t n = len - 15 < sizeof(value) - 1 ? len - 15 : sizeof(value) - 1;
+
+        memcpy(value, buffer + 15, n);
+        value[n] = '\0';
+
+        long declared = strtol(value, NULL, 10);
+
+        if(declared > 0 && declared <= CONTENT_LENGTH_HINT_MAX){
+            reserve_body(&resp->body, (size_t) declared);
+        }
+    }
+
+    return len;
+}
+
+
+
+/*
+Prepares a response for url. Sitemaps always get a streaming sitemap parser, and in
+stream mode HTML pages get a push parser as well. 
+
+@param const frontier_item *item: what is being fetched; links found while streaming are queued one level deeper.
+@return bool: false if the body buffer could not be allocated.
+*/
+bool init_response(response *resp, struct crawl_args *args, const frontier_item *item){
+
+    resp->status = 0;
+    resp->parser = NULL;
+    resp->sitemap = NULL;
+    resp->headers = (struct mem) {0};
+    resp->validators = NULL;
+    resp->simhash = NULL;
+    resp->robots = (item->kind == ITEM_ROBOTS);
+    resp->rejected = NULL;
+    resp->parse_us = 0;
+    resp->started_us = metrics.enabled ? monotonic_us() : 0;
+    resp->resolve = NULL;
+
+    //A name known not to exist fails here, before anything is allocated or sent.
+    if(dns.enabled){
+
+        char key[512];
+        host_key(item->url, key, sizeof(key));
+
+        if(!dns_prepare(key, &resp->resolve)){
+            log_event(CURLE_COULDNT_RESOLVE_HOST, item->url, "Host name does not exist (cached lookup)");
+            count_metric(COUNT_ERRORS, 1);
+            return false;
+        }
+    }
+
+    //Pooled; header_callback() grows it to the Content-Length once that is known.
+    if(!acquire_body(&resp->body, 0)){
+        curl_slist_free_all(resp->resolve);
+        resp->resolve = NULL;
+        return false;
+    }
+
+    if(item->kind == ITEM_SITEMAP || (item->kind == ITEM_PAGE && check_ifXML(item->url))){
+        resp->sitemap = create_sitemap_parser(args->url_q, item->url, item->depth);
+    }
+
+    //With --parse-workers the fetch thread only downloads; see submit_page().
+    resp->deferred = (config.parse_workers > 0 && item->kind == ITEM_PAGE && resp->sitemap == NULL);
+
+    if(config.parser == PARSER_STREAM && item->kind == ITEM_PAGE && resp->sitemap == NULL && !resp->deferred){
+        resp->parser = create_stream_parser(args, item->url, item->depth);
+    }
+
+    if(resp->sitemap == NULL && item->kind == ITEM_PAGE && atomic_load_explicit(&validators.enabled, memory_order_relaxed)){
+        prepare_validators(resp, item);
+    }
+
+    if(resp->sitemap == NULL && item->kind == ITEM_PAGE && config.near_duplicate_bits >= 0){
+        resp->simhash = (simhash_state *) calloc(1, sizeof(simhash_state));
+    }
+
+    return true;
+}
+
+
+void free_response(response *resp){
+
+    if(resp->parser){
+        free_stream_parser(resp->parser);
+        resp->parser = NULL;
+    }
+
+    if(resp->sitemap){
+        free_sitemap_parser(resp->sitemap);
+        resp->sitemap = NULL;
+    }
+
+    free(resp->headers.memory);
+    resp->headers = (struct mem) {0};
+
+    free_validators(resp->validators);
+    resp->validators = NULL;
+
+    free(resp->simhash);
+    resp->simhash = NULL;
+
+    curl_slist_free_all(resp->resolve);
+    resp->resolve = NULL;
+
+    release_body(&resp->body);
+}
+
+
+int write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+
+    size_t real_size = size * nmemb;
+    response *resp = (response *)userdata;
+    struct mem *memory_ = &resp->body;
+
+    if(resp->sitemap){
+        return sitemap_feed(resp->sitemap, ptr, real_size) ? real_size : 0;
+    }
+
+    //Servers that send no Content-Length, or a wrong one, are caught here.
+    if(config.max_page_size > 0 && memory_->size + real_size > (size_t) config.max_page_size){
+        resp->rejected = "Body over --max-page-size, transfer aborted";
+        return 0;
+    }
+
+    if(!reserve_body(memory_, memory_->size + real_size)){
+        return 0;
+    }
+
+    memcpy(&(memory_->memory[memory_->size]), ptr, real_size);
+    memory_->size += real_size;
+    //memory_->memory[memory_->size] = 0;
+
+    memory_->memory[memory_->size] = '\0';
+
+    if(resp->simhash && !resp->deferred){
+        simhash_feed(resp->simhash, ptr, real_size);
+    }
+
+    //Parse the chunk now rather than after the whole page has arrived.
+    if(resp->parser){
+
+        long started = metrics.enabled ? monotonic_us() : 0;
+
+        capturing_page = resp->validators;
+        htmlParseChunk(resp->parser->ctxt, ptr, (int) real_size, 0);
+        capturing_page = NULL;
+
+        if(metrics.enabled){
+            resp->parse_us += monotonic_us() - started;
+        }
+    }
+
+    return real_size;
+}
+
+
+
+void Parse_JSON(const char *json_data){
+
+    //Create CSJON obj
+    //cJSON *json_parsed = cJSON_Parse(json_data);
+
+    cJSON *json_parsed = cJSON_Parse(json_data);
+
+    char *parsed_string = cJSON_Print(json_parsed);
+    
+    //printf("%s", parsed_string);
+
+    
+    return;
+}
+
+
+
+/*
+One CURLSH object is shared by every handler in the crawler, so the DNS cache, the 
+connection pool and TLS sessions survive from one page to the next and across workers.
+A page on a host we have already talked to then skips the lookup, the TCP handshake 
+and most of the TLS handshake. curl does not lock shared data itself; it calls 
+share_lock()/share_unlock() with the kind of data it is about to touch, and we keep one
+mutex per kind so DNS lookups do not wait on connection pool access.
+*/
+static CURLSH *share_handle = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+
+void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr){
+
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+
+void share_unlock(CURL *handle, curl_lock_data data, void *userptr){
+
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+
+//Creates the shared cache object. Must be called once before any handler is created.
+bool init_share(void){
+
+    for(int i = 0; i < CURL_LOCK_DATA_LAST; i++){
+        pthread_mutex_init(&share_locks[i], NULL);
+    }
+
+    share_handle = curl_share_init();
+
+    if(share_handle == NULL){
+        append_to_log_file("Failed to create curl share object");
+        return false;
+    }
+
+    curl_share_setopt(share_handle, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share_handle, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    return true;
+}
+
+
+void cleanup_share(void){
+
+    if(share_handle){
+        curl_share_cleanup(share_handle);
+        share_handle = NULL;
+    }
+}
+
+
+
+/*
+Creates a handler with the options that do not change from one request to the next. 
+Workers keep their handler for the whole crawl and only call setup_handle() per page,
+so keep-alive connections, the share object and HTTP/2 negotiation carry over. 
+
+@return CURL*: the new handler, NULL on failure.
+*/
+CURL* create_handle(void){
+
+    CURL *curl_handler = curl_easy_init();
+
+    if(curl_handler == NULL){
+        append_to_log_file("Failed to create curl handler");
+        return NULL;
+    }
+
+    curl_easy_setopt(curl_handler, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl_handler, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(curl_handler, CURLOPT_USERAGENT, USER_AGENT); //Additional information for server requests
+    curl_easy_setopt(curl_handler, CURLOPT_HEADER, 0);
+    curl_easy_setopt(curl_handler, CURLOPT_NOSIGNAL, 1L); //Required when curl is used from several threads.
+
+    //Every encoding this libcurl can decode (gzip, and br or zstd when built with them); bodies arrive decoded.
+    curl_easy_setopt(curl_handler, CURLOPT_ACCEPT_ENCODING, "");
+
+    //Reuse connections: shared caches, TCP keep-alive probes and HTTP/2 (multiplexed when the server allows it).
+    if(share_handle){
+        curl_easy_setopt(curl_handler, CURLOPT_SHARE, share_handle);
+    }
+    curl_easy_setopt(curl_handler, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl_handler, CURLOPT_TCP_KEEPIDLE, 60L);
+    curl_easy_setopt(curl_handler, CURLOPT_TCP_KEEPINTVL, 30L);
+    curl_easy_setopt(curl_handler, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+
+    return curl_handler;
+}
+
+
+
+/*
+Points a handler at the next page. Only the per-request options are set here; 
+everything else was set once by create_handle(). 
+
+@param CURL *curl_handler: handler to configure.
+@param char *url: page to request.
+@param response *userdata: filled by the write callback, see init_response().
+*/
+void setup_handle(CURL *curl_handler, const char *url, response *userdata){
+
+    curl_easy_setopt(curl_handler, CURLOPT_URL, url);
+    curl_easy_setopt(curl_handler, CURLOPT_WRITEDATA, userdata); // Pass userdata to write callback
+    curl_easy_setopt(curl_handler, CURLOPT_HEADERDATA, userdata);
+
+    //Always set, so a reused handler does not send the previous page's validators.
+    curl_easy_setopt(curl_handler, CURLOPT_HTTPHEADER, userdata->validators ? userdata->validators->conditions : NULL);
+
+    //Likewise, so a reused handler does not pin the previous page's address. See dns_prepare().
+    curl_easy_setopt(curl_handler, CURLOPT_RESOLVE, userdata->resolve);
+}
+
+
+
+/*
+The open_url() function takes a string url as input and creates an http
+request to the respective page using libcurl. 
+
+@param CURL *curl_handler: the calling worker's handler, created by create_handle() and reused for every page.
+@param char *url: pointer to string, the unique resource identifier of the target page. 
+@param response *userdata: prepared by init_response(); receives the body.
+@return bool: false if the transfer failed.
+*/
+bool open_url(CURL *curl_handler, const char *url, response *userdata){
+
+    if(curl_handler == NULL){
+        return false;
+    }
+
+    /*
+    In libcurl a variety of options exist to modify the behaviour of the curl handler. 
+    These options are initialized using curl_set_opt(curl handler, option, option_parameter).
+    
+    What do we want the curl handler to do?
+        -> We want it to establish connection with a web page 
+        
+        -> Retrieve HTML data 
+
+    We must open the url before transferring the data. 
+    */
+    setup_handle(curl_handler, url, userdata);
+
+
+    //Execute the behaviour (data transfer) attributed to curl_handler.
+    CURLcode flag = curl_easy_perform(curl_handler);
+
+    if (flag != CURLE_OK) {
+        log_event(flag, url, userdata->rejected ? userdata->rejected : curl_easy_strerror(flag));
+        record_transfer(curl_handler, flag, 0, userdata->rejected != NULL);
+        return false;
+    }
+
+    curl_easy_getinfo(curl_handler, CURLINFO_RESPONSE_CODE, &userdata->status);
+    record_transfer(curl_handler, flag, userdata->status, false);
+
+    //Data is now preserved in data struct
+    //printf("%s", userdata->body.memory); 
+
+    return true; 
+}
+
+
+ 
+struct URLQueueNode* create_URLQueueNode(char *url){
+  
+    struct URLQueueNode *newNode = (struct URLQueueNode *) malloc(sizeof(struct URLQueueNode));
+
+    if (newNode == NULL) {
+
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    
+    newNode -> html_url = intern_url(url, strlen(url), url_fingerprint(url)); 
+
+    if(newNode->html_url == URL_NONE) {
+
+        printf("Memory allocation failed.\n");
+        free(newNode); // Free previously allocated memory
+        return NULL;
+    }
+
+    newNode -> depth = 0;
+    newNode -> host = NULL;
+    newNode -> next_URL = NULL;
+
+    return newNode;
+}
+
+
+
+// Initialize a URL queue.
+bool initQueue(URLQueue *URLS){
+
+    size_t capacity = 2;
+
+    while(capacity < (size_t) config.queue_size){
+        capacity <<= 1;
+    }
+
+    URLS -> slots = (URLQueueSlot *) malloc(capacity * sizeof(URLQueueSlot));
+
+    if(URLS -> slots == NULL){
+        append_to_log_file("Memory allocation failed");
+        return false;
+    }
+
+    for(size_t i = 0; i < capacity; i++){
+        atomic_init(&URLS->slots[i].sequence, i);
+        URLS->slots[i].html_url = URL_NONE;
+        URLS->slots[i].depth = 0;
+        URLS->slots[i].host = NULL;
+    }
+
+    URLS -> mask = capacity - 1;
+    atomic_init(&URLS->enqueue_pos, 0);
+    atomic_init(&URLS->dequeue_pos, 0);
+    atomic_init(&URLS->outstanding, 0);
+    atomic_init(&URLS->overflow_count, 0);
+    atomic_init(&URLS->idle_workers, 0);
+    atomic_init(&URLS->finished, false);
+    atomic_init(&URLS->pausing, false);
+    atomic_init(&URLS->workers, 0);
+    atomic_init(&URLS->parsing, 0);
+
+    URLS -> head = NULL;
+    URLS -> tail = NULL;
+
+    URLS -> max_depth = config.depth_limit;
+    URLS -> bfs_barrier = config.bfs_barrier;
+    URLS -> level = 0;
+    atomic_init(&URLS->level_outstanding, 0);
+    URLS -> next_head = NULL;
+    URLS -> next_tail = NULL;
+    URLS -> next_count = 0;
+
+    pthread_mutex_init(&URLS->lock, NULL);
+    pthread_cond_init(&URLS->wake, NULL);
+
+    if(!init_seen_set(&URLS->seen, config.seen_backend) || !init_host_table(&URLS->hosts) || !init_frontier_spill(&URLS->spill)){
+        return false;
+    }
+
+    if(pthread_create(&URLS->hosts.timer, NULL, run_host_timer, URLS) != 0){
+        append_to_log_file("Failed to start host timer");
+        return false;
+    }
+
+    return true;
+}
+
+bool initData(struct data_list *output_q){
+    output_q -> head = NULL;
+    output_q -> tail = NULL;
+
+    pthread_mutex_init(&output_q->lock, NULL);
+
+    return init_seen_set(&output_q->seen, SEEN_EXACT);
+}
+
+
+/*
+Some websites do not support www.website.com/sitemap.xml. 
+Therefore, our other attempt to retrieve the sitemap will consist
+of analyzing and parsing the robot.txt file.
+The robots.txt file should give us the sitemaps, if any. 
+It is possible for there to be more than one sitemap url; each one is 
+queued as a sitemap item and streamed through sitemap_feed(). 
+*/
+typedef struct robots_sitemap_ctx{
+    URLQueue *URLS;
+    const char *base;        //The host, which relative sitemap URLs are resolved against.
+} robots_sitemap_ctx;
+
+
+static void queue_robots_sitemap(const char *url, void *ctx){
+
+    robots_sitemap_ctx *where = (robots_sitemap_ctx *) ctx;
+    char resolved[URL_MAX];
+
+    if(config.follow_sitemaps && resolve_url(where->base, url, strlen(url), resolved, sizeof(resolved)) > 0){
+        enqueue_item(where->URLS, resolved, 0, ITEM_SITEMAP);
+    }
+}
+
+
+/*
+Installs a host's freshly fetched robots.txt and lets the URLs that were waiting for
+it through, or drops the ones it disallows. Called for every robots.txt item, fetched
+or not: a missing file (4xx) allows everything, while a server error or no answer at
+all disallows everything until the TTL runs out, as RFC 9309 asks.
+
+@param const char *body: the file, or NULL if the fetch failed.
+@param long status: HTTP status of the response.
+*/
+void robots_loaded(URLQueue *URLS, host_entry *h, const char *body, long status){
+
+    robots_rules *rules = NULL;
+
+    if(body != NULL && status >= 200 && status < 300){
+        robots_sitemap_ctx ctx = { URLS, h->name };
+        rules = parse_robots(body, queue_robots_sitemap, &ctx);
+    }
+
+    else if(body != NULL && status >= 400 && status < 500){
+        rules = create_robots_rules();
+    }
+
+    else if((rules = create_robots_rules()) != NULL){
+        robots_add_rule(rules, "/", 1, -1);
+    }
+
+    pthread_mutex_lock(&h->lock);
+
+    robots_rules *old = h->robots;
+    URLQueueNode *waiting = h->robots_wait_head;
+
+    //Out of memory: keep what we had, or allow everything rather than stall the host.
+    if(rules != NULL){
+        h->robots = rules;
+    }
+
+    h->robots_state = ROBOTS_READY;
+    h->robots_expires_ms = monotonic_ms() + config.robots_ttl * 1000L;
+    h->robots_wait_head = h->robots_wait_tail = NULL;
+
+    pthread_mutex_unlock(&h->lock);
+
+    if(rules != NULL){
+        free_robots_rules(old);
+    }
+
+    while(waiting != NULL){
+
+        URLQueueNode *next = waiting->next_URL;
+
+        if(!host_enqueue(URLS, waiting)){
+            drop_node(URLS, waiting);
+        }
+
+        waiting = next;
+    }
+}
+
+
+/*
+Called instead of process_page() when an item could not be fetched. Pages are just 
+lost, but a host's URLs are waiting on its robots.txt whatever became of it.
+*/
+void fetch_failed(crawl_args *args, const frontier_item *item){
+
+    if(item->kind == ITEM_ROBOTS && item->host != NULL){
+        robots_loaded(args->url_q, item->host, NULL, 0);
+    }
+}
+
+
+char* getTextInsideElements(TidyDoc doc, TidyNode node, char *elementName) {
+
+    TidyNode child;
+
+    char *target = "window.__PRELOADED_STATE__ =";
+
+    for (child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+        
+        ctmbstr name = tidyNodeGetName(child);
+        
+        if(name){
+            // Check if the node matches the specified element name
+            if (strcmp(name, elementName) == 0) {
+                TidyBuffer buf;
+                tidyBufInit(&buf);
+                tidyNodeGetText(doc, child, &buf);
+                //printf("Text inside <%s>: %s\n", elementName, buf.bp);
+
+                char* foundit = strstr(buf.bp, target);
+
+                if(foundit != NULL){
+                    //printf("Found it! \n%s", foundit); 
+                    
+                    char *json = strstr(foundit, "{");
+                    //printf("%s", json);
+                    //Call parseJSON
+                    //Parse_JSON(json);
+
+                    tidyBufFree(&buf);
+                    return json;
+                }
+
+                ///printf("Didnt find it. ");
+
+                tidyBufFree(&buf);
+            }
+        }
+
+        //Recursively search for the specified elements in child nodes
+        getTextInsideElements(doc, child, elementName);
+        
+    }
+}
+
+
+void printAnchorHrefs(TidyDoc tdoc) {
+    TidyNode anchor = tidyGetBody(tdoc);  // Start with the body tag
+    anchor = tidyGetChild(anchor);        // Get the first child of the body
+
+    while (anchor) {
+        TidyAttr attr;
+        if (tidyNodeGetId(anchor) == TidyTag_A) {  // Check if the node is an <a> tag
+            attr = tidyAttrFirst(anchor);
+            while (attr) {
+                if (tidyAttrGetId(attr) == TidyAttr_HREF) {  // Check if the attribute is 'href'
+                    //printf("Found href: %s\n", tidyAttrValue(attr));
+                    break;
+                }
+                attr = tidyAttrNext(attr);
+            }
+        }
+        anchor = tidyGetNext(anchor);  // Get next sibling node
+    }
+}
+
+
+
+void crawlElements(xmlNode *node, match_stream *ms){
+
+
+    xmlNode *cur = NULL;
+    for (cur = node; cur; cur = cur->next) {
+        if (cur->type == XML_ELEMENT_NODE) {
+            //printf("Element: <%s>\n", cur->name);
+
+            // If the element has children, recursively traverse them
+            if (cur->children) {
+                crawlElements(cur->children, ms);
+            }
+
+            //printf("End Element: <%s>\n", cur->name); // Print end tag
+        } 
+        
+        else if (cur->type == XML_TEXT_NODE && cur->content) {
+            
+            //printf("Loc has <%s>: %s\n", node->parent->name, cur->content);
+            match_stream_feed(ms, (const char *) cur->content, strlen((const char *) cur->content));
+            match_stream_break(ms);
+        }
+    }
+
+    
+}
+
+
+
+void parseHTMLElements(struct URLQueue *url_q, struct data_list *output, const char *html, const ac_automaton *matcher, const char *url){
+
+     
+    htmlDocPtr doc = NULL;
+    xmlNode *root = NULL;
+
+    // Parse the HTML content from the string
+    doc = htmlReadMemory(html, strlen(html), NULL, NULL, HTML_PARSE_NOWARNING | HTML_PARSE_NOERROR);
+
+    if (doc == NULL) {
+        append_to_log_file("Failed to parse document");
+        return;
+    }
+
+    // Get the root element of the HTML document
+    root = xmlDocGetRootElement((xmlDoc *)doc);
+    if (root == NULL) {
+        append_to_log_file("Empty document");
+        xmlFreeDoc((xmlDoc *)doc);
+        return;
+    }
+
+    //Start traversing the HTML tree
+    match_list hits = {0};
+    match_stream ms;
+
+    if(init_match_stream(&ms, matcher, &hits)){
+        crawlElements(root, &ms);
+        free_match_stream(&ms);
+        record_match(output, matcher, url, &hits);
+        free_match_list(&hits);
+    }
+
+    // Cleanup
+    xmlFreeDoc((xmlDoc *)doc);
+
+    return;
+}
+
+
+
+
+//printing the href attributes, resolved against base, the page's URL
+bool parseHTML(struct URLQueue *url_q, const char *html_content, const char *base, int depth){
+
+    //Reads the HTML content, htmlReadDoc - converts the HTML string to xmlDoc pointer 
+    htmlDocPtr doc = htmlReadDoc((xmlChar*)html_content, NULL, NULL, HTML_PARSE_NOWARNING | HTML_PARSE_NOERROR); //giving warning and error reports 
+    if (!doc){
+        append_to_log_file("Failed to parse the document");
+    }
+
+    //for the parsed XML document 
+    xmlXPathContextPtr context = xmlXPathNewContext(doc);
+    if(!context){
+        append_to_log_file("Failed to create XPath context");
+        xmlFreeDoc(doc);
+    }
+
+    //Evaluate XPath expression to find all <a> elements with an href attribute
+    xmlXPathObjectPtr result = xmlXPathEvalExpression((xmlChar*)"//a[@href]", context);
+    if (!result){
+        append_to_log_file("Failed to evaluate XPath expression");
+        xmlXPathFreeContext(context);
+        xmlFreeDoc(doc);
+    }
+    //checking if the node set is empty 
+    if(xmlXPathNodeSetIsEmpty(result->nodesetval)){
+        printf("");
+        return false;
+    }
+
+
+    else{
+
+        //representing a set of nodes in a document 
+        xmlNodeSetPtr nodes = result->nodesetval; //referencing to access the node set from the result of the XPath evaluation.
+        for(int i = 0; i < nodes -> nodeNr; i++){ //accessing each node
+
+            xmlNodePtr node = nodes->nodeTab[i];
+            xmlChar *href = xmlGetProp(node, (xmlChar *)"href"); //Retreving the href attribute 
+
+            if(href){
+
+                //printf("herf: %s\n", href);
+                //printf("Enqueing URL: %s", href);
+                enqueue_link(url_q, base, (const char *) href, xmlStrlen(href), depth + 1);
+                xmlFree(href);
+            }
+
+        }
+    }
+       
+    xmlXPathFreeObject(result);
+    xmlXPathFreeContext(context);
+    xmlFreeDoc(doc);
+
+    return true; 
+}
+
+
+
+/*
+-----------------------------------------
+|       Fast-path link extractor        |
+-----------------------------------------
+Link discovery does not need a conforming HTML tree. scan_html() walks the raw body
+once, jumping from one '<' to the next with SIMD compares (AVX2 when the CPU has it,
+SSE2 otherwise, memchr() off x86), and inside ordinary tags jumps straight to the 
+closing '>' while stepping over quoted attribute values. Only <a> tags get their 
+attributes parsed. Hrefs and text runs are reported as spans into the body, so
+nothing is allocated; hrefs with character references are decoded into a stack
+buffer first. Selected with --parser=fast; libxml2 stays available for strict parsing.
+*/
+
+typedef struct html_scan_handler{
+    void (*href)(const char *href, size_t len, void *ctx);   //Value of every <a href>, entities decoded.
+    void (*text)(const char *text, size_t len, void *ctx);   //Raw text between tags, including script bodies.
+} html_scan_handler;
+
+
+//Finds the next '<' in [p, end), or returns end.
+static const char *(*find_tag_open)(const char *p, const char *end);
+
+//Finds the next '>', '"' or '\'' in [p, end), or returns end.
+static const char *(*find_tag_special)(const char *p, const char *end);
+
+
+static const char *find_tag_open_scalar(const char *p, const char *end){
+
+    const char *hit = memchr(p, '<', end - p);
+
+    return hit ? hit : end;
+}
+
+
+static const char *find_tag_special_scalar(const char *p, const char *end){
+
+    while(p < end && *p != '>' && *p != '"' && *p != '\''){
+        p++;
+    }
+
+    return p;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static const char *find_tag_open_sse2(const char *p, const char *end){
+
+    const __m128i lt = _mm_set1_epi8('<');
+
+    while(end - p >= 16){
+
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), lt));
+
+        if(mask){
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return find_tag_open_scalar(p, end);
+}
+
+
+static const char *find_tag_special_sse2(const char *p, const char *end){
+
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i dq = _mm_set1_epi8('"');
+    const __m128i sq = _mm_set1_epi8('\'');
+
+    while(end - p >= 16){
+
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, sq)));
+        int mask = _mm_movemask_epi8(hits);
+
+        if(mask){
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return find_tag_special_scalar(p, end);
+}
+
+
+//Two 32-byte vectors per iteration; text between tags is usually longer than one.
+__attribute__((target("avx2")))
+static const char *find_tag_open_avx2(const char *p, const char *end){
+
+    const __m256i lt = _mm256_set1_epi8('<');
+
+    while(end - p >= 64){
+
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), lt);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 32)), lt);
+        uint64_t mask = (uint32_t) _mm256_movemask_epi8(a) | ((uint64_t) (uint32_t) _mm256_movemask_epi8(b) << 32);
+
+        if(mask){
+            return p + __builtin_ctzll(mask);
+        }
+
+        p += 64;
+    }
+
+    return find_tag_open_sse2(p, end);
+}
+
+
+__attribute__((target("avx2")))
+static const char *find_tag_special_avx2(const char *p, const char *end){
+
+    const __m256i gt = _mm256_set1_epi8('>');
+    const __m256i dq = _mm256_set1_epi8('"');
+    const __m256i sq = _mm256_set1_epi8('\'');
+
+    while(end - p >= 32){
+
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(v, gt), _mm256_or_si256(_mm256_cmpeq_epi8(v, dq), _mm256_cmpeq_epi8(v, sq)));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(hits);
+
+        if(mask){
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return find_tag_special_sse2(p, end);
+}
+
+#endif
+
+
+//Picks the widest scanner the CPU supports. Called once from main() before any thread starts.
+void init_link_scanner(void){
+
+    find_tag_open = find_tag_open_scalar;
+    find_tag_special = find_tag_special_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2")){
+        find_tag_open = find_tag_open_avx2;
+        find_tag_special = find_tag_special_avx2;
+    }
+
+    else if(__builtin_cpu_supports("sse2")){
+        find_tag_open = find_tag_open_sse2;
+        find_tag_special = find_tag_special_sse2;
+    }
+#endif
+}
+
+
+static bool is_html_space(char c){
+
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+
+//Case-insensitive compare of [p, end) against a lower-case literal prefix.
+static bool starts_with_ci(const char *p, const char *end, const char *lower){
+
+    for(; *lower; p++, lower++){
+        if(p >= end || (*p | 0x20) != *lower){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+Decodes the character references in an attribute value (&amp; &lt; &gt; &quot; &apos;
+and numeric ones) into dst, writing numeric ones above 0x7F as UTF-8. Unknown
+references are copied as they are. 
+
+@return size_t: decoded length, or 0 if it did not fit in cap bytes.
+*/
+size_t decode_entities(const char *src, size_t len, char *dst, size_t cap){
+
+    static const struct { const char *name; char c; } named[] = {
+        {"amp;", '&'}, {"lt;", '<'}, {"gt;", '>'}, {"quot;", '"'}, {"apos;", '\''}
+    };
+
+    const char *end = src + len;
+    size_t out = 0;
+
+    while(src < end){
+
+        if(out + 4 >= cap){
+            return 0;
+        }
+
+        if(*src != '&'){
+            dst[out++] = *src++;
+            continue;
+        }
+
+        const char *p = src + 1;
+        bool decoded = false;
+
+        if(p < end && *p == '#'){
+
+            unsigned long code = 0;
+            bool hex = (p + 1 < end && (p[1] | 0x20) == 'x');
+            const char *digits = p + (hex ? 2 : 1);
+            const char *q = digits;
+
+            while(q < end && (hex ? isxdigit((unsigned char) *q) : isdigit((unsigned char) *q)) && code < 0x110000){
+                code = code * (hex ? 16 : 10) + (isdigit((unsigned char) *q) ? *q - '0' : (*q | 0x20) - 'a' + 10);
+                q++;
+            }
+
+            if(q > digits && code > 0 && code < 0x110000){
+
+                if(code < 0x80){
+                    dst[out++] = (char) code;
+                } else if(code < 0x800){
+                    dst[out++] = (char) (0xC0 | (code >> 6));
+                    dst[out++] = (char) (0x80 | (code & 0x3F));
+                } else if(code < 0x10000){
+                    dst[out++] = (char) (0xE0 | (code >> 12));
+                    dst[out++] = (char) (0x80 | ((code >> 6) & 0x3F));
+                    dst[out++] = (char) (0x80 | (code & 0x3F));
+                } else {
+                    dst[out++] = (char) (0xF0 | (code >> 18));
+                    dst[out++] = (char) (0x80 | ((code >> 12) & 0x3F));
+                    dst[out++] = (char) (0x80 | ((code >> 6) & 0x3F));
+                    dst[out++] = (char) (0x80 | (code & 0x3F));
+                }
+
+                src = (q < end && *q == ';') ? q + 1 : q;
+                decoded = true;
+            }
+        }
+
+        else {
+            for(size_t i = 0; i < sizeof(named) / sizeof(named[0]); i++){
+
+                size_t n = strlen(named[i].name);
+
+                if((size_t) (end - p) >= n && memcmp(p, named[i].name, n) == 0){
+                    dst[out++] = named[i].c;
+                    src = p + n;
+                    decoded = true;
+                    break;
+                }
+            }
+        }
+
+        if(!decoded){
+            dst[out++] = *src++;
+        }
+    }
+
+    return out;
+}
+
+
+//Trims the value, decodes it if it contains '&', and passes it on.
+static void emit_href(const char *value, size_t len, const html_scan_handler *handler, void *ctx){
+
+    char decoded[4096];
+
+    while(len > 0 && is_html_space(*value)){
+        value++;
+        len--;
+    }
+
+    while(len > 0 && is_html_space(value[len - 1])){
+        len--;
+    }
+
+    if(len == 0){
+        return;
+    }
+
+    if(memchr(value, '&', len) != NULL){
+
+        size_t n = decode_entities(value, len, decoded, sizeof(decoded));
+
+        if(n > 0){
+            handler->href(decoded, n, ctx);
+            return;
+        }
+    }
+
+    handler->href(value, len, ctx);
+}
+
+
+/*
+Parses the attributes of an <a> tag starting right after "<a" and reports its href.
+
+@return const char*: position just past the tag's '>', or end.
+*/
+static const char *scan_anchor(const char *p, const char *end, const html_scan_handler *handler, void *ctx){
+
+    while(p < end){
+
+        while(p < end && (is_html_space(*p) || *p == '/')){
+            p++;
+        }
+
+        if(p >= end || *p == '>'){
+            return p < end ? p + 1 : end;
+        }
+
+        const char *name = p;
+
+        while(p < end && !is_html_space(*p) && *p != '=' && *p != '>' && *p != '/'){
+            p++;
+        }
+
+        bool is_href = (p - name == 4) && starts_with_ci(name, p, "href");
+
+        while(p < end && is_html_space(*p)){
+            p++;
+        }
+
+        if(p >= end || *p != '='){
+            continue;
+        }
+
+        p++;
+
+        while(p < end && is_html_space(*p)){
+            p++;
+        }
+
+        const char *value = p;
+        size_t value_len;
+
+        if(p < end && (*p == '"' || *p == '\'')){
+
+            const char *close = memchr(p + 1, *p, end - p - 1);
+
+            if(close == NULL){
+                return end;
+            }
+
+            value = p + 1;
+            value_len = close - value;
+            p = close + 1;
+        }
+
+        else {
+            while(p < end && !is_html_space(*p) && *p != '>'){
+                p++;
+            }
+
+            value_len = p - value;
+        }
+
+        if(is_href){
+            emit_href(value, value_len, handler, ctx);
+        }
+    }
+
+    return end;
+}
+
+
+//Skips to just past the '>' that closes a tag, stepping over quoted attribute values.
+static const char *skip_tag(const char *p, const char *end){
+
+    while(p < end){
+
+        p = find_tag_special(p, end);
+
+        if(p >= end || *p == '>'){
+            return p < end ? p + 1 : end;
+        }
+
+        const char *close = memchr(p + 1, *p, end - p - 1);
+
+        if(close == NULL){
+            return end;
+        }
+
+        p = close + 1;
+    }
+
+    return end;
+}
+
+
+//Finds the "</name" that ends a raw-text element such as <script>.
+static const char *find_raw_text_end(const char *p, const char *end, const char *name){
+
+    size_t n = strlen(name);
+
+    while((p = find_tag_open(p, end)) < end){
+
+        if(p + 1 < end && p[1] == '/' && starts_with_ci(p + 2, end, name) && (p + 2 + n >= end || !isalnum((unsigned char) p[2 + n]))){
+            return p;
+        }
+
+        p++;
+    }
+
+    return end;
+}
+
+
+/*
+Single pass over an HTML body, reporting every <a href> and every run of text.
+
+@param const char *html: the body; need not be NUL terminated.
+@param size_t len: its length.
+*/
+void scan_html(const char *html, size_t len, const html_scan_handler *handler, void *ctx){
+
+    const char *p = html;
+    const char *end = html + len;
+
+    while(p < end){
+
+        const char *lt = find_tag_open(p, end);
+
+        if(lt > p && handler->text){
+            handler->text(p, lt - p, ctx);
+        }
+
+        if(lt >= end){
+            break;
+        }
+
+        const char *tag = lt + 1;
+
+        if(starts_with_ci(tag, end, "!--")){
+            const char *close = memmem(tag + 3, end - tag - 3, "-->", 3);
+            p = close ? close + 3 : end;
+        }
+
+        else if((tag < end && (*tag | 0x20) == 'a') && (tag + 1 >= end || is_html_space(tag[1]) || tag[1] == '>')){
+            p = scan_anchor(tag + 1, end, handler, ctx);
+        }
+
+        else if(starts_with_ci(tag, end, "script") || starts_with_ci(tag, end, "style")){
+
+            const char *name = ((*tag | 0x20) == 's' && (tag[1] | 0x20) == 'c') ? "script" : "style";
+            const char *body = skip_tag(tag, end);
+            const char *close = find_raw_text_end(body, end, name);
+
+            if(close > body && handler->text){
+                handler->text(body, close - body, ctx);
+            }
+
+            p = (close < end) ? skip_tag(close, end) : end;
+        }
+
+        else {
+            p = skip_tag(tag, end);
+        }
+    }
+}
+
+
+//Per-page state for the fast path.
+typedef struct fast_page{
+    crawl_args *args;
+    const char *url;     //Links are resolved against it.
+    int depth;
+    match_stream ms;
+} fast_page;
+
+
+static void fast_page_href(const char *href, size_t len, void *ctx){
+
+    fast_page *page = (fast_page *) ctx;
+
+    enqueue_link(page->args->url_q, page->url, href, len, page->depth + 1);
+}
+
+
+static void fast_page_text(const char *text, size_t len, void *ctx){
+
+    fast_page *page = (fast_page *) ctx;
+
+    match_stream_feed(&page->ms, text, len);
+    match_stream_break(&page->ms);
+}
+
+
+static const html_scan_handler fast_page_handler = { fast_page_href, fast_page_text };
+
+
+
+/*
+Hands a fetched page to the parsing stage: robots.txt goes to robots_loaded(), sitemaps have their last entries queued, everything else 
+has its links queued by parseHTML() and is checked for targets by parseHTMLElements(),
+or both happen in one scan_html() pass with --parser=fast. In stream mode the page has already been parsed while it downloaded, so only the end
+of the document is flushed through the push parser. A near duplicate (see 
+is_near_duplicate()) is not parsed at all, and in stream mode its held-back links are
+dropped. Both the blocking workers and the event loops call this once a transfer has finished. 
+
+@param crawl_args *args: shared crawl state.
+@param const frontier_item *item: what was fetched; its links are queued one level deeper.
+@param response *resp: the response, body NUL terminated.
+*/
+void process_page(crawl_args *args, const frontier_item *item, response *resp){
+
+    const char *url = item->url;
+    int depth = item->depth;
+    char *data = resp->body.memory;
+    page_validators *page = resp->validators;
+    uint64_t content_hash = 0;
+
+    //Not modified: report and queue what the stored copy had; there is no body to parse or archive.
+    if (page != NULL && resp->status == 304) {
+
+        if (replay_validators(args, item, 0)) {
+            atomic_fetch_add(&validators.not_modified, 1);
+        }
+
+        return;
+    }
+
+    if (page != NULL && resp->status == 200) {
+        content_hash = hash_bytes(data, resp->body.size);
+    }
+
+    //Parse time of pages, on top of what the stream parser spent while the page downloaded.
+    bool timed = metrics.enabled && item->kind == ITEM_PAGE && resp->sitemap == NULL;
+    long parse_started = timed ? monotonic_us() : 0;
+    long match_us = 0;
+
+    //A deferred page was only buffered; its fingerprint is taken here, off the fetch thread.
+    if (resp->deferred && resp->simhash != NULL) {
+        simhash_feed(resp->simhash, data, resp->body.size);
+    }
+
+    //Decided before parsing, so a duplicate costs no parse in the fast, DOM and deferred modes.
+    bool duplicate = (resp->simhash != NULL && is_near_duplicate(resp->simhash));
+
+    //Whatever the parsers below find is collected for the validator cache.
+    capturing_page = page;
+
+    if (item->kind == ITEM_ROBOTS) {
+
+        if (item->host != NULL) {
+            robots_loaded(args->url_q, item->host, data, resp->status);
+        }
+    }
+
+    else if (resp->parser) {
+
+        htmlParseChunk(resp->parser->ctxt, NULL, 0, 1);
+        match_stream_break(&resp->parser->ms);
+
+        //The page was parsed as it arrived, but a duplicate's links and matches go no further.
+        if (!duplicate) {
+            record_match(args->output, args->matcher, url, &resp->parser->hits);
+            queue_deferred_links(args->url_q, resp->parser);
+        }
+    }
+
+    else if (resp->sitemap) {
+        // Sitemap entries were queued as they streamed in; queue the rest.
+        finish_sitemap(resp->sitemap);
+    }
+
+    else if (duplicate) {
+        // Near copy of a page already crawled: neither its targets nor its links are new.
+    }
+
+    else if (content_hash != 0 && replay_validators(args, item, content_hash)) {
+        // Same bytes as last time, so the stored links and matches are still right.
+        atomic_fetch_add(&validators.unchanged, 1);
+    }
+
+    else if (config.parser == PARSER_STREAM) {
+
+        //Deferred to a parse worker: the same SAX pass as while downloading, over the whole body at once.
+        stream_parser *parser = create_stream_parser(args, url, depth);
+
+        if (parser != NULL) {
+            parser->defer_links = false;
+            htmlParseChunk(parser->ctxt, data, (int) resp->body.size, 1);
+            match_stream_break(&parser->ms);
+            record_match(args->output, args->matcher, url, &parser->hits);
+            free_stream_parser(parser);
+        }
+    }
+
+    else if (config.parser == PARSER_FAST) {
+
+        fast_page page = {args, url, depth};
+        match_list hits = {0};
+
+        if(init_match_stream(&page.ms, args->matcher, &hits)){
+            scan_html(data, resp->body.size, &fast_page_handler, &page);
+            free_match_stream(&page.ms);
+            record_match(args->output, args->matcher, url, &hits);
+            free_match_list(&hits);
+        }
+    } else {
+        // Parse HTML content
+        if (parseHTML(args->url_q, data, url, depth)) {
+            //printf("HTML URL's Parsed.\n");
+        }
+
+        // Parse specific elements in the HTML
+        long match_started = timed ? monotonic_us() : 0;
+
+        parseHTMLElements(args->url_q, args->output, data, args->matcher, url);
+
+        if (timed) {
+            match_us = monotonic_us() - match_started;
+            observe_stage(STAGE_MATCH, match_us);
+        }
+    }
+
+    capturing_page = NULL;
+
+    if (timed) {
+
+        long now = monotonic_us();
+
+        observe_stage(STAGE_PARSE, resp->parse_us + now - parse_started - match_us);
+        observe_stage(STAGE_PAGE, now - resp->started_us);
+    }
+
+    //Stored even when unchanged, since the validators themselves may be new.
+    if (content_hash != 0) {
+        store_validators(item, page, content_hash);
+    }
+
+    //Sitemaps were never buffered, so there is nothing to keep.
+    if (config.warc_dir != NULL && resp->sitemap == NULL) {
+        archive_response(item, resp);
+    }
+}
+
+
+
+/*
+-----------------------------------------
+|       Fetch and parse pipeline        |
+-----------------------------------------
+With --parse-workers, fetching and parsing run on different threads. A blocking worker
+or event loop that finishes a transfer puts the response on a bounded queue and goes
+straight back to the network; a pool of parse workers, one per core with "auto", takes
+pages off the queue, runs process_page() on them and retires their URLs. The stages
+are sized on their own: fetch threads for how many transfers wait on the network at
+once, parse threads for the cores.
+
+The queue holds at most --parse-queue pages. When it is full, a fetch thread blocks in
+submit_page() until a parse worker makes room, so a parse stage that falls behind
+slows fetching down instead of piling up bodies in memory. Queue depth, the time pages
+wait on the queue ("parse_wait") and the time fetch threads are held up ("stall") are
+in the metrics.
+
+Pages are not stream-parsed while they download in this mode, since that is exactly
+the work being moved off the fetch threads; the parse worker runs the same SAX pass
+over the whole body. Sitemaps still stream, as they are never buffered. Body buffers
+now come from the fetch threads' pools but are freed on the parse workers, so parse
+workers pass them back through a shared stack (see return_bodies()).
+*/
+
+#define PIPELINE_SPARES (POOL_BUFFERS * 4)   //Body buffers waiting to go back to a fetch thread.
+#define PIPELINE_BORROW 8                    //Taken at once by a fetch thread whose pool is empty.
+
+typedef struct parse_job{
+    frontier_item item;
+    response resp;
+    long queued_us;
+} parse_job;
+
+
+static struct {
+    bool enabled;
+    crawl_args *args;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    parse_job **slots;          //Ring of capacity jobs; count of them start at head.
+    int capacity, head, count;
+    bool closing;               //No more jobs will come; workers exit once the queue is empty.
+
+    pthread_t *workers;
+    int worker_count;
+
+    long peak;                  //Most jobs queued at once.
+    long stalls;                //Times a fetch thread found the queue full.
+
+    pthread_mutex_t spare_lock;
+    int spare_count;
+    char  *spare_memory[PIPELINE_SPARES];
+    size_t spare_capacity[PIPELINE_SPARES];
+} pipeline = { .lock = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER,
+               .not_full = PTHREAD_COND_INITIALIZER, .spare_lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+//Parse worker: moves the buffers its finished pages left in its pool to the shared stack.
+void return_bodies(void){
+
+    buffer_pool *pool = &thread_pool;
+
+    pthread_mutex_lock(&pipeline.spare_lock);
+
+    while(pool->count > 0 && pipeline.spare_count < PIPELINE_SPARES){
+        pool->count--;
+        pipeline.spare_memory[pipeline.spare_count] = pool->memory[pool->count];
+        pipeline.spare_capacity[pipeline.spare_count] = pool->capacity[pool->count];
+        pipeline.spare_count++;
+    }
+
+    pthread_mutex_unlock(&pipeline.spare_lock);
+}
+
+
+//Fetch thread: refills an empty pool from the shared stack, so acquire_body() does not fall back to malloc.
+void borrow_bodies(void){
+
+    buffer_pool *pool = &thread_pool;
+
+    if(pool->count > 0){
+        return;
+    }
+
+    pthread_mutex_lock(&pipeline.spare_lock);
+
+    while(pool->count < PIPELINE_BORROW && pipeline.spare_count > 0){
+        pipeline.spare_count--;
+        pool->memory[pool->count] = pipeline.spare_memory[pipeline.spare_count];
+        pool->capacity[pool->count] = pipeline.spare_capacity[pipeline.spare_count];
+        pool->count++;
+    }
+
+    pthread_mutex_unlock(&pipeline.spare_lock);
+}
+
+
+/*
+Hands a fetched page to the parse workers, waiting while the queue is full. The job 
+takes over resp, and the parse worker retires the URL, so after true the caller must
+neither free resp nor call URL_done().
+
+@return bool: false if the pipeline is off or memory ran out; the caller then processes the page itself.
+*/
+bool submit_page(const frontier_item *item, response *resp){
+
+    if(!pipeline.enabled){
+        return false;
+    }
+
+    parse_job *job = (parse_job *) malloc(sizeof(parse_job));
+
+    if(job == NULL){
+        return false;
+    }
+
+    job->item = *item;
+    job->resp = *resp;
+    job->queued_us = metrics.enabled ? monotonic_us() : 0;
+
+    //Counted before the fetch thread can look idle, so a checkpoint waits for the page (see pause_crawl()).
+    atomic_fetch_add(&pipeline.args->url_q->parsing, 1);
+
+    long stalled = 0;
+
+    pthread_mutex_lock(&pipeline.lock);
+
+    if(pipeline.count == pipeline.capacity){
+
+        long started = monotonic_us();
+
+        pipeline.stalls++;
+
+        while(pipeline.count == pipeline.capacity){
+            pthread_cond_wait(&pipeline.not_full, &pipeline.lock);
+        }
+
+        stalled = monotonic_us() - started;
+    }
+
+    pipeline.slots[(pipeline.head + pipeline.count) % pipeline.capacity] = job;
+    pipeline.count++;
+
+    if(pipeline.count > pipeline.peak){
+        pipeline.peak = pipeline.count;
+    }
+
+    atomic_store_explicit(&metrics.parse_queued, pipeline.count, memory_order_relaxed);
+    pthread_cond_signal(&pipeline.not_empty);
+    pthread_mutex_unlock(&pipeline.lock);
+
+    if(stalled > 0 && metrics.enabled){
+        observe_stage(STAGE_STALL, stalled);
+    }
+
+    borrow_bodies();
+
+    return true;
+}
+
+
+//Parse worker: process_page() for every job until the pipeline is closed and drained.
+void * run_parse_worker(void *arg){
+
+    crawl_args *args = pipeline.args;
+
+    while(1){
+
+        pthread_mutex_lock(&pipeline.lock);
+
+        while(pipeline.count == 0 && !pipeline.closing){
+            pthread_cond_wait(&pipeline.not_empty, &pipeline.lock);
+        }
+
+        if(pipeline.count == 0){
+            pthread_mutex_unlock(&pipeline.lock);
+            break;
+        }
+
+        parse_job *job = pipeline.slots[pipeline.head];
+
+        pipeline.head = (pipeline.head + 1) % pipeline.capacity;
+        pipeline.count--;
+
+        atomic_store_explicit(&metrics.parse_queued, pipeline.count, memory_order_relaxed);
+        pthread_cond_signal(&pipeline.not_full);
+        pthread_mutex_unlock(&pipeline.lock);
+
+        if(metrics.enabled){
+            observe_stage(STAGE_PARSE_WAIT, monotonic_us() - job->queued_us);
+        }
+
+        process_page(args, &job->item, &job->resp);
+        free_response(&job->resp);
+        return_bodies();
+
+        URL_done(args->url_q, &job->item);
+        atomic_fetch_sub(&args->url_q->parsing, 1);
+
+        free(job);
+    }
+
+    drain_buffer_pool();
+
+    return NULL;
+}
+
+
+/*
+Starts the parse workers. Call before any fetch thread starts.
+
+@return bool: false if the queue or the threads could not be set up.
+*/
+bool start_pipeline(crawl_args *args){
+
+    pipeline.args = args;
+    pipeline.capacity = config.parse_queue;
+    pipeline.slots = (parse_job **) calloc(pipeline.capacity, sizeof(parse_job *));
+    pipeline.workers = (pthread_t *) calloc(config.parse_workers, sizeof(pthread_t));
+
+    if(pipeline.slots == NULL || pipeline.workers == NULL){
+        append_to_log_file("Memory allocation failed");
+        return false;
+    }
+
+    metrics.parse_queue_size = pipeline.capacity;
+
+    for(int i = 0; i < config.parse_workers; i++, pipeline.worker_count++){
+        if(pthread_create(&pipeline.workers[i], NULL, run_parse_worker, NULL) != 0){
+            append_to_log_file("Failed to create thread");
+            break;
+        }
+    }
+
+    pipeline.enabled = (pipeline.worker_count > 0);
+
+    return pipeline.enabled;
+}
+
+
+//Lets the parse workers finish what is queued and waits for them. Call once every fetch thread has exited.
+void stop_pipeline(void){
+
+    if(!pipeline.enabled){
+        return;
+    }
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.closing = true;
+    pthread_cond_broadcast(&pipeline.not_empty);
+    pthread_mutex_unlock(&pipeline.lock);
+
+    for(int i = 0; i < pipeline.worker_count; i++){
+        pthread_join(pipeline.workers[i], NULL);
+    }
+
+    for(int i = 0; i < pipeline.spare_count; i++){
+        free(pipeline.spare_memory[i]);
+    }
+
+    pipeline.spare_count = 0;
+    pipeline.enabled = false;
+    free(pipeline.slots);
+    free(pipeline.workers);
+}
+
+
+void report_pipeline(void){
+
+    printf("Parse pipeline: %d workers, queue peaked at %ld of %d pages, fetch threads waited for room %ld times\n",
+           pipeline.worker_count, pipeline.peak, pipeline.capacity, pipeline.stalls);
+}
+
+
+
+/*
+The execute_page() function is the function we should call to process a web page, or url, within our crawler. 
+Since C does not provide native support for retrieving web pages the process consists of multiple
+steps. This function will begin the execution of those steps. 
+
+@param char *url 
+@return bool: returns false if error, true otherwise. 
+*/
+void * execute_crawl(void *arg){
+
+    crawl_args *args = arg;
+    
+    if (args->output == NULL || args->url_q == NULL) {
+        append_to_log_file("Invalid arguments");
+        return NULL;
+    }
+    
+    
+    //printf("Target: %s", args->target);
+
+    //Each worker keeps one handler for its whole life so connections are reused between pages.
+    CURL *curl_handler = create_handle();
+
+    if(curl_handler == NULL){
+        return NULL;
+    }
+
+    while(1){
+
+        // Dequeue URL from the queue, waiting while other workers may still add links.
+        frontier_item item;
+        long waited = metrics.enabled ? monotonic_us() : 0;
+
+        if (!dequeue_URL(args->url_q, &item)) {
+            // Queue is empty and no worker is busy: the crawl is over.
+            break;
+        }
+
+        if (metrics.enabled) {
+            observe_stage(STAGE_QUEUE_WAIT, monotonic_us() - waited);
+        }
+
+        if (cluster_handoff(args->url_q, &item)) {
+            continue;
+        }
+
+        const char *url = item.url;
+        //printf("%s", url);
+
+        // Process the URL
+        response resp;
+
+        if (!init_response(&resp, args, &item)){
+            fetch_failed(args, &item);
+            URL_done(args->url_q, &item);
+            continue;
+        }
+
+        if (open_url(curl_handler, url, &resp)){
+
+            //A parse worker finishes it from here.
+            if (submit_page(&item, &resp)) {
+                continue;
+            }
+
+            process_page(args, &item, &resp);
+
+        } else {
+
+            fetch_failed(args, &item);
+        }
+
+        // Free memory allocated for data
+        free_response(&resp);
+        
+        URL_done(args->url_q, &item);
+    }
+
+    curl_easy_cleanup(curl_handler);
+    drain_buffer_pool();
+
+    return NULL;
+}
+
+
+
+/*
+-----------------------------------------
+|        Event-driven fetch engine      |
+-----------------------------------------
+In async mode a few event-loop threads replace the blocking workers. Each loop owns a curl 
+multi handle and an epoll instance. curl reports the sockets it cares about through 
+socket_callback() and the next timeout through timer_callback(); epoll tells us when those 
+sockets are ready, and curl_multi_socket_action() moves every transfer on them forward.
+One loop keeps thousands of transfers in flight, so throughput is bounded by the network
+rather than by the number of threads. Finished bodies go to process_page(), exactly like
+the blocking workers. 
+*/
+
+//One in-flight request owned by an event loop.
+typedef struct transfer{
+    CURL *curl_handler;
+    frontier_item item;           //The URL being fetched, with its depth and host.
+    response resp;
+    struct transfer *next_idle;   //Link in the loop's list of idle transfers.
+} transfer;
+
+
+typedef struct event_loop{
+    CURLM *multi;
+    int epoll_fd;
+    long deadline_ms;   //When curl wants CURL_SOCKET_TIMEOUT, -1 if it has no timer pending.
+    int inflight;       //Transfers currently added to the multi handle.
+    transfer *idle;     //Finished transfers kept with their handler for the next URL.
+    crawl_args *args;
+} event_loop;
+
+
+
+
+/*
+Called by curl whenever it wants us to start, change or stop watching a socket.
+socketp is NULL until we have registered the socket with epoll once; we use
+curl_multi_assign() to remember that it is registered.
+*/
+int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp){
+
+    event_loop *loop = (event_loop *) userp;
+
+    if(what == CURL_POLL_REMOVE){
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, s, NULL);
+        curl_multi_assign(loop->multi, s, NULL);
+        return 0;
+    }
+
+    struct epoll_event ev = {0};
+    ev.data.fd = s;
+    ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+
+    if(socketp == NULL){
+
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, s, &ev) != 0 && errno == EEXIST){
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, s, &ev);
+        }
+        curl_multi_assign(loop->multi, s, loop);
+    }
+
+    else {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, s, &ev);
+    }
+
+    return 0;
+}
+
+
+//Called by curl to tell us when it next needs a timeout action.
+int timer_callback(CURLM *multi, long timeout_ms, void *userp){
+
+    event_loop *loop = (event_loop *) userp;
+
+    loop->deadline_ms = (timeout_ms < 0) ? -1 : monotonic_ms() + timeout_ms;
+
+    return 0;
+}
+
+
+//Adds a transfer for item to the loop's multi handle, reusing an idle handler when there is one.
+void add_transfer(event_loop *loop, const frontier_item *item){
+
+    //Reuse an idle handler when we have one so its connections stay warm.
+    transfer *t = loop->idle;
+
+    if(t != NULL){
+        loop->idle = t->next_idle;
+    }
+
+    else {
+        t = (transfer *) calloc(1, sizeof(transfer));
+
+        if(t != NULL && (t->curl_handler = create_handle()) == NULL){
+            free(t);
+            t = NULL;
+        }
+    }
+
+    //init_response() has logged why, e.g. a name the DNS cache knows does not exist.
+    if(t != NULL && !init_response(&t->resp, loop->args, item)){
+        t->next_idle = loop->idle;
+        loop->idle = t;
+        fetch_failed(loop->args, item);
+        URL_done(loop->args->url_q, item);
+        return;
+    }
+
+    if(t == NULL){
+        append_to_log_file("Failed to create transfer");
+        fetch_failed(loop->args, item);
+        URL_done(loop->args->url_q, item);
+        return;
+    }
+
+    t->item = *item;
+
+    setup_handle(t->curl_handler, t->item.url, &t->resp);
+    curl_easy_setopt(t->curl_handler, CURLOPT_PRIVATE, t);
+
+    curl_multi_add_handle(loop->multi, t->curl_handler);
+    loop->inflight++;
+}
+
+
+/*
+Takes URLs off the queue until the loop is at its in-flight limit or the queue runs dry,
+and adds a transfer for each of them to the multi handle. 
+*/
+void start_transfers(event_loop *loop){
+
+    crawl_args *args = loop->args;
+
+    while(loop->inflight < config.max_inflight){
+
+        frontier_item item;
+
+        if(!try_dequeue_URL(args->url_q, &item)){
+            return;
+        }
+
+        if(!cluster_handoff(args->url_q, &item)){
+            add_transfer(loop, &item);
+        }
+    }
+}
+
+
+//Collects finished transfers from the multi handle and sends their bodies to the parsing stage.
+void finish_transfers(event_loop *loop){
+
+    CURLMsg *msg;
+    int pending;
+
+    while((msg = curl_multi_info_read(loop->multi, &pending)) != NULL){
+
+        if(msg->msg != CURLMSG_DONE){
+            continue;
+        }
+
+        transfer *t = NULL;
+        bool submitted = false;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &t);
+
+        if(msg->data.result == CURLE_OK){
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &t->resp.status);
+            record_transfer(msg->easy_handle, CURLE_OK, t->resp.status, false);
+
+            //Handed to a parse worker, which now owns the response and retires the URL.
+            submitted = submit_page(&t->item, &t->resp);
+
+            if(!submitted){
+                process_page(loop->args, &t->item, &t->resp);
+            }
+        } 
+        
+        else {
+            log_event(msg->data.result, t->item.url, t->resp.rejected ? t->resp.rejected : curl_easy_strerror(msg->data.result));
+            record_transfer(msg->easy_handle, msg->data.result, 0, t->resp.rejected != NULL);
+            fetch_failed(loop->args, &t->item);
+        }
+
+        curl_multi_remove_handle(loop->multi, t->curl_handler);
+
+        if(!submitted){
+            free_response(&t->resp);
+        }
+
+        t->next_idle = loop->idle;
+        loop->idle = t;
+
+        loop->inflight--;
+
+        if(!submitted){
+            URL_done(loop->args->url_q, &t->item);
+        }
+
+        t->item.url = NULL;
+    }
+}
+
+
+/*
+Thread body of an event loop. Keeps the multi handle topped up with transfers, waits
+on epoll for socket readiness or curl's next timeout, and hands finished pages to
+process_page(). A loop with nothing in flight parks in dequeue_URL() like a blocking
+worker, and exits when the queue reports the crawl is finished. 
+*/
+void * run_event_loop(void *arg){
+
+    event_loop *loop = (event_loop *) arg;
+    struct epoll_event events[64];
+    int running = 0;
+
+    while(1){
+
+        start_transfers(loop);
+
+        if(loop->inflight == 0){
+
+            frontier_item item;
+            long waited = metrics.enabled ? monotonic_us() : 0;
+
+            if(!dequeue_URL(loop->args->url_q, &item)){
+                break;
+            }
+
+            if(metrics.enabled){
+                observe_stage(STAGE_QUEUE_WAIT, monotonic_us() - waited);
+            }
+
+            if(!cluster_handoff(loop->args->url_q, &item)){
+                add_transfer(loop, &item);
+            }
+
+            continue;
+        }
+
+        /*
+        Sleep until curl's own timer expires. While the loop still has room for more
+        transfers, wake up regularly so new links on the queue are picked up quickly.
+        */
+        long now = monotonic_ms();
+        long wait = (loop->deadline_ms < 0) ? 1000 : loop->deadline_ms - now;
+
+        if(wait < 0) wait = 0;
+        if(loop->inflight < config.max_inflight && wait > 10) wait = 10;
+
+        int n = epoll_wait(loop->epoll_fd, events, 64, (int) wait);
+
+        for(int i = 0; i < n; i++){
+
+            int flags = 0;
+
+            if(events[i].events & EPOLLIN)  flags |= CURL_CSELECT_IN;
+            if(events[i].events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+            if(events[i].events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+
+            curl_multi_socket_action(loop->multi, events[i].data.fd, flags, &running);
+        }
+
+        if(loop->deadline_ms >= 0 && monotonic_ms() >= loop->deadline_ms){
+            loop->deadline_ms = -1;
+            curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+
+        finish_transfers(loop);
+    }
+
+    drain_buffer_pool();
+
+    return NULL;
+}
+
+
+/*
+Runs the crawl in async mode: starts config.event_loops loops, each with its own multi
+handle and epoll instance, and waits for them to drain the queue. 
+
+@return bool: false if a loop could not be set up.
+*/
+bool run_async_crawl(crawl_args *args){
+
+    int count = config.event_loops;
+    event_loop *loops = (event_loop *) calloc(count, sizeof(event_loop));
+    pthread_t *threads = (pthread_t *) calloc(count, sizeof(pthread_t));
+    bool ok = true;
+
+    if(loops == NULL || threads == NULL){
+        append_to_log_file("Memory allocation failed");
+        free(loops);
+        free(threads);
+        return false;
+    }
+
+    for(int i = 0; i < count; i++){
+
+        loops[i].args = args;
+        loops[i].deadline_ms = -1;
+        loops[i].multi = curl_multi_init();
+        loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+        if(loops[i].multi == NULL || loops[i].epoll_fd < 0){
+            append_to_log_file("Failed to create event loop");
+            ok = false;
+            count = i + 1;
+            break;
+        }
+
+        curl_multi_setopt(loops[i].multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+        curl_multi_setopt(loops[i].multi, CURLMOPT_SOCKETDATA, &loops[i]);
+        curl_multi_setopt(loops[i].multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+        curl_multi_setopt(loops[i].multi, CURLMOPT_TIMERDATA, &loops[i]);
+        curl_multi_setopt(loops[i].multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
     }
-    
 
-    //Join threads after completion.
-    for (int i = 0; i < NUM_THREADS; i++) {
+    int started = 0;
+
+    for(int i = 0; ok && i < count; i++, started++){
+        if(pthread_create(&threads[i], NULL, run_event_loop, &loops[i]) != 0){
+            append_to_log_file("Failed to create event loop thread");
+            ok = false;
+            break;
+        }
+    }
+
+    atomic_store(&args->url_q->workers, started);
+
+    for(int i = 0; i < started; i++){
         pthread_join(threads[i], NULL);
     }
 
+    for(int i = 0; i < count; i++){
+
+        while(loops[i].idle != NULL){
+            transfer *t = loops[i].idle;
+            loops[i].idle = t->next_idle;
+            curl_easy_cleanup(t->curl_handler);
+            free(t);
+        }
+
+        if(loops[i].multi) curl_multi_cleanup(loops[i].multi);
+        if(loops[i].epoll_fd >= 0) close(loops[i].epoll_fd);
+    }
+
+    free(loops);
+    free(threads);
+
+    return ok;
+}
+    
+
+//Debug helper, only meaningful while no other thread is touching the queue.
+void print_queue(struct URLQueue *url_q){
+
+    size_t head = atomic_load(&url_q->dequeue_pos);
+    size_t tail = atomic_load(&url_q->enqueue_pos);
+
+    for(size_t pos = head; pos != tail; pos++){
+        printf("URL: %s\n", url_string(url_q->slots[pos & url_q->mask].html_url));
+    }
+
+    struct URLQueueNode *ptr = url_q -> head;
+
+    while(ptr != NULL){
+        printf("URL: %s\n", url_string(ptr->html_url));
+        ptr = ptr -> next_URL;
+    }
+
+    return;
+}
+
+
+void printOutput(struct data_list *output){
+
+    struct URL *ptr = output -> head;
+    printf("Printing output...\n");
+
+    while(ptr != NULL){
+        printf("URL: %s\n", ptr->url);
+        ptr = ptr -> next_URL;
+    }
+
+    return;
+}
+
+
+//Adds a pattern to config.targets.
+bool add_target(const char *pattern){
+
+    char **targets = (char **) realloc(config.targets, (config.target_count + 1) * sizeof(char *));
+
+    if(targets == NULL || (targets[config.target_count] = strdup(pattern)) == NULL){
+        append_to_log_file("Memory allocation failed");
+        return false;
+    }
+
+    config.targets = targets;
+    config.target_count++;
+
+    return true;
+}
+
+
+bool add_strip_param(const char *name){
+
+    char **params = (char **) realloc(config.strip_params, (config.strip_param_count + 1) * sizeof(char *));
+
+    if(params == NULL || (params[config.strip_param_count] = strdup(name)) == NULL){
+        append_to_log_file("Memory allocation failed");
+        return false;
+    }
+
+    config.strip_params = params;
+    config.strip_param_count++;
+
+    return true;
+}
+
+
+//Adds every non-empty line of a file as a target.
+bool load_targets_file(const char *path){
+
+    FILE *file = fopen(path, "r");
+    char line[4096];
+
+    if(file == NULL){
+        fprintf(stderr, "Cannot open targets file %s\n", path);
+        return false;
+    }
+
+    while(fgets(line, sizeof(line), file)){
+
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if(line[0] != '\0' && !add_target(line)){
+            fclose(file);
+            return false;
+        }
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+
+
+/*
+Command line options. Everything is optional; the defaults reproduce the original
+ten blocking worker threads. 
+*/
+static struct option long_options[] = {
+    {"threads",      required_argument, NULL, 't'},
+    {"async",        no_argument,       NULL, 'a'},
+    {"loops",        required_argument, NULL, 'l'},
+    {"max-inflight", required_argument, NULL, 'm'},
+    {"queue-size",   required_argument, NULL, 'q'},
+    {"parser",       required_argument, NULL, 'p'},
+    {"parse-workers", required_argument, NULL, 'g'},
+    {"parse-queue",  required_argument, NULL, 'u'},
+    {"target",       required_argument, NULL, 'T'},
+    {"targets-file", required_argument, NULL, 'f'},
+    {"ignore-case",  no_argument,       NULL, 'i'},
+    {"whole-word",   no_argument,       NULL, 'w'},
+    {"seen",         required_argument, NULL, 's'},
+    {"bloom-fpr",    required_argument, NULL, 'F'},
+    {"bloom-items",  required_argument, NULL, 'N'},
+    {"bloom-memory", required_argument, NULL, 'M'},
+    {"seen-spill",   required_argument, NULL, 'S'},
+    {"bfs-barrier",  no_argument,       NULL, 'R'},
+    {"host-rate",    required_argument, NULL, 'H'},
+    {"host-burst",   required_argument, NULL, 'U'},
+    {"host-connections", required_argument, NULL, 'C'},
+    {"ignore-robots", no_argument,      NULL, 'O'},
+    {"robots-ttl",   required_argument, NULL, 'E'},
+    {"no-sitemaps",  no_argument,       NULL, 'X'},
+    {"strip-param",  required_argument, NULL, 'P'},
+    {"state-dir",    required_argument, NULL, 'D'},
+    {"frontier-memory", required_argument, NULL, 'G'},
+    {"checkpoint-every", required_argument, NULL, 'K'},
+    {"resume",       no_argument,       NULL, 'Z'},
+    {"warc",         required_argument, NULL, 'W'},
+    {"warc-segment", required_argument, NULL, 'V'},
+    {"validator-cache", required_argument, NULL, 'J'},
+    {"near-duplicates", required_argument, NULL, 'Q'},
+    {"max-page-size", required_argument, NULL, 'A'},
+    {"stats-every",  required_argument, NULL, 'I'},
+    {"metrics-port", required_argument, NULL, 'k'},
+    {"dns-prefetch", no_argument,       NULL, 'd'},
+    {"dns-negative-ttl", required_argument, NULL, 'e'},
+    {"cluster",      required_argument, NULL, 'c'},
+    {"node",         required_argument, NULL, 'n'},
+    {"log-file",     required_argument, NULL, 'L'},
+    {"log-fsync",    required_argument, NULL, 'Y'},
+    {"log-full",     required_argument, NULL, 'B'},
+    {"help",         no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+
+void print_usage(char *program){
+
+    printf("Usage: %s [options] <depth-limit> <starting-url>\n\n", program);
+    printf("  depth-limit is how many links away from the starting URL the crawl goes.\n\n");
+    printf("  -t, --threads=N        blocking fetch workers (default %d)\n", config.num_threads);
+    printf("  -a, --async            drive transfers through curl multi event loops\n");
+    printf("  -l, --loops=N          event-loop threads in async mode (default %d)\n", config.event_loops);
+    printf("  -m, --max-inflight=N   transfers per event loop (default %d)\n", config.max_inflight);
+    printf("  -q, --queue-size=N     slots in the lock-free frontier ring (default %d)\n", config.queue_size);
+    printf("  -p, --parser=MODE      stream (single SAX pass while downloading), dom, or fast\n");
+    printf("                         (SIMD link scanner, no conforming tree) (default stream)\n");
+    printf("      --parse-workers=N  parse fetched pages on N separate threads, \"auto\" for one per\n");
+    printf("                         core (default 0: parse on the fetching thread)\n");
+    printf("      --parse-queue=N    fetched pages that may wait for a parse worker before fetching\n");
+    printf("                         pauses (default %d)\n", config.parse_queue);
+    printf("  -T, --target=TEXT      pattern to look for; repeat for several (default \"About\")\n");
+    printf("  -f, --targets-file=F   one pattern per line\n");
+    printf("  -i, --ignore-case      match targets case-insensitively\n");
+    printf("  -w, --whole-word       only match targets that are whole words\n");
+    printf("  -s, --seen=MODE        seen-set backend: exact or bloom (default exact)\n");
+    printf("      --bloom-fpr=P      target Bloom false-positive rate (default %g)\n", config.bloom_fpr);
+    printf("      --bloom-items=N    URLs the Bloom filter is sized for (default %ld)\n", config.bloom_items);
+    printf("      --bloom-memory=MB  ceiling on the Bloom filter size (default %ld)\n", config.bloom_memory_mb);
+    printf("      --seen-spill=FILE  exact on-disk check behind the Bloom filter\n");
+    printf("      --bfs-barrier      fetch one depth level completely before starting the next\n");
+    printf("      --host-rate=R      requests per second to any one host, 0 for no limit (default %g)\n", config.host_rate);
+    printf("      --host-burst=N     requests a quiet host may take back to back (default %g)\n", config.host_burst);
+    printf("      --host-connections=N  pages of one host fetched at once, 0 for no limit (default %d)\n", config.host_connections);
+    printf("      --ignore-robots    do not fetch or obey robots.txt\n");
+    printf("      --robots-ttl=SEC   how long a robots.txt is cached (default %ld)\n", config.robots_ttl);
+    printf("      --no-sitemaps      do not follow the Sitemap lines of robots.txt\n");
+    printf("      --strip-param=NAME session parameter to remove from URLs; repeat for several\n");
+    printf("                         (always: jsessionid, phpsessid, aspsessionid, sessionid, sid)\n");
+    printf("      --state-dir=DIR    spill the frontier to DIR and write checkpoints there\n");
+    printf("      --frontier-memory=N  URLs kept in memory before the frontier spills (default %ld)\n", config.frontier_memory);
+    printf("      --checkpoint-every=SEC  seconds between checkpoints, 0 for only the last (default %d)\n", config.checkpoint_every);
+    printf("      --resume           continue from the checkpoint in the state directory\n");
+    printf("      --warc=DIR         archive every fetched page to gzipped WARC files in DIR\n");
+    printf("      --warc-segment=MB  size at which a new WARC file is started (default %ld)\n", config.warc_segment_mb);
+    printf("      --validator-cache=FILE  send the ETag and Last-Modified seen in earlier runs and\n");
+    printf("                         reuse the stored links of pages that have not changed\n");
+    printf("      --near-duplicates=K  do not parse pages whose SimHash is within K bits (0-%d)\n", NEAR_DUP_MAX_BITS);
+    printf("                         of an earlier page's\n");
+    printf("      --max-page-size=KB abort transfers whose body is larger, 0 for no limit\n");
+    printf("                         (default %ld; sitemaps are exempt)\n", config.max_page_size / 1024);
+    printf("      --stats-every=SEC  print throughput, queue and per-stage latencies to stderr\n");
+    printf("      --metrics-port=N   serve the same metrics as Prometheus text on 127.0.0.1:N\n");
+    printf("      --dns-prefetch     resolve host names in the background as soon as they are queued\n");
+    printf("                         and give curl the cached answers\n");
+    printf("      --dns-negative-ttl=SEC  how long a name that does not exist is remembered (default %ld)\n", config.dns_negative_ttl);
+    printf("      --cluster=FILE     crawl with the nodes listed in FILE (host:port or unix:/path per\n");
+    printf("                         line, re-read when it changes); each node owns a share of the hosts\n");
+    printf("      --node=ADDR        this node's address as listed in the cluster file; the port has\n");
+    printf("                         no authentication, keep it off untrusted networks\n");
+    printf("      --log-file=FILE    structured log (default %s)\n", config.log_path);
+    printf("      --log-fsync=MS     fsync the log: 0 after every batch, N at most every N ms\n");
+    printf("                         (default never)\n");
+    printf("      --log-full=MODE    drop or block when a thread's log ring is full (default drop)\n");
+}
+
+
+/*
+Fills in the global config from argv. 
+
+@return int: index of the first positional argument, or -1 if the options were invalid.
+*/
+int parse_options(int argc, char *argv[]){
+
+    int opt;
+
+    while((opt = getopt_long(argc, argv, "t:al:m:q:p:T:f:iws:h", long_options, NULL)) != -1){
+
+        switch(opt){
+            case 't': config.num_threads  = atoi(optarg); break;
+            case 'a': config.async        = true;         break;
+            case 'l': config.event_loops  = atoi(optarg); break;
+            case 'm': config.max_inflight = atoi(optarg); break;
+            case 'q': config.queue_size   = atoi(optarg); break;
+            case 'F': config.bloom_fpr       = atof(optarg); break;
+            case 'N': config.bloom_items     = atol(optarg); break;
+            case 'M': config.bloom_memory_mb = atol(optarg); break;
+            case 'S': config.seen_spill_path = optarg;       break;
+            case 'R': config.bfs_barrier     = true;         break;
+            case 'H': config.host_rate       = atof(optarg); break;
+            case 'U': config.host_burst      = atof(optarg); break;
+            case 'C': config.host_connections = atoi(optarg); break;
+            case 'O': config.obey_robots     = false;        break;
+            case 'E': config.robots_ttl      = atol(optarg); break;
+            case 'X': config.follow_sitemaps = false;        break;
+            case 'D': config.state_dir       = optarg;       break;
+            case 'G': config.frontier_memory = atol(optarg); break;
+            case 'K': config.checkpoint_every = atoi(optarg); break;
+            case 'Z': config.resume          = true;         break;
+            case 'W': config.warc_dir        = optarg;       break;
+            case 'V': config.warc_segment_mb = atol(optarg); break;
+            case 'J': config.validator_cache = optarg;       break;
+            case 'Q': config.near_duplicate_bits = atoi(optarg); break;
+            case 'A': config.max_page_size   = atol(optarg) * 1024; break;
+            case 'I': config.stats_every     = atoi(optarg); break;
+            case 'k': config.metrics_port    = atoi(optarg); break;
+            case 'd': config.dns_prefetch    = true;         break;
+            case 'e': config.dns_negative_ttl = atol(optarg); break;
+            case 'c': config.cluster_file    = optarg;       break;
+            case 'n': config.node_address    = optarg;       break;
+            case 'L': config.log_path        = optarg;       break;
+            case 'u': config.parse_queue     = atoi(optarg); break;
+            case 'Y': config.log_fsync_ms    = atoi(optarg); break;
+            case 'i': config.ignore_case     = true;         break;
+            case 'w': config.whole_word      = true;         break;
+
+            case 'T':
+                if(!add_target(optarg)) return -1;
+                break;
+
+            case 'f':
+                if(!load_targets_file(optarg)) return -1;
+                break;
+
+            case 'P':
+                if(!add_strip_param(optarg)) return -1;
+                break;
+
+            case 'g':
+                if(strcmp(optarg, "auto") == 0) config.parse_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+                else config.parse_workers = atoi(optarg);
+                break;
+
+            case 'p':
+                if(strcmp(optarg, "stream") == 0)   config.parser = PARSER_STREAM;
+                else if(strcmp(optarg, "dom") == 0) config.parser = PARSER_DOM;
+                else if(strcmp(optarg, "fast") == 0) config.parser = PARSER_FAST;
+                else return -1;
+                break;
+
+            case 'B':
+                if(strcmp(optarg, "drop") == 0)       config.log_full = LOG_DROP;
+                else if(strcmp(optarg, "block") == 0) config.log_full = LOG_BLOCK;
+                else return -1;
+                break;
+
+            case 's':
+                if(strcmp(optarg, "exact") == 0)      config.seen_backend = SEEN_EXACT;
+                else if(strcmp(optarg, "bloom") == 0) config.seen_backend = SEEN_BLOOM;
+                else return -1;
+                break;
+
+            default:  return -1;
+        }
+    }
+
+    if(config.num_threads < 1 || config.event_loops < 1 || config.max_inflight < 1 || config.queue_size < 1 ||
+       config.bloom_fpr <= 0.0 || config.bloom_fpr >= 1.0 || config.bloom_items < 1 || config.bloom_memory_mb < 1 ||
+       config.host_rate < 0 || config.host_burst < 1 || config.host_connections < 0 ||
+       config.robots_ttl < 0 || config.warc_segment_mb < 1 || config.near_duplicate_bits > NEAR_DUP_MAX_BITS ||
+       config.max_page_size < 0 || config.stats_every < 0 || config.metrics_port < 0 || config.metrics_port > 65535 ||
+       (config.cluster_file == NULL) != (config.node_address == NULL) || config.parse_workers < 0 || config.parse_queue < 1 ||
+       config.dns_negative_ttl < 0){
+        return -1;
+    }
+
+    return optind;
+}
+
+
+/*
+The whole crawl: options, start-up, the workers or event loops, and the reports. main()
+is just this, so Bench.c can build Crawl.c with CRAWL_NO_MAIN and drive a crawl itself.
+
+@return int: the process exit status.
+*/
+int run_crawler(int argc, char *argv[]){
+
+    int first_arg = parse_options(argc, argv);
+
+    if(first_arg < 0 || argc - first_arg < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    
+    //"https://www.ubisoft.com/en-ca/game/assassins-creed/mirage/photomode"
+
+    char *first_url = argv[first_arg + 1];
+
+    //Links followed from the starting URL; 0 fetches only the starting page.
+    config.depth_limit = atoi(argv[first_arg]);
+
+    if(config.depth_limit < 0){
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if(!start_logger(config.log_path, config.log_fsync_ms, config.log_full)){
+        return 1;
+    }
+
+    //Every exit path from here on, including the early error returns, flushes the log.
+    atexit(stop_logger);
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    xmlInitParser();
+    init_link_scanner();
+
+    if(!init_share()){
+        return 1;
+    }
+
+    //Aligned so the queue's hot counters really do get a cache line each.
+    struct URLQueue *url_q = (struct URLQueue *) aligned_alloc(CACHE_LINE, sizeof(struct URLQueue));
+    if (url_q == NULL || !initQueue(url_q)) {
+        append_to_log_file("Memory allocation failed\n");
+        return 1;
+    }
+
+    struct data_list *output = (struct data_list *)aligned_alloc(CACHE_LINE, sizeof(struct data_list)); // Initialize output structure
+    if (output == NULL || !initData(output)) { // Set head and tail to NULL initially
+        append_to_log_file("Memory allocation failed");
+        free(url_q);
+        return 1;
+    }
+
+    //A resumed crawl has seen the starting URL already, unless it never got past it.
+    if(config.state_dir != NULL && config.resume && !load_checkpoint(url_q, output)){
+        printf("Cannot resume from %s, see the log.\n", config.state_dir);
+        return 1;
+    }
+
+    //Before the first URL, so its host is looked up as it is queued.
+    if(config.dns_prefetch){
+
+        if(!start_dns_prefetch()){
+            printf("Cannot start the DNS resolver, see the log.\n");
+            return 1;
+        }
+
+        atexit(stop_dns_prefetch);
+    }
+
+    //Every node is given the starting URL; whichever owns its host crawls it.
+    if(config.cluster_file != NULL){
+
+        if(!start_cluster(url_q)){
+            printf("Cannot join the cluster, see the log.\n");
+            return 1;
+        }
+
+        atexit(stop_cluster);
+    }
+
+    enqueue_URL(&url_q, first_url, 0);
+
+    if(config.state_dir != NULL && !start_checkpointer(url_q, output)){
+        return 1;
+    }
+
+    if(config.warc_dir != NULL){
+
+        if(!start_warc_writer()){
+            printf("Cannot write WARC files to %s, see the log.\n", config.warc_dir);
+            return 1;
+        }
+
+        //Runs before stop_logger() at exit, so records still queued on an early return are kept.
+        atexit(stop_warc_writer);
+    }
+
+    if(config.target_count == 0 && !add_target("About")){
+        return 1;
+    }
+
+    //Compiled once; every worker shares it read-only.
+    ac_automaton *matcher = compile_matcher(config.targets, config.target_count, config.ignore_case, config.whole_word);
+
+    if(matcher == NULL){
+        printf("No usable targets.\n");
+        return 1;
+    }
+
+    if(config.near_duplicate_bits >= 0 && !init_near_dups()){
+        return 1;
+    }
+
+    if((config.stats_every > 0 || config.metrics_port > 0) && !start_metrics(url_q)){
+        printf("Cannot start metrics, see the log.\n");
+        return 1;
+    }
+
+    //Loaded once the targets are final, since the stored matches are only valid for the same ones.
+    if(config.validator_cache != NULL){
+
+        if(!load_validator_cache(config.validator_cache)){
+            printf("Cannot read the validator cache %s, see the log.\n", config.validator_cache);
+            return 1;
+        }
+
+        //A crawl that exits early, as after the --state-dir checkpoint on SIGTERM, still keeps what it learned.
+        atexit(save_validator_cache);
+    }
+
+
+    printf("We will scrape URL's that contain the following target%s.\n", config.target_count > 1 ? "s" : "");
+
+    for(int i = 0; i < config.target_count; i++){
+        printf("Target: %s\n", config.targets[i]);
+    }
+
+    //execute_crawl(url_q, output, target);
+
+
+    crawl_args args = {url_q, output, first_url, matcher};
+
+    if(config.parse_workers > 0 && !start_pipeline(&args)){
+        printf("Cannot start the parse workers, see the log.\n");
+        return 1;
+    }
+
+
+    if(config.async){
+
+        run_async_crawl(&args);
+    }
+
+    else {
+
+        pthread_t *threads = (pthread_t *) calloc(config.num_threads, sizeof(pthread_t));
+        int started = 0;
+
+        if(threads == NULL){
+            append_to_log_file("Memory allocation failed");
+            return 1;
+        }
+
+        //Create worker threads
+        for (int i = 0; i < config.num_threads; i++, started++) {
+            if (pthread_create(&threads[i], NULL, execute_crawl, &args) != 0){
+                append_to_log_file("Failed to create thread");
+                break;
+            }
+        }
+
+        atomic_store(&url_q->workers, started);
+        
+
+        //Join threads after completion.
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        free(threads);
+    }
+
+    //Every fetch thread is gone and the crawl is finished, so the parse queue is already empty.
+    stop_pipeline();
+
     if (output && output->head) { //Check if output and output->head are not NULL
         printOutput(output);
 
@@ -990,12 +11548,60 @@ int main(int argc, char *argv[]){
 
         printf("Output is empty\n");
     }
+
+    stop_host_timer(url_q);
+    stop_metrics();
+    stop_cluster();
+    stop_dns_prefetch();
+
+    if(config.state_dir != NULL){
+        stop_checkpointer(url_q, output);
+    }
+
+    stop_warc_writer();
+
+    if(config.validator_cache != NULL){
+        save_validator_cache();
+    }
+
+    report_seen_set(&url_q->seen);
+    report_url_arena();
+
+    if(config.near_duplicate_bits >= 0){
+        report_near_dups();
+    }
+
+    report_hosts(&url_q->hosts);
+
+    if(config.cluster_file != NULL){
+        report_cluster();
+    }
+
+    if(config.parse_workers > 0){
+        report_pipeline();
+    }
+
+    if(config.dns_prefetch){
+        report_dns();
+    }
     
     // Cleanup and program termination.
     // You may need to add additional cleanup logic here.
-    
+    cleanup_share();
+    curl_global_cleanup();
+
+    //Only once every fetch and parse thread is gone; libxml2's global state is shared by all of them.
+    xmlCleanupParser();
 
 
 
     return 0; 
-} 
\ No newline at end of file
+}
+
+
+#ifndef CRAWL_NO_MAIN
+int main(int argc, char *argv[]){
+
+    return run_crawler(argc, argv);
+}
+#endif